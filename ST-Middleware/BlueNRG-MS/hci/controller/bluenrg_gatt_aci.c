@@ -1503,3 +1503,31 @@ tBleStatus aci_gatt_update_char_value_ext_IDB05A1(uint16_t service_handle, uint1
   
   return status;
 }
+
+int aci_gatt_update_char_value_ext_async_IDB05A1(uint16_t service_handle, uint16_t char_handle,
+                                                 uint8_t update_type, uint16_t char_length,
+                                                 uint16_t value_offset, uint8_t value_length,
+                                                 const uint8_t* value, hci_status_cb cb, void *ctx)
+{
+  struct hci_request rq;
+  gatt_upd_char_val_ext_cp cp;
+  
+  if(value_length > sizeof(cp.value))
+    return -1;
+  
+  cp.service_handle = htobs(service_handle);
+  cp.char_handle = htobs(char_handle);
+  cp.update_type = update_type;
+  cp.char_length = htobs(char_length);
+  cp.value_offset = htobs(value_offset);
+  cp.value_length = value_length;
+  BLUENRG_memcpy(cp.value, value, value_length);
+  
+  BLUENRG_memset(&rq, 0, sizeof(rq));
+  rq.ogf = OGF_VENDOR_CMD;
+  rq.ocf = OCF_GATT_UPD_CHAR_VAL_EXT;
+  rq.cparam = &cp;
+  rq.clen = GATT_UPD_CHAR_VAL_EXT_CP_SIZE + value_length;
+  
+  return hci_send_req_async_status(&rq, cb, ctx);
+}
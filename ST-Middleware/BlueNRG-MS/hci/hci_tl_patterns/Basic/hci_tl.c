@@ -19,6 +19,7 @@
 #include "hci_const.h"
 #include "hci.h"
 #include "hci_tl.h"
+#include "bluenrg_def.h"
 
 #define HCI_LOG_ON                      0
 #define HCI_PCK_TYPE_OFFSET             0
@@ -28,18 +29,316 @@
  * Increase this parameter to overcome possible issues due to BLE devices crowded environment 
  * or high number of incoming notifications from peripheral devices 
  */
-#define HCI_READ_PACKET_NUM_MAX 	   (5)
+#define HCI_READ_PACKET_NUM_MAX 	   (3)
+
+/**
+ * Packets kept out of reach of unsolicited events: the ISR only uses the last
+ * free packet when a command response is expected.
+ */
+#define HCI_READ_PACKET_NUM_RESERVED (1)
+
+/**
+ * Small packets of HCI_READ_PACKET_SMALL_SIZE bytes, used for the short events
+ * when the IO bus provides ReceiveAlloc. With the defaults the pool takes the
+ * RAM of 6 packets of HCI_READ_PACKET_SIZE bytes and buffers 12 events.
+ */
+#ifndef HCI_READ_PACKET_SMALL_SIZE
+#define HCI_READ_PACKET_SMALL_SIZE   (32)
+#endif
+#ifndef HCI_READ_PACKET_SMALL_NUM_MAX
+#define HCI_READ_PACKET_SMALL_NUM_MAX (8)
+#endif
+
+#define HCI_READ_PACKET_LARGE_NUM    (HCI_READ_PACKET_NUM_MAX + HCI_READ_PACKET_NUM_RESERVED)
+#define HCI_READ_PACKET_TOTAL_NUM    (HCI_READ_PACKET_LARGE_NUM + HCI_READ_PACKET_SMALL_NUM_MAX)
+
+/**
+ * Slots of the packet rings, a power of two holding every read packet
+ */
+#define HCI_PKT_RING_SIZE            (16)
+#if (HCI_PKT_RING_SIZE < HCI_READ_PACKET_TOTAL_NUM) || (HCI_PKT_RING_SIZE & (HCI_PKT_RING_SIZE - 1))
+#error "HCI_PKT_RING_SIZE must be a power of two holding all the read packets"
+#endif
+
+#define HCI_CMD_PARAM_SIZE_MAX       (HCI_MAX_PAYLOAD_SIZE - HCI_HDR_SIZE - HCI_COMMAND_HDR_SIZE)
+
+/**
+ * Bytes of the events parked by hci_send_req() while the read packets are all
+ * taken by events ahead of its response, see evt_park(). Each event takes its
+ * length plus 4 to 7 bytes. By default the largest event only: a longer run
+ * of events ahead of the response makes the request time out.
+ */
+#define HCI_EVT_PARK_HDR_SIZE        (4)
+#define HCI_EVT_PARK_REC_SIZE(len)   ((HCI_EVT_PARK_HDR_SIZE + (len) + 3) & ~3)
+#ifndef HCI_EVT_PARK_SIZE
+#define HCI_EVT_PARK_SIZE            HCI_EVT_PARK_REC_SIZE(HCI_READ_PACKET_SIZE)
+#endif
+#if HCI_EVT_PARK_SIZE < HCI_EVT_PARK_REC_SIZE(HCI_READ_PACKET_SIZE)
+#error "HCI_EVT_PARK_SIZE must hold the largest event"
+#endif
+
+/**
+ * Maximum number of commands parked while the controller cannot take them
+ * (the IO bus returned HCI_IO_BUSY). Each one keeps a copy of the packet.
+ * More than one lets the asynchronous requests go on while the controller is
+ * busy, and go out together in one transfer.
+ */
+#ifndef HCI_TX_QUEUE_LEN
+#define HCI_TX_QUEUE_LEN             (1)
+#endif
+
+/**
+ * Timeout passed to hci_cmd_resp_wait() while commands are parked or the
+ * reads paused: they are retried when it returns, no interrupt says when.
+ */
+#define HCI_RETRY_PERIOD_MS          (1)
+
+/**
+ * HCI capture ring, exported by hci_snoop_dump(): the last HCI_SNOOP_RING_SIZE
+ * commands and events, the first HCI_SNOOP_SNAPLEN bytes of each. Undefined,
+ * the capture is compiled out.
+ */
+#ifdef HCI_SNOOP_RING_SIZE
+#ifndef HCI_SNOOP_SNAPLEN
+#define HCI_SNOOP_SNAPLEN            (32)
+#endif
+#endif
+
+/**
+ * Check of the calling contract, see hci_select(): define it in bluenrg_conf.h
+ * (e.g. as assert_param) to stop on an instance switched under a waiting
+ * request. Undefined, the request fails (tHciStats.reqInstanceSwitched).
+ */
+#ifndef HCI_ASSERT
+#define HCI_ASSERT(expr)             ((void)0)
+#endif
 
 #define MIN(a,b)      ((a) < (b))? (a) : (b)
 #define MAX(a,b)      ((a) > (b))? (a) : (b)
 
-tListNode             hciReadPktPool;
-tListNode             hciReadPktRxQueue;
-static tHciDataPacket hciReadPacketBuffer[HCI_READ_PACKET_NUM_MAX];
-static tHciContext    hciContext;
+/**
+ * @brief Single producer / single consumer ring of packets.
+ *        Each index is only written by one side, so no interrupt masking
+ *        is needed between the ISR and the main loop:
+ *        - readPktRxQueue: ISR -> hci_user_evt_proc()
+ *        - readPktPool, readPktPoolSmall: main loop -> ISR
+ */
+typedef struct
+{
+  volatile uint16_t head;  /**< Written by the producer only */
+  volatile uint16_t tail;  /**< Written by the consumer only */
+  tHciDataPacket   *slot[HCI_PKT_RING_SIZE];
+} tHciPktRing;
+
+#ifdef HCI_SNOOP_RING_SIZE
+/**
+ * @brief Captured packet, flags as in btsnoop
+ */
+typedef struct
+{
+  uint32_t tsUs;
+  uint16_t len;      /**< Length of the packet */
+  uint8_t  flags;    /**< Bit 0: received, bit 1: command or event */
+  uint8_t  inclLen;  /**< Bytes kept in data */
+  uint8_t  data[HCI_SNOOP_SNAPLEN];
+} tHciSnoopRec;
+
+#define HCI_SNOOP_FLAG_SENT_CMD  (0x02)
+#define HCI_SNOOP_FLAG_RECV_EVT  (0x03)
+
+static void snoop_put(uint8_t flags, const tHciIOVec *iov, uint8_t iovcnt);
+#define HCI_SNOOP(flags, iov, iovcnt)  snoop_put((flags), (iov), (iovcnt))
+#else
+#define HCI_SNOOP(flags, iov, iovcnt)
+#endif
+
+/**
+ * @brief Command packet parked in the transmit queue
+ */
+typedef struct
+{
+  uint32_t tickstart;
+  uint16_t len;
+  uint8_t  data[HCI_MAX_PAYLOAD_SIZE];
+} tHciTxFrame;
+
+/**
+ * @brief Asynchronous request slot
+ */
+typedef enum
+{
+  HCI_ASYNC_FREE = 0,
+  HCI_ASYNC_QUEUED,  /**< Waiting for a command credit */
+  HCI_ASYNC_SENT,    /**< Sent, waiting for command complete/status */
+  HCI_ASYNC_DONE,    /**< Response received by the ISR, callback pending */
+  HCI_ASYNC_FAILED,  /**< Not sent (IO error), callback pending */
+} tHciAsyncState;
+
+typedef struct
+{
+  volatile uint8_t state;
+  uint16_t         opcode;
+  uint8_t          clen;
+  uint16_t         token;
+  uint32_t         seq;
+  uint32_t         sendSeq;  /**< Send order, shared with the synchronous requests */
+  uint32_t         tickstart;
+  hci_cmd_cb       cb;
+  hci_status_cb    statusCb; /**< Instead of cb, see hci_send_req_async_status() */
+  void            *ctx;
+  tHciDataPacket  *resp;
+  uint8_t          cparam[HCI_CMD_PARAM_SIZE_MAX];
+} tHciAsyncReq;
+
+
+/**
+ * @brief Synchronous request waiting in hci_send_req()
+ */
+typedef enum
+{
+  HCI_SYNC_IDLE = 0,
+  HCI_SYNC_WAIT_CMD,  /**< Waiting for command complete/status */
+  HCI_SYNC_WAIT_EVT,  /**< Command status received, waiting for the LE meta subevent */
+  HCI_SYNC_DONE,      /**< Response handed over by the ISR */
+} tHciSyncState;
+
+typedef struct
+{
+  volatile uint8_t         state;
+  uint16_t                 opcode;
+  uint32_t                 event;
+  uint32_t                 sendSeq;  /**< Send order, see tHciAsyncReq */
+  tHciDataPacket * volatile resp;
+} tHciSyncReq;
+
+/**
+ * @brief State of one HCI instance (one BlueNRG), selected by hci_select()
+ */
+typedef struct
+{
+  tHciContext       context;
+  tHciPktRing       readPktPool;
+  tHciPktRing       readPktPoolSmall;
+  tHciPktRing       readPktRxQueue;
+  /* Large packets first, then the small ones */
+  tHciDataPacket    readPacketBuffer[HCI_READ_PACKET_TOTAL_NUM];
+  uint8_t           readPacketLargeData[HCI_READ_PACKET_LARGE_NUM][HCI_READ_PACKET_SIZE];
+  uint8_t           readPacketSmallData[HCI_READ_PACKET_SMALL_NUM_MAX][HCI_READ_PACKET_SMALL_SIZE];
+  tHciDataPacket   *rxPacket;
+  uint8_t           rxStarved;
+  volatile uint8_t  rxPending;
+  volatile uint8_t  rxPaused;
+  volatile uint16_t rxPausedLen;
+  tHciStats         stats;
+  /* Only used from the main loop: send_cmd() parks, hci_tx_flush() sends */
+  tHciTxFrame       txQueue[HCI_TX_QUEUE_LEN];
+  uint8_t           txHead;
+  uint8_t           txCount;
+  /* Free space of the controller write buffer, see hci_notify_tx_space() */
+  volatile uint16_t txSpace;
+  tHciAsyncReq      asyncReq[HCI_ASYNC_REQ_NUM_MAX];
+  uint32_t          asyncSeq;
+  /* Commands sent by the requests, for the order of their responses */
+  uint32_t          sendSeq;
+  tHciSyncReq       syncReq;
+  /* Events parked by hci_send_req(), handed to the application first */
+  uint8_t           evtPark[HCI_EVT_PARK_SIZE];
+  uint16_t          evtParkHead;
+  uint16_t          evtParkTail;
+  /* Set by hci_cmd_resp_release(), see hci_cmd_resp_wait() */
+  volatile uint32_t cmdRespFlag;
+#ifdef HCI_SNOOP_RING_SIZE
+  tHciSnoopRec      snoopRing[HCI_SNOOP_RING_SIZE];
+  uint32_t          snoopCount;  /**< Packets captured since hci_init() */
+#endif
+} tHciInstance;
+
+static tHciInstance  hciInstance[HCI_NUM_INSTANCES];
+/* Selected instance: the ISRs switch to theirs and back */
+static tHciInstance *hci = &hciInstance[0];
 
 /************************* Static internal functions **************************/
 
+/**
+  * @brief  Reset a packet ring. Only when neither side is running.
+  *
+  * @param  ring The packet ring
+  * @retval None
+  */
+static void ring_init(tHciPktRing * ring)
+{
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/**
+  * @brief  Number of packets in a packet ring.
+  *
+  * @param  ring The packet ring
+  * @retval Number of packets
+  */
+static uint16_t ring_count(const tHciPktRing * ring)
+{
+  return (uint16_t)(ring->head - ring->tail);
+}
+
+/**
+  * @brief  Add a packet to a packet ring (producer side). The rings hold all
+  *         the read packets so they are never full.
+  *
+  * @param  ring The packet ring
+  * @param  hciReadPacket The HCI data packet
+  * @retval None
+  */
+static void ring_put(tHciPktRing * ring, tHciDataPacket * hciReadPacket)
+{
+  uint16_t head = ring->head;
+  
+  ring->slot[head & (HCI_PKT_RING_SIZE - 1)] = hciReadPacket;
+  /* Publish the slot before the index */
+  __DMB();
+  ring->head = head + 1;
+}
+
+/**
+  * @brief  Remove the oldest packet from a packet ring (consumer side).
+  *
+  * @param  ring The packet ring
+  * @retval The packet, NULL if the ring is empty
+  */
+static tHciDataPacket *ring_get(tHciPktRing * ring)
+{
+  uint16_t tail = ring->tail;
+  tHciDataPacket *hciReadPacket;
+  
+  if (tail == ring->head)
+  {
+    return NULL;
+  }
+  hciReadPacket = ring->slot[tail & (HCI_PKT_RING_SIZE - 1)];
+  /* Read the slot before releasing it to the producer */
+  __DMB();
+  ring->tail = tail + 1;
+  
+  return hciReadPacket;
+}
+
+/**
+  * @brief  Give back the packet just removed with ring_get() (consumer side),
+  *         before the producer had a chance to run.
+  *
+  * @param  ring The packet ring
+  * @param  hciReadPacket The HCI data packet
+  * @retval None
+  */
+static void ring_unget(tHciPktRing * ring, tHciDataPacket * hciReadPacket)
+{
+  uint16_t tail = ring->tail - 1;
+  
+  ring->slot[tail & (HCI_PKT_RING_SIZE - 1)] = hciReadPacket;
+  ring->tail = tail;
+}
+
 /**
   * @brief  Verify the packet type.
   *
@@ -60,298 +359,1425 @@ static int verify_packet(const tHciDataPacket * hciReadPacket)
 }
 
 /**
-  * @brief  Send an HCI command.
+  * @brief  Write packets on the IO bus, gathered from their segments. Send
+  *         only takes a single packet.
+  *
+  * @param  iov The packet segments
+  * @param  iovcnt The number of segments
+  * @retval Number of segments written (whole packets), HCI_IO_BUSY: the
+  *         controller cannot take the first packet now, other < 0: error
+  */
+static int32_t tx_write(const tHciIOVec *iov, uint8_t iovcnt)
+{
+  uint8_t payload[HCI_MAX_PAYLOAD_SIZE];
+  uint16_t len = 0;
+  int32_t ret;
+  uint8_t i;
+  
+  if (hci->context.io.SendV)
+  {
+    return hci->context.io.SendV (iov, iovcnt);
+  }
+  if (hci->context.io.Send == NULL)
+  {
+    return -1;
+  }
+  if (iovcnt == 1)
+  {
+    ret = hci->context.io.Send ((uint8_t *)iov[0].data, iov[0].len);
+    return (ret == 0) ? 1 : ret;
+  }
+  for (i = 0; i < iovcnt; i++)
+  {
+    if (len + iov[i].len > sizeof(payload))
+    {
+      return -1;
+    }
+    BLUENRG_memcpy(payload + len, iov[i].data, iov[i].len);
+    len += iov[i].len;
+  }
+  ret = hci->context.io.Send (payload, len);
+  return (ret == 0) ? iovcnt : ret;
+}
+
+/**
+  * @brief  Copy a packet at the end of the transmit queue.
+  *
+  * @param  iov The packet segments
+  * @param  iovcnt The number of segments
+  * @retval 0: parked, -1: queue full
+  */
+static int tx_park(const tHciIOVec *iov, uint8_t iovcnt)
+{
+  tHciTxFrame *frame;
+  uint8_t i;
+  
+  if (hci->txCount == HCI_TX_QUEUE_LEN)
+  {
+    return -1;
+  }
+  frame = &hci->txQueue[(hci->txHead + hci->txCount) % HCI_TX_QUEUE_LEN];
+  frame->len = 0;
+  for (i = 0; i < iovcnt; i++)
+  {
+    BLUENRG_memcpy(frame->data + frame->len, iov[i].data, iov[i].len);
+    frame->len += iov[i].len;
+  }
+  frame->tickstart = HAL_GetTick();
+  hci->txCount++;
+  hci->stats.txParked++;
+  return 0;
+}
+
+/**
+  * @brief  Send the parked commands, oldest first, until the controller is
+  *         busy again. With SendV, the commands fitting in the controller
+  *         write buffer go out back to back in a single transfer. A command
+  *         parked for longer than the command timeout is dropped: its
+  *         request has already failed.
+  *
+  * @param  None
+  * @retval None
+  */
+static void hci_tx_flush(void)
+{
+  tHciIOVec iov[HCI_TX_QUEUE_LEN];
+  tHciTxFrame *frame;
+  int32_t sent;
+  uint8_t count;
+  
+  while (hci->txCount > 0)
+  {
+    if ((HAL_GetTick() - hci->txQueue[hci->txHead].tickstart) > HCI_DEFAULT_TIMEOUT_MS)
+    {
+      hci->txHead = (hci->txHead + 1) % HCI_TX_QUEUE_LEN;
+      hci->txCount--;
+      continue;
+    }
+    
+    for (count = 0; count < hci->txCount; count++)
+    {
+      frame = &hci->txQueue[(hci->txHead + count) % HCI_TX_QUEUE_LEN];
+      iov[count].data = frame->data;
+      iov[count].len  = frame->len;
+      iov[count].eop  = 1;
+      if (hci->context.io.SendV == NULL)
+      {
+        count++;
+        break;
+      }
+    }
+    
+    sent = tx_write(iov, count);
+    if (sent == HCI_IO_BUSY)
+    {
+      return;
+    }
+    if (sent <= 0)
+    {
+      /* IO error: the command is lost, its request will time out */
+      sent = 1;
+    }
+    hci->stats.txCoalesced += sent - 1;
+    hci->txHead = (hci->txHead + sent) % HCI_TX_QUEUE_LEN;
+    hci->txCount -= sent;
+  }
+}
+
+/**
+  * @brief  Send an HCI command. It never waits for the controller: when its
+  *         write buffer is not ready the command is parked and sent by
+  *         hci_tx_flush() on a later IRQ or tick. The callers make sure the
+  *         transmit queue has room, see hci_tx_room(). A command neither
+  *         written nor parked gives its command credit back.
   *
   * @param  ogf The Opcode Group Field
   * @param  ocf The Opcode Command Field
   * @param  plen The HCI command length
   * @param  param The HCI command parameters
-  * @retval None
+  * @retval 0: written or parked, -1: IO error or transmit queue full
   */
-static void send_cmd(uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
+static int send_cmd(uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
 {
-  uint8_t payload[HCI_MAX_PAYLOAD_SIZE];  
+  uint8_t header[HCI_HDR_SIZE + HCI_COMMAND_HDR_SIZE];
+  tHciIOVec iov[2];
   hci_command_hdr hc;
+  uint8_t iovcnt = (plen > 0) ? 2 : 1;
+  uint8_t credit = 0;
+  int32_t sent = HCI_IO_BUSY;
   
   hc.opcode = htobs(cmd_opcode_pack(ogf, ocf));
   hc.plen = plen;
 
-  payload[0] = HCI_COMMAND_PKT;
-  BLUENRG_memcpy(payload + 1, &hc, sizeof(hc));
-  BLUENRG_memcpy(payload + HCI_HDR_SIZE + HCI_COMMAND_HDR_SIZE, param, plen);
+  header[0] = HCI_COMMAND_PKT;
+  BLUENRG_memcpy(header + 1, &hc, sizeof(hc));
+  
+  /* Consume a command credit, given back by the next command complete/status */
+  uint32_t uwPRIMASK_Bit = __get_PRIMASK();
+  __disable_irq();
+  if (hci->context.cmdCredits > 0)
+  {
+    hci->context.cmdCredits--;
+    credit = 1;
+  }
+  __set_PRIMASK(uwPRIMASK_Bit);
+  
+  /* The parameters go out from the caller buffer, behind the header */
+  iov[0].data = header;
+  iov[0].len  = sizeof(header);
+  iov[0].eop  = (plen == 0);
+  iov[1].data = param;
+  iov[1].len  = plen;
+  iov[1].eop  = 1;
+  
+  /* Keep the order: behind the commands still parked */
+  hci_tx_flush();
+  if (hci->txCount == 0)
+  {
+    sent = tx_write(iov, iovcnt);
+  }
+  if ((sent == HCI_IO_BUSY) && (tx_park(iov, iovcnt) == 0))
+  {
+    sent = iovcnt;
+  }
+  if (sent <= 0)
+  {
+    /* No command complete/status will give the credit back */
+    uwPRIMASK_Bit = __get_PRIMASK();
+    __disable_irq();
+    hci->context.cmdCredits += credit;
+    __set_PRIMASK(uwPRIMASK_Bit);
+    return -1;
+  }
+  HCI_SNOOP(HCI_SNOOP_FLAG_SENT_CMD, iov, iovcnt);
+  return 0;
+}
+
+/**
+  * @brief  Tell if the transmit queue can take one more command.
+  *
+  * @param  None
+  * @retval 1: room for a command, 0: queue full
+  */
+static int hci_tx_room(void)
+{
+  return (hci->txCount < HCI_TX_QUEUE_LEN);
+}
+
+/**
+  * @brief  Tell if a command response is expected, either by hci_send_req()
+  *         or by an asynchronous request in flight.
+  *
+  * @param  None
+  * @retval 1: response expected, 0: otherwise
+  */
+static int cmd_resp_expected(void)
+{
+  uint8_t index;
+  
+  if (hci->syncReq.state != HCI_SYNC_IDLE)
+  {
+    return 1;
+  }
+  for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+  {
+    if (hci->asyncReq[index].state == HCI_ASYNC_SENT)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  * @brief  Pool of the size class of a packet.
+  *
+  * @param  hciReadPacket The HCI data packet
+  * @retval The packet pool
+  */
+static tHciPktRing *read_pkt_pool(const tHciDataPacket * hciReadPacket)
+{
+  if (hciReadPacket < &hci->readPacketBuffer[HCI_READ_PACKET_LARGE_NUM])
+  {
+    return &hci->readPktPool;
+  }
+  return &hci->readPktPoolSmall;
+}
+
+/**
+  * @brief  Give a packet back to the pool of its size class.
+  *         Main loop only: the ISR is the consumer of the pools.
+  *
+  * @param  hciReadPacket The HCI data packet
+  * @retval None
+  */
+static void free_read_pkt(tHciDataPacket * hciReadPacket)
+{
+  ring_put(read_pkt_pool(hciReadPacket), hciReadPacket);
+}
+
+/**
+  * @brief  Give back the packet the ISR has just taken and does not queue.
+  *
+  * @param  hciReadPacket The HCI data packet
+  * @retval None
+  */
+static void drop_read_pkt(tHciDataPacket * hciReadPacket)
+{
+  ring_unget(read_pkt_pool(hciReadPacket), hciReadPacket);
+}
+
+/**
+  * @brief  Tell if the ISR can take a large packet from the pool. The last
+  *         free one is only taken while a command response is expected, for
+  *         the response or for an event ahead of it (hci_send_req() then
+  *         parks the events to reach the response).
+  *
+  * @param  None
+  * @retval 1: a packet can be read, 0: otherwise
+  */
+static int large_pkt_available(void)
+{
+  uint16_t count = ring_count(&hci->readPktPool);
+  
+  if (count > HCI_READ_PACKET_NUM_RESERVED)
+  {
+    return 1;
+  }
+  return (count > 0) && cmd_resp_expected();
+}
+
+/**
+  * @brief  Tell if the ISR can take a packet of any size class.
+  *
+  * @param  None
+  * @retval 1: a packet can be read, 0: otherwise
+  */
+static int read_pkt_available(void)
+{
+  return (ring_count(&hci->readPktPoolSmall) > 0) || large_pkt_available();
+}
+
+/**
+  * @brief  Tell if a packet holding size bytes can be read.
+  *
+  * @param  size Packet length
+  * @retval 1: a packet can be read, 0: otherwise
+  */
+static int read_pkt_fits(uint16_t size)
+{
+  if ((size <= HCI_READ_PACKET_SMALL_SIZE) && (ring_count(&hci->readPktPoolSmall) > 0))
+  {
+    return 1;
+  }
+  return large_pkt_available();
+}
+
+/**
+  * @brief  Update the pool low-water marks after the ISR took a packet.
+  *
+  * @param  None
+  * @retval None
+  */
+static void read_pkt_watermarks(void)
+{
+  uint16_t count = ring_count(&hci->readPktPool);
+  
+  if (count < hci->stats.poolFreeMin)
+  {
+    hci->stats.poolFreeMin = count;
+  }
+  count = ring_count(&hci->readPktPoolSmall);
+  if (count < hci->stats.poolSmallFreeMin)
+  {
+    hci->stats.poolSmallFreeMin = count;
+  }
+}
+
+/**
+  * @brief  Pause the reads: the packet of size bytes stays in the BlueNRG
+  *         until hci_resume_flow() finds a packet for it. A request waiting
+  *         meanwhile is woken up, it is the one freeing the packets.
+  *
+  * @param  size Length of the packet waiting in the BlueNRG
+  * @retval None
+  */
+static void read_flow_pause(uint16_t size)
+{
+  hci->rxPausedLen = size;
+  if (hci->rxPaused == 0)
+  {
+    hci->rxPaused = 1;
+    hci->stats.rxPaused++;
+    hci_cmd_resp_release(1);
+  }
+}
+
+/**
+  * @brief  Take the smallest free packet holding size bytes (or the largest
+  *         one, the IO bus truncates the packet). Called from the ISR through
+  *         the ReceiveAlloc IO function.
+  *
+  * @param  size In: packet length, out: size of the returned buffer
+  * @retval Packet buffer, NULL if no packet is free for that length
+  */
+static uint8_t *read_pkt_alloc(uint16_t *size)
+{
+  hci->rxPacket = NULL;
+  if (*size <= HCI_READ_PACKET_SMALL_SIZE)
+  {
+    hci->rxPacket = ring_get(&hci->readPktPoolSmall);
+  }
+  if ((hci->rxPacket == NULL) && large_pkt_available())
+  {
+    hci->rxPacket = ring_get(&hci->readPktPool);
+  }
+  if (hci->rxPacket == NULL)
+  {
+    hci->rxStarved = 1;
+    read_flow_pause(*size);
+    return NULL;
+  }
+  *size = hci->rxPacket->bufSize;
+  
+  return hci->rxPacket->dataBuff;
+}
+
+/**
+  * @brief  Hand a packet to the synchronous request if it is the awaited
+  *         response. Called from the ISR.
+  *
+  * @param  hciReadPacket The HCI data packet
+  * @param  opcode Opcode of a command complete/status, 0 for other events
+  * @retval 1: packet taken, 0: otherwise
+  */
+static int sync_resp_demux(tHciDataPacket * hciReadPacket, uint16_t opcode)
+{
+  hci_event_pckt *event_pckt = (void *)(hciReadPacket->dataBuff + HCI_HDR_SIZE);
   
-  if (hciContext.io.Send)
+  switch (event_pckt->evt)
   {
-    hciContext.io.Send (payload, HCI_HDR_SIZE + HCI_COMMAND_HDR_SIZE + plen);
+  case EVT_CMD_STATUS:
+    if ((hci->syncReq.state != HCI_SYNC_WAIT_CMD) || (opcode != hci->syncReq.opcode))
+      return 0;
+    if ((hci->syncReq.event != EVT_CMD_STATUS) && (((evt_cmd_status *)event_pckt->data)->status == 0))
+    {
+      /* Command accepted: the response is the LE meta subevent */
+      drop_read_pkt(hciReadPacket);
+      hci->syncReq.state = HCI_SYNC_WAIT_EVT;
+      return 1;
+    }
+    break;
+    
+  case EVT_CMD_COMPLETE:
+    if ((hci->syncReq.state != HCI_SYNC_WAIT_CMD) || (opcode != hci->syncReq.opcode))
+      return 0;
+    break;
+    
+  case EVT_LE_META_EVENT:
+    if ((hci->syncReq.state == HCI_SYNC_IDLE) || (hci->syncReq.state == HCI_SYNC_DONE))
+      return 0;
+    if (((evt_le_meta_event *)event_pckt->data)->subevent != hci->syncReq.event)
+      return 0;
+    break;
+    
+  case EVT_HARDWARE_ERROR:
+    if ((hci->syncReq.state == HCI_SYNC_IDLE) || (hci->syncReq.state == HCI_SYNC_DONE))
+      return 0;
+    break;
+    
+  default:
+    return 0;
+  }
+  
+  hci->syncReq.resp  = hciReadPacket;
+  hci->syncReq.state = HCI_SYNC_DONE;
+  return 1;
+}
+
+/**
+  * @brief  Route a received packet: command completions go straight to the
+  *         request waiting for them (the one sent first with the same opcode,
+  *         asynchronous or hci_send_req()), everything else is left to the
+  *         application. Also updates the command credits. Called from the ISR.
+  *
+  * @param  hciReadPacket The HCI data packet
+  * @retval 1: packet taken by a request, 0: otherwise
+  */
+static int cmd_resp_demux(tHciDataPacket * hciReadPacket)
+{
+  hci_event_pckt *event_pckt = (void *)(hciReadPacket->dataBuff + HCI_HDR_SIZE);
+  tHciAsyncReq *req = NULL;
+  uint16_t opcode;
+  uint8_t index;
+  
+  if (event_pckt->evt == EVT_CMD_COMPLETE)
+  {
+    evt_cmd_complete *cc = (void *)event_pckt->data;
+    hci->context.cmdCredits = cc->ncmd;
+    opcode = cc->opcode;
+  }
+  else if (event_pckt->evt == EVT_CMD_STATUS)
+  {
+    evt_cmd_status *cs = (void *)event_pckt->data;
+    hci->context.cmdCredits = cs->ncmd;
+    opcode = cs->opcode;
+  }
+  else
+  {
+    return sync_resp_demux(hciReadPacket, 0);
+  }
+  
+  for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+  {
+    tHciAsyncReq *r = &hci->asyncReq[index];
+    if ((r->state == HCI_ASYNC_SENT) && (r->opcode == opcode) &&
+        ((req == NULL) || ((int32_t)(r->sendSeq - req->sendSeq) < 0)))
+    {
+      req = r;
+    }
+  }
+  if ((req == NULL) ||
+      ((hci->syncReq.state == HCI_SYNC_WAIT_CMD) && (hci->syncReq.opcode == opcode) &&
+       ((int32_t)(hci->syncReq.sendSeq - req->sendSeq) < 0)))
+  {
+    return sync_resp_demux(hciReadPacket, opcode);
+  }
+  req->resp  = hciReadPacket;
+  req->state = HCI_ASYNC_DONE;
+  return 1;
+}
+
+/**
+  * @brief  Run the reads left to the bottom half (bnrgm0_hw_t.rx_budget_pkts)
+  *         and the parked commands, and sleep until the ISR signals something
+  *         only when no read is left.
+  *
+  * @param  timeout Waiting timeout in ms
+  * @retval None
+  */
+static void hci_rx_wait(uint32_t timeout)
+{
+  if (hci_tl_lowlevel_bottom_half() != 0)
+  {
+    return;
+  }
+  
+  /* The parked commands are retried on the next tick, and so are the paused
+     reads: the BlueNRG gives no edge to wake the core meanwhile */
+  hci_tx_flush();
+  if (((hci->txCount > 0) || hci->rxPaused) && (timeout > HCI_RETRY_PERIOD_MS))
+  {
+    timeout = HCI_RETRY_PERIOD_MS;
+  }
+  hci_cmd_resp_wait(timeout);
+}
+
+/**
+  * @brief  Wait for a command credit and room in the transmit queue.
+  *
+  * @param  None
+  * @retval 0: credit available, -1: timeout
+  */
+static int wait_cmd_credit(void)
+{
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t elapsed;
+  
+  while ((hci->context.cmdCredits == 0) || (hci_tx_room() == 0))
+  {
+    elapsed = HAL_GetTick() - tickstart;
+    if (elapsed > HCI_DEFAULT_TIMEOUT_MS)
+    {
+      /* The controller did not give the credit back: recover it */
+      hci->context.cmdCredits = 1;
+      return -1;
+    }
+    hci_rx_wait(HCI_DEFAULT_TIMEOUT_MS - elapsed);
+  }
+  return 0;
+}
+
+/**
+  * @brief  Send the queued asynchronous requests, oldest first, as long as
+  *         the controller gives command credits and the transmit queue
+  *         has room.
+  *
+  * @param  None
+  * @retval None
+  */
+static void async_req_pump(void)
+{
+  tHciAsyncReq *req;
+  uint8_t index;
+  
+  while ((hci->context.cmdCredits > 0) && hci_tx_room())
+  {
+    req = NULL;
+    for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+    {
+      tHciAsyncReq *r = &hci->asyncReq[index];
+      if ((r->state == HCI_ASYNC_QUEUED) &&
+          ((req == NULL) || ((int32_t)(r->seq - req->seq) < 0)))
+      {
+        req = r;
+      }
+    }
+    if (req == NULL)
+    {
+      return;
+    }
+    req->tickstart = HAL_GetTick();
+    req->sendSeq = hci->sendSeq++;
+    req->state = HCI_ASYNC_SENT;
+    if (send_cmd(cmd_opcode_ogf(req->opcode), cmd_opcode_ocf(req->opcode), req->clen, req->cparam) < 0)
+    {
+      /* The callback runs from async_req_proc(), not from the submission */
+      req->state = HCI_ASYNC_FAILED;
+      return;
+    }
+  }
+}
+
+/**
+  * @brief  Run the callback of an asynchronous request.
+  *
+  * @param  req The request
+  * @param  rparam The return parameters, NULL if the request failed
+  * @param  rlen The length of the return parameters
+  * @retval None
+  */
+static void async_req_complete(tHciAsyncReq *req, const uint8_t *rparam, uint16_t rlen)
+{
+  if (req->statusCb != NULL)
+  {
+    req->statusCb(req->token, (rparam != NULL) ? rparam[0] : BLE_STATUS_TIMEOUT, req->ctx);
+  }
+  else if (req->cb != NULL)
+  {
+    req->cb(req->token, rparam, rlen, req->ctx);
+  }
+}
+
+/**
+  * @brief  Run the callbacks of the completed asynchronous requests and
+  *         expire the ones whose response did not come in time.
+  *
+  * @param  None
+  * @retval None
+  */
+static void async_req_proc(void)
+{
+  uint32_t uwPRIMASK_Bit;
+  uint8_t expired;
+  uint8_t index;
+  
+  for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+  {
+    tHciAsyncReq *req = &hci->asyncReq[index];
+    
+    expired = 0;
+    if ((req->state == HCI_ASYNC_SENT) &&
+        ((HAL_GetTick() - req->tickstart) > HCI_DEFAULT_TIMEOUT_MS))
+    {
+      /* Expire it with the ISR masked: a response handed over meanwhile
+         is delivered below, with the credit it carried */
+      uwPRIMASK_Bit = __get_PRIMASK();
+      __disable_irq();
+      if (req->state == HCI_ASYNC_SENT)
+      {
+        /* The response never came: release the slot and recover the credit */
+        req->state = HCI_ASYNC_FREE;
+        expired = 1;
+        if (hci->context.cmdCredits == 0)
+        {
+          hci->context.cmdCredits = 1;
+        }
+      }
+      __set_PRIMASK(uwPRIMASK_Bit);
+    }
+    
+    if (req->state == HCI_ASYNC_DONE)
+    {
+      hci_event_pckt *event_pckt = (void *)(req->resp->dataBuff + HCI_HDR_SIZE);
+      uint8_t *ptr = event_pckt->data;
+      uint16_t len = event_pckt->plen;
+      
+      if (event_pckt->evt == EVT_CMD_COMPLETE)
+      {
+        ptr += EVT_CMD_COMPLETE_SIZE;
+        len -= EVT_CMD_COMPLETE_SIZE;
+      }
+      else
+      {
+        /* Command status: only the status byte */
+        len = 1;
+      }
+      async_req_complete(req, ptr, len);
+      free_read_pkt(req->resp);
+      req->resp  = NULL;
+      req->state = HCI_ASYNC_FREE;
+    }
+    else if ((req->state == HCI_ASYNC_FAILED) || expired)
+    {
+      req->state = HCI_ASYNC_FREE;
+      async_req_complete(req, NULL, 0);
+    }
   }
+  
+  async_req_pump();
 }
 
 /**
-  * @brief  Remove the tail from a source list and insert it to the head 
-  *         of a destination list.
+  * @brief  Move the events read to the park, oldest first, to give their
+  *         packets back to the pool. Called by hci_send_req() when the events
+  *         fill the read packets while it waits: the controller delivers in
+  *         order, its response is behind them.
   *
-  * @param  dest_list
-  * @param  src_list
+  * @param  None
   * @retval None
   */
-static void move_list(tListNode * dest_list, tListNode * src_list)
+static void evt_park(void)
 {
-  pListNode tmp_node;
+  tHciDataPacket * hciReadPacket;
+  uint16_t size;
   
-  while (!list_is_empty(src_list))
+  while ((hciReadPacket = ring_get(&hci->readPktRxQueue)) != NULL)
   {
-    list_remove_tail(src_list, &tmp_node);
-    list_insert_head(dest_list, tmp_node);
+    size = HCI_EVT_PARK_REC_SIZE(hciReadPacket->data_len);
+    if (hci->evtParkTail + size > HCI_EVT_PARK_SIZE)
+    {
+      /* Park full: the request waits for its timeout */
+      ring_unget(&hci->readPktRxQueue, hciReadPacket);
+      return;
+    }
+    hci->evtPark[hci->evtParkTail] = hciReadPacket->data_len;
+    BLUENRG_memcpy(&hci->evtPark[hci->evtParkTail + HCI_EVT_PARK_HDR_SIZE], hciReadPacket->dataBuff,
+                   hciReadPacket->data_len);
+    hci->evtParkTail += size;
+    hci->stats.rxEvtParked++;
+    free_read_pkt(hciReadPacket);
   }
 }
 
 /**
-  * @brief  Free the HCI event list.
+  * @brief  Hand the events to the application: the parked ones first, they
+  *         were read before the queued ones. Called by hci_user_evt_proc().
+  *         A parked event cannot be retained, see hci_evt_retain().
   *
   * @param  None
   * @retval None
   */
-static void free_event_list(void)
+static void hci_evt_dispatch(void)
 {
-  tHciDataPacket * pckt;
+  tHciDataPacket * hciReadPacket;
+  uint8_t *rec;
+  
+  for (;;)
+  {
+    if (hci->evtParkHead != hci->evtParkTail)
+    {
+      rec = &hci->evtPark[hci->evtParkHead];
+      hci->evtParkHead += HCI_EVT_PARK_REC_SIZE(rec[0]);
+      if (hci->context.UserEvtRx != NULL)
+      {
+        hci->context.UserEvtRx(rec + HCI_EVT_PARK_HDR_SIZE);
+      }
+      /* A request sent by the callback can park more events behind */
+      if (hci->evtParkHead == hci->evtParkTail)
+      {
+        hci->evtParkHead = 0;
+        hci->evtParkTail = 0;
+      }
+      continue;
+    }
+    
+    hciReadPacket = ring_get(&hci->readPktRxQueue);
+    if (hciReadPacket == NULL)
+    {
+      break;
+    }
+    /* The callback can retain the packet, it is freed with the last reference */
+    hciReadPacket->refCount = 1;
+    if (hci->context.UserEvtRx != NULL)
+    {
+      hci->context.UserEvtRx(hciReadPacket->dataBuff);
+    }
 
-  while(list_get_size(&hciReadPktPool) < HCI_READ_PACKET_NUM_MAX/2){
-    list_remove_head(&hciReadPktRxQueue, (tListNode **)&pckt);    
-    list_insert_tail(&hciReadPktPool, (tListNode *)pckt);
+    hci_evt_release(hciReadPacket->dataBuff);
   }
 }
 
 /********************** HCI Transport layer functions *****************************/
 
+uint8_t hci_select(uint8_t id)
+{
+  uint8_t prev = (uint8_t)(hci - hciInstance);
+  
+  hci = &hciInstance[id];
+  hci_tl_lowlevel_select(id);
+  return prev;
+}
+
+uint8_t hci_selected(void)
+{
+  return (uint8_t)(hci - hciInstance);
+}
+
 void hci_init(void(* UserEvtRx)(void* pData), void* pConf)
 {
   uint8_t index;
 
   if(UserEvtRx != NULL)
   {
-    hciContext.UserEvtRx = UserEvtRx;
+    hci->context.UserEvtRx = UserEvtRx;
   }
   
+  /* The controller accepts one command after reset */
+  hci->context.cmdCredits = 1;
+  BLUENRG_memset(hci->asyncReq, 0, sizeof(hci->asyncReq));
+  hci->syncReq.state = HCI_SYNC_IDLE;
+  hci->evtParkHead = 0;
+  hci->evtParkTail = 0;
+  hci->cmdRespFlag = 0;
+  
   /* Initialize list heads of ready and free hci data packet queues */
-  list_init_head(&hciReadPktPool);
-  list_init_head(&hciReadPktRxQueue);
+  ring_init(&hci->readPktPool);
+  ring_init(&hci->readPktPoolSmall);
+  ring_init(&hci->readPktRxQueue);
+  hci->txHead = 0;
+  hci->txCount = 0;
+  hci->txSpace = 0;
+  hci->rxPaused = 0;
+  hci->rxPending = 0;
+  BLUENRG_memset(&hci->stats, 0, sizeof(hci->stats));
+  hci->stats.poolFreeMin      = HCI_READ_PACKET_LARGE_NUM;
+  hci->stats.poolSmallFreeMin = HCI_READ_PACKET_SMALL_NUM_MAX;
+#ifdef HCI_SNOOP_RING_SIZE
+  hci->snoopCount = 0;
+#endif
 
   /* Initialize TL BLE layer */
   hci_tl_lowlevel_init();
     
   /* Initialize the queue of free hci data packets */
-  for (index = 0; index < HCI_READ_PACKET_NUM_MAX; index++)
+  for (index = 0; index < HCI_READ_PACKET_TOTAL_NUM; index++)
   {
-    list_insert_tail(&hciReadPktPool, (tListNode *)&hciReadPacketBuffer[index]);
+    if (index < HCI_READ_PACKET_LARGE_NUM)
+    {
+      hci->readPacketBuffer[index].dataBuff = hci->readPacketLargeData[index];
+      hci->readPacketBuffer[index].bufSize  = HCI_READ_PACKET_SIZE;
+    }
+    else
+    {
+      hci->readPacketBuffer[index].dataBuff = hci->readPacketSmallData[index - HCI_READ_PACKET_LARGE_NUM];
+      hci->readPacketBuffer[index].bufSize  = HCI_READ_PACKET_SMALL_SIZE;
+    }
+    hci->readPacketBuffer[index].refCount = 0;
+    free_read_pkt(&hci->readPacketBuffer[index]);
   } 
   
   /* Initialize low level driver */
-  if (hciContext.io.Init)  hciContext.io.Init(NULL);
-  if (hciContext.io.Reset) hciContext.io.Reset();
+  if (hci->context.io.Init)  hci->context.io.Init(NULL);
+  if (hci->context.io.Reset) hci->context.io.Reset();
 }
 
 void hci_register_io_bus(tHciIO* fops)
 {
   /* Register bus function */
-  hciContext.io.Init    = fops->Init; 
-  hciContext.io.Receive = fops->Receive;  
-  hciContext.io.Send    = fops->Send;
-  hciContext.io.GetTick = fops->GetTick;
-  hciContext.io.Reset   = fops->Reset;
+  hci->context.io.Init    = fops->Init; 
+  hci->context.io.Receive = fops->Receive;  
+  hci->context.io.ReceiveAlloc = fops->ReceiveAlloc;
+  hci->context.io.Send    = fops->Send;
+  hci->context.io.SendV   = fops->SendV;
+  hci->context.io.GetTick = fops->GetTick;
+  hci->context.io.Reset   = fops->Reset;
 }
 
 int hci_send_req(struct hci_request* r, BOOL async)
 {
+  tHciInstance *self = hci;
   uint8_t *ptr;
   uint16_t opcode = htobs(cmd_opcode_pack(r->ogf, r->ocf));
   hci_event_pckt *event_pckt;
-  hci_uart_pckt *hci_hdr;
-
-  tHciDataPacket * hciReadPacket = NULL;
-  tListNode hciTempQueue;
+  evt_le_meta_event *me;
+  uint32_t len;
+  uint32_t tickstart;
+  uint32_t elapsed;
+  uint32_t uwPRIMASK_Bit;
+  uint8_t state;
+  int ret = -1;
   
-  list_init_head(&hciTempQueue);
-
-  free_event_list();
+  /* The packet must fit in the controller write buffer and in a parked frame */
+  if (r->clen > HCI_CMD_PARAM_SIZE_MAX)
+  {
+    return -1;
+  }
+  
+  /* Only one synchronous request waits at a time */
+  if (!async && (hci->syncReq.state != HCI_SYNC_IDLE))
+  {
+    return -1;
+  }
   
-  send_cmd(r->ogf, r->ocf, r->clen, r->cparam);
+  if (wait_cmd_credit() < 0)
+  {
+    return -1;
+  }
   
   if (async)
   {
-    return 0;
+    return send_cmd(r->ogf, r->ocf, r->clen, r->cparam);
   }
   
-  while (1) 
+  /* Register the request before sending: the ISR routes the response here
+     and leaves every other event in the application queue. */
+  hci->syncReq.opcode = opcode;
+  hci->syncReq.event  = r->event;
+  hci->syncReq.resp   = NULL;
+  hci->syncReq.sendSeq = hci->sendSeq++;
+  hci->syncReq.state  = HCI_SYNC_WAIT_CMD;
+  
+  if (send_cmd(r->ogf, r->ocf, r->clen, r->cparam) < 0)
   {
-    evt_cmd_complete  *cc;
-    evt_cmd_status    *cs;
-    evt_le_meta_event *me;
-    uint32_t len;
-    
-    uint32_t tickstart = HAL_GetTick();
-      
-    while (1)
+    hci->syncReq.state = HCI_SYNC_IDLE;
+    return -1;
+  }
+  
+  state = HCI_SYNC_WAIT_CMD;
+  tickstart = HAL_GetTick();
+  while (hci->syncReq.state != HCI_SYNC_DONE)
+  {
+    /* The command status restarts the timeout for the LE meta subevent */
+    if (hci->syncReq.state != state)
     {
-      if ((HAL_GetTick() - tickstart) > HCI_DEFAULT_TIMEOUT_MS)
-      {
-        goto failed;
-      }
-      
-      if (!list_is_empty(&hciReadPktRxQueue)) 
-      {
-        break;
-      }
+      state = hci->syncReq.state;
+      tickstart = HAL_GetTick();
     }
     
-    /* Extract packet from HCI event queue. */
-    list_remove_head(&hciReadPktRxQueue, (tListNode **)&hciReadPacket);    
-    
-    hci_hdr = (void *)hciReadPacket->dataBuff;
-
-    if (hci_hdr->type == HCI_EVENT_PKT)
+    elapsed = HAL_GetTick() - tickstart;
+    if (elapsed > HCI_DEFAULT_TIMEOUT_MS)
     {
-      event_pckt = (void *)(hci_hdr->data);
-    
-      ptr = hciReadPacket->dataBuff + (1 + HCI_EVENT_HDR_SIZE);
-      len = hciReadPacket->data_len - (1 + HCI_EVENT_HDR_SIZE);
+      break;
+    }
     
-      switch (event_pckt->evt) 
-      {      
-      case EVT_CMD_STATUS:
-        cs = (void *) ptr;
-        
-        if (cs->opcode != opcode)
-          goto failed;
-        
-        if (r->event != EVT_CMD_STATUS) {
-          if (cs->status) {
-            goto failed;
-          }
-          break;
-        }
-
-        r->rlen = MIN(len, r->rlen);
-        BLUENRG_memcpy(r->rparam, ptr, r->rlen);
-        goto done;
-      
-      case EVT_CMD_COMPLETE:
-        cc = (void *) ptr;
-      
-        if (cc->opcode != opcode)
-          goto failed;
-      
-        ptr += EVT_CMD_COMPLETE_SIZE;
-        len -= EVT_CMD_COMPLETE_SIZE;
-      
-        r->rlen = MIN(len, r->rlen);
-        BLUENRG_memcpy(r->rparam, ptr, r->rlen);
-        goto done;
-      
-      case EVT_LE_META_EVENT:
-        me = (void *) ptr;
-      
-        if (me->subevent != r->event)
-          break;
-      
-        len -= 1;
-        r->rlen = MIN(len, r->rlen);
-        BLUENRG_memcpy(r->rparam, me->data, r->rlen);
-        goto done;
-      
-      case EVT_HARDWARE_ERROR:            
-        goto failed;
-      
-      default:      
-        break;
-      }
+    /* The response cannot come while the reads are paused */
+    hci_resume_flow();
+    if (hci->rxPaused && (ring_count(&hci->readPktRxQueue) > 0))
+    {
+      /* Every packet holds an application event ahead of the response */
+      evt_park();
+      hci_resume_flow();
     }
     
-    /* If there are no more packets to be processed, be sure there is at list one
-       packet in the pool to process the expected event.
-       If no free packets are available, discard the processed event and insert it
-       into the pool. */
-    if (list_is_empty(&hciReadPktPool) && list_is_empty(&hciReadPktRxQueue)) {
-      list_insert_tail(&hciReadPktPool, (tListNode *)hciReadPacket);
-      hciReadPacket=NULL;
+    /* Read, or sleep until the ISR hands over the response (or the timeout expires) */
+    hci_rx_wait(HCI_DEFAULT_TIMEOUT_MS - elapsed);
+    /* The ISRs restore the instance they switch: another task switched it.
+       Unsupported, see hci_select(): the request ends on its own instance */
+    HCI_ASSERT(hci == self);
+    if (hci != self)
+    {
+      self->stats.reqInstanceSwitched++;
+      hci_select((uint8_t)(self - hciInstance));
+      break;
     }
-    else {
-      /* Insert the packet in a different queue. These packets will be
-      inserted back in the main queue just before exiting from send_req(), so that
-      these events can be processed by the application.
-    */
-    list_insert_tail(&hciTempQueue, (tListNode *)hciReadPacket);
-      hciReadPacket=NULL;
+  }
+  
+  /* Give the request up with the ISR masked: a response handed over in the
+     meantime is taken, its packet would be lost otherwise */
+  uwPRIMASK_Bit = __get_PRIMASK();
+  __disable_irq();
+  if (hci->syncReq.state != HCI_SYNC_DONE)
+  {
+    if ((hci->syncReq.state == HCI_SYNC_WAIT_CMD) && (hci->context.cmdCredits == 0))
+    {
+      /* The command complete/status was lost (e.g. dropped by verify_packet()),
+         the credit it carried with it */
+      hci->context.cmdCredits = 1;
     }
+    hci->syncReq.state = HCI_SYNC_IDLE;
+    __set_PRIMASK(uwPRIMASK_Bit);
+    /* A late response would be routed to the application */
+    return -1;
   }
+  __set_PRIMASK(uwPRIMASK_Bit);
+  
+  event_pckt = (void *)(hci->syncReq.resp->dataBuff + HCI_HDR_SIZE);
+  ptr = event_pckt->data;
+  len = event_pckt->plen;
   
-failed: 
-  if (hciReadPacket!=NULL) {
-    list_insert_head(&hciReadPktPool, (tListNode *)hciReadPacket);
+  switch (event_pckt->evt)
+  {
+  case EVT_CMD_STATUS:
+    /* Only routed here on failure if the request waits for another event */
+    if (r->event != EVT_CMD_STATUS)
+      break;
+    
+    r->rlen = MIN(len, r->rlen);
+    BLUENRG_memcpy(r->rparam, ptr, r->rlen);
+    ret = 0;
+    break;
+    
+  case EVT_CMD_COMPLETE:
+    ptr += EVT_CMD_COMPLETE_SIZE;
+    len -= EVT_CMD_COMPLETE_SIZE;
+    
+    r->rlen = MIN(len, r->rlen);
+    BLUENRG_memcpy(r->rparam, ptr, r->rlen);
+    ret = 0;
+    break;
+    
+  case EVT_LE_META_EVENT:
+    me = (void *) ptr;
+    
+    len -= 1;
+    r->rlen = MIN(len, r->rlen);
+    BLUENRG_memcpy(r->rparam, me->data, r->rlen);
+    ret = 0;
+    break;
+    
+  case EVT_HARDWARE_ERROR:
+  default:
+    break;
   }
-  move_list(&hciReadPktRxQueue, &hciTempQueue);
-
-  return -1;
   
-done:
   /* Insert the packet back into the pool.*/
-  list_insert_head(&hciReadPktPool, (tListNode *)hciReadPacket); 
-  move_list(&hciReadPktRxQueue, &hciTempQueue);
-
-  return 0;
+  free_read_pkt(hci->syncReq.resp);
+  hci->syncReq.resp  = NULL;
+  hci->syncReq.state = HCI_SYNC_IDLE;
+  
+  return ret;
 }
 
 void hci_user_evt_proc(void)
 {
-  tHciDataPacket * hciReadPacket = NULL;
+  /* read the packets left to the bottom half by the ISR, within the budget */
+  hci_tl_lowlevel_bottom_half();
+  
+  /* send the commands parked while the controller was busy */
+  hci_tx_flush();
      
+  /* complete the asynchronous requests and send the queued ones */
+  async_req_proc();
+  
   /* process any pending events read */
-  while (list_is_empty(&hciReadPktRxQueue) == FALSE)
+  hci_evt_dispatch();
+  
+  /* read what was left in the BlueNRG while no packet was free */
+  hci_resume_flow();
+}
+
+void hci_resume_flow(void)
+{
+  if ((hci->rxPaused == 0) || (read_pkt_fits(hci->rxPausedLen) == 0))
   {
-    list_remove_head (&hciReadPktRxQueue, (tListNode **)&hciReadPacket);
+    return;
+  }
+  hci->rxPaused = 0;
+  hci->stats.rxResumed++;
+  hci_tl_lowlevel_resume();
+}
+
+void hci_get_stats(tHciStats *stats)
+{
+  *stats = hci->stats;
+  stats->rxQueueDepth  = ring_count(&hci->readPktRxQueue);
+  stats->poolFree      = ring_count(&hci->readPktPool);
+  stats->poolSmallFree = ring_count(&hci->readPktPoolSmall);
+}
 
-    if (hciContext.UserEvtRx != NULL)
+#ifdef HCI_SNOOP_RING_SIZE
+/**
+  * @brief  Capture a packet in the ring, over the oldest one when it is full.
+  *         Called from send_cmd() and from the ISR.
+  *
+  * @param  flags btsnoop flags
+  * @param  iov The packet segments
+  * @param  iovcnt The number of segments
+  * @retval None
+  */
+static void snoop_put(uint8_t flags, const tHciIOVec *iov, uint8_t iovcnt)
+{
+  uint32_t tsUs = HAL_GetTickUs();
+  tHciSnoopRec *rec;
+  uint16_t len = 0;
+  uint16_t copy;
+  uint8_t i;
+  
+  uint32_t uwPRIMASK_Bit = __get_PRIMASK();
+  __disable_irq();
+  rec = &hci->snoopRing[hci->snoopCount % HCI_SNOOP_RING_SIZE];
+  hci->snoopCount++;
+  rec->tsUs = tsUs;
+  rec->flags = flags;
+  for (i = 0; i < iovcnt; i++)
+  {
+    if (len < HCI_SNOOP_SNAPLEN)
     {
-      hciContext.UserEvtRx(hciReadPacket->dataBuff);
+      copy = HCI_SNOOP_SNAPLEN - len;
+      if (copy > iov[i].len)
+        copy = iov[i].len;
+      BLUENRG_memcpy(rec->data + len, iov[i].data, copy);
     }
-
-    list_insert_tail(&hciReadPktPool, (tListNode *)hciReadPacket);
+    len += iov[i].len;
   }
+  rec->len = len;
+  rec->inclLen = (len < HCI_SNOOP_SNAPLEN) ? len : HCI_SNOOP_SNAPLEN;
+  __set_PRIMASK(uwPRIMASK_Bit);
 }
 
-int32_t hci_notify_asynch_evt(void* pdata)
+/**
+  * @brief  Store a 32-bit big endian value.
+  */
+static void snoop_be32(uint8_t *p, uint32_t v)
 {
-  tHciDataPacket * hciReadPacket = NULL;
-  uint8_t data_len;
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+uint32_t hci_snoop_dump(void (*write)(const uint8_t *data, uint16_t len))
+{
+  /* btsnoop version 1, datalink 1002: HCI UART (H4) */
+  static const uint8_t header[16] = {'b', 't', 's', 'n', 'o', 'o', 'p', 0,
+                                     0, 0, 0, 1, 0, 0, 0x03, 0xEA};
+  /* Microseconds since year 0, at the tick origin */
+  const uint64_t epoch = 0x00DCDDB30F2F8000ULL;
+  uint8_t record[24 + HCI_SNOOP_SNAPLEN];
+  tHciSnoopRec rec;
+  uint32_t count, index, drops, lost;
+  uint32_t written = 0;
+  uint64_t ts;
   
-  int32_t ret = 0;
+  uint32_t uwPRIMASK_Bit = __get_PRIMASK();
+  __disable_irq();
+  count = hci->snoopCount;
+  __set_PRIMASK(uwPRIMASK_Bit);
   
-  if (list_is_empty (&hciReadPktPool) == FALSE)
+  /* Packets overwritten before the dump */
+  lost = (count > HCI_SNOOP_RING_SIZE) ? count - HCI_SNOOP_RING_SIZE : 0;
+  write(header, sizeof(header));
+  for (index = lost; index < count; index++)
   {
-    /* Queuing a packet to read */
-    list_remove_head (&hciReadPktPool, (tListNode **)&hciReadPacket);
+    uwPRIMASK_Bit = __get_PRIMASK();
+    __disable_irq();
+    rec = hci->snoopRing[index % HCI_SNOOP_RING_SIZE];
+    drops = hci->snoopCount - index;
+    __set_PRIMASK(uwPRIMASK_Bit);
     
-    if (hciContext.io.Receive)
-    {
-      data_len = hciContext.io.Receive(hciReadPacket->dataBuff, HCI_READ_PACKET_SIZE);
-      if (data_len > 0)
-      {                    
-        hciReadPacket->data_len = data_len;
-        if (verify_packet(hciReadPacket) == 0)
-          list_insert_tail(&hciReadPktRxQueue, (tListNode *)hciReadPacket);
-        else
-          list_insert_head(&hciReadPktPool, (tListNode *)hciReadPacket);          
-      }
-      else 
+    /* Overwritten by the capture meanwhile */
+    if (drops > HCI_SNOOP_RING_SIZE)
+    {
+      lost++;
+      continue;
+    }
+    
+    ts = epoch + rec.tsUs;
+    snoop_be32(record, rec.len);
+    snoop_be32(record + 4, rec.inclLen);
+    snoop_be32(record + 8, rec.flags);
+    snoop_be32(record + 12, lost);
+    snoop_be32(record + 16, (uint32_t)(ts >> 32));
+    snoop_be32(record + 20, (uint32_t)ts);
+    BLUENRG_memcpy(record + 24, rec.data, rec.inclLen);
+    write(record, 24 + rec.inclLen);
+    written++;
+  }
+  return written;
+}
+#endif
+
+/**
+  * @brief  Find the read packet holding a buffer pointer.
+  *
+  * @param  pData Any pointer inside a packet data buffer
+  * @retval The packet, NULL if pData is not inside a read packet
+  */
+static tHciDataPacket *evt_packet_of(const void *pData)
+{
+  const uint8_t *ptr = (const uint8_t *)pData;
+  const uint8_t *large = (const uint8_t *)hci->readPacketLargeData;
+  const uint8_t *small = (const uint8_t *)hci->readPacketSmallData;
+  
+  if ((ptr >= large) && (ptr < large + sizeof(hci->readPacketLargeData)))
+  {
+    return &hci->readPacketBuffer[(uint32_t)(ptr - large) / HCI_READ_PACKET_SIZE];
+  }
+  if ((ptr >= small) && (ptr < small + sizeof(hci->readPacketSmallData)))
+  {
+    return &hci->readPacketBuffer[HCI_READ_PACKET_LARGE_NUM + (uint32_t)(ptr - small) / HCI_READ_PACKET_SMALL_SIZE];
+  }
+  return NULL;
+}
+
+void *hci_evt_retain(const void *pData)
+{
+  tHciDataPacket *hciReadPacket = evt_packet_of(pData);
+  
+  if ((hciReadPacket == NULL) || (hciReadPacket->refCount == 0) || (hciReadPacket->refCount == 0xFF))
+  {
+    return NULL;
+  }
+  hciReadPacket->refCount++;
+  
+  return hciReadPacket->dataBuff;
+}
+
+void hci_evt_release(const void *pData)
+{
+  tHciDataPacket *hciReadPacket = evt_packet_of(pData);
+  
+  if ((hciReadPacket == NULL) || (hciReadPacket->refCount == 0))
+  {
+    return;
+  }
+  if (--hciReadPacket->refCount == 0)
+  {
+    free_read_pkt(hciReadPacket);
+  }
+}
+
+/**
+  * @brief  Queue an asynchronous request, see hci_send_req_async().
+  *
+  * @param  r The HCI request
+  * @param  cb The raw completion callback, or NULL
+  * @param  statusCb The status completion callback, or NULL
+  * @param  ctx The user context of the callback
+  * @retval Token of the request, -1 if no slot is free
+  */
+static int async_req_submit(struct hci_request* r, hci_cmd_cb cb, hci_status_cb statusCb, void* ctx)
+{
+  tHciAsyncReq *req = NULL;
+  uint8_t index;
+  
+  if (r->clen > HCI_CMD_PARAM_SIZE_MAX)
+  {
+    return -1;
+  }
+  
+  for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+  {
+    if (hci->asyncReq[index].state == HCI_ASYNC_FREE)
+    {
+      req = &hci->asyncReq[index];
+      break;
+    }
+  }
+  if (req == NULL)
+  {
+    return -1;
+  }
+  
+  req->opcode = cmd_opcode_pack(r->ogf, r->ocf);
+  req->clen   = r->clen;
+  req->cb     = cb;
+  req->statusCb = statusCb;
+  req->ctx    = ctx;
+  req->resp   = NULL;
+  req->seq    = hci->asyncSeq++;
+  req->token  = (uint16_t)req->seq & 0x7FFF;
+  BLUENRG_memcpy(req->cparam, r->cparam, r->clen);
+  req->state  = HCI_ASYNC_QUEUED;
+  
+  async_req_pump();
+  
+  return req->token;
+}
+
+int hci_send_req_async(struct hci_request* r, hci_cmd_cb cb, void* ctx)
+{
+  return async_req_submit(r, cb, NULL, ctx);
+}
+
+int hci_send_req_async_status(struct hci_request* r, hci_status_cb cb, void* ctx)
+{
+  return async_req_submit(r, NULL, cb, ctx);
+}
+
+uint8_t hci_async_req_pending(void)
+{
+  uint8_t index;
+  uint8_t count = 0;
+  
+  for (index = 0; index < HCI_ASYNC_REQ_NUM_MAX; index++)
+  {
+    if (hci->asyncReq[index].state != HCI_ASYNC_FREE)
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+  * @brief  Queue the packet read by the IO bus, or give it back to the pool.
+  *
+  * @param  data_len Number of bytes read
+  * @retval 0: packet/event processed, 1: no packet/event processed
+  */
+static int32_t read_pkt_complete(int32_t data_len)
+{
+  tHciDataPacket * hciReadPacket = hci->rxPacket;
+  int verify;
+  
+  hci->rxPacket = NULL;
+  if (hciReadPacket == NULL)
+  {
+    /* No packet free for that length: the event stays in the controller */
+    return hci->rxStarved;
+  }
+  
+  if (data_len > 0)
+  {
+    read_pkt_watermarks();
+    hciReadPacket->data_len = data_len;
+    verify = verify_packet(hciReadPacket);
+    if (verify == 0)
+    {
+#ifdef HCI_SNOOP_RING_SIZE
+      tHciIOVec evt = {hciReadPacket->dataBuff, (uint16_t)data_len, 1};
+      HCI_SNOOP(HCI_SNOOP_FLAG_RECV_EVT, &evt, 1);
+#endif
+      if (cmd_resp_demux(hciReadPacket) == 0)
       {
-        /* Insert the packet back into the pool*/
-        list_insert_head(&hciReadPktPool, (tListNode *)hciReadPacket);
+        ring_put(&hci->readPktRxQueue, hciReadPacket);
+        if (ring_count(&hci->readPktRxQueue) > hci->stats.rxQueueMax)
+        {
+          hci->stats.rxQueueMax = ring_count(&hci->readPktRxQueue);
+        }
       }
+      hci_cmd_resp_release(1);
+    }
+    else
+    {
+      if (verify == 1)
+        hci->stats.rxBadType++;
+      else
+        hci->stats.rxBadLength++;
+      drop_read_pkt(hciReadPacket);
     }
   }
   else 
   {
-    ret = 1;
+    /* Insert the packet back into the pool*/
+    drop_read_pkt(hciReadPacket);
   }
-  return ret;
+  return 0;
+}
+
+int32_t hci_notify_asynch_evt(void* pdata)
+{
+  int32_t data_len = 0;
+  
+  if (hci->rxPending)
+  {
+    /* A transfer is in progress, hci_notify_rx_complete() will follow */
+    return 1;
+  }
+  
+  if (read_pkt_available() == 0)
+  {
+    read_flow_pause(HCI_READ_PACKET_SMALL_SIZE);
+    return 1;
+  }
+  
+  hci->rxPacket = NULL;
+  hci->rxStarved = 0;
+  if (hci->context.io.ReceiveAlloc)
+  {
+    /* The packet is taken from the size class fitting the packet length */
+    data_len = hci->context.io.ReceiveAlloc(read_pkt_alloc);
+    if ((data_len == HCI_IO_PENDING) && (hci->rxPacket != NULL))
+    {
+      hci->rxPending = 1;
+      return 1;
+    }
+  }
+  else if (hci->context.io.Receive && large_pkt_available())
+  {
+    /* Queuing a packet to read */
+    hci->rxPacket = ring_get(&hci->readPktPool);
+    data_len = hci->context.io.Receive(hci->rxPacket->dataBuff, hci->rxPacket->bufSize);
+  }
+  else
+  {
+    hci->rxStarved = 1;
+    read_flow_pause(HCI_READ_PACKET_SIZE);
+  }
+  
+  return read_pkt_complete(data_len);
+}
+
+void hci_notify_tx_space(uint16_t space)
+{
+  hci->txSpace = space;
+}
+
+uint16_t hci_tx_space(void)
+{
+  return hci->txSpace;
+}
+
+void hci_notify_rx_complete(int32_t len)
+{
+  if (hci->rxPending == 0)
+  {
+    return;
+  }
+  hci->rxPending = 0;
+  read_pkt_complete(len);
+}
+
+/**
+  * @brief  Default command response wait: the core sleeps in WFI until
+  *         hci_cmd_resp_release() is called from the ISR or the timeout
+  *         expires (the tick interrupt wakes it up at least every tick).
+  *         The timeout is counted in whole ticks: HCI_RETRY_PERIOD_MS sleeps
+  *         until the next tick or two.
+  *         The flag is tested with interrupts masked so that a release
+  *         happening right before WFI is not lost: a pending interrupt
+  *         still wakes the core, and runs as soon as PRIMASK is restored.
+  *         Override together with hci_cmd_resp_release() to back it with an
+  *         RTOS semaphore or a host condition variable, one per instance
+  *         (hci_selected()).
+  *
+  * @param  timeout Waiting timeout in ms
+  * @retval None
+  */
+__weak void hci_cmd_resp_wait(uint32_t timeout)
+{
+  uint32_t tickstart = HAL_GetTick();
+  uint32_t uwPRIMASK_Bit;
+
+  while (hci->cmdRespFlag == 0)
+  {
+    if ((HAL_GetTick() - tickstart) > timeout)
+    {
+      break;
+    }
+
+    uwPRIMASK_Bit = __get_PRIMASK();  /**< backup PRIMASK bit */
+    __disable_irq();                  /**< Disable all interrupts by setting PRIMASK bit on Cortex*/
+    if (hci->cmdRespFlag == 0)
+    {
+      __WFI();
+    }
+    __set_PRIMASK(uwPRIMASK_Bit);     /**< Restore PRIMASK bit*/
+  }
+  hci->cmdRespFlag = 0;
+}
 
+/**
+  * @brief  Default command response release, called from the ISR each time
+  *         an event is queued for hci_send_req()/hci_user_evt_proc(), with
+  *         its instance selected.
+  *
+  * @param  flag Release flag
+  * @retval None
+  */
+__weak void hci_cmd_resp_release(uint32_t flag)
+{
+  hci->cmdRespFlag = flag;
 }
@@ -67,13 +67,62 @@ struct hci_request {
 typedef struct _tHciDataPacket
 {
   tListNode currentNode;
-  uint8_t   dataBuff[HCI_READ_PACKET_SIZE];
+  uint8_t   *dataBuff; /**< Packet storage, from the size class of the packet */
+  uint16_t  bufSize;   /**< Size of dataBuff */
   uint8_t   data_len;
+  uint8_t   refCount;  /**< References held on the packet, see hci_evt_retain() */
 } tHciDataPacket;
 /**
  * @}
  */
 
+/**
+ * @brief Segment of a packet sent with the gather IO function (SendV).
+ *        A transfer can hold several packets, eop marks the last segment
+ *        of each one: packets are never split between transfers.
+ * @{
+ */
+typedef struct _tHciIOVec
+{
+  const uint8_t *data;
+  uint16_t       len;
+  uint8_t        eop;  /**< 1 on the last segment of a packet */
+} tHciIOVec;
+/**
+ * @}
+ */
+
+/**
+ * @brief Returned by ReceiveAlloc when the packet is read in the background
+ *        (e.g. by DMA): the IO bus calls hci_notify_rx_complete() when done.
+ */
+#define HCI_IO_PENDING  (-10)
+
+/**
+ * @brief Returned by Send/SendV when the controller cannot take the packet
+ *        now (e.g. its SPI write buffer is full): the packet is parked and
+ *        sent again on the next IRQ or tick, nothing waits on the bus.
+ */
+#define HCI_IO_BUSY     (-11)
+
+/**
+ * @brief Number of BlueNRG driven by the MCU, each one with its own HCI
+ *        instance (read pools, transmit queue, requests), see hci_select()
+ */
+#ifndef HCI_NUM_INSTANCES
+#define HCI_NUM_INSTANCES  (1)
+#endif
+
+/**
+ * @brief Maximum number of asynchronous requests (queued or in flight)
+ *        submitted with hci_send_req_async(), per instance. Each one keeps a
+ *        copy of its parameters. The bnrgm0 notification queue takes one, and
+ *        bnrgm0_updateCharValues() pipelines its updates on the others.
+ */
+#ifndef HCI_ASYNC_REQ_NUM_MAX
+#define HCI_ASYNC_REQ_NUM_MAX  (2)
+#endif
+
 /**
  * @brief Structure used to manage the BUS IO operations.
  *        All the structure fields will point to functions defined at user level.
@@ -85,7 +134,11 @@ typedef struct
   int32_t (* DeInit)  (void); /**< Pointer to HCI TL function for the IO Bus de-initialization */
   int32_t (* Reset)   (void); /**< Pointer to HCI TL function for the IO Bus reset */
   int32_t (* Receive) (uint8_t*, uint16_t); /**< Pointer to HCI TL function for the IO Bus data reception */
+  int32_t (* ReceiveAlloc) (uint8_t* (* alloc)(uint16_t* size)); /**< Optional, pointer to HCI TL function for the IO Bus data reception
+                                                                     into a buffer sized from the packet length (see hci_register_io_bus()) */
   int32_t (* Send)    (uint8_t*, uint16_t); /**< Pointer to HCI TL function for the IO Bus data transmission */
+  int32_t (* SendV)   (const tHciIOVec*, uint8_t); /**< Optional, pointer to HCI TL function for the IO Bus transmission
+                                                      of packets made of several segments, in one transfer */
   int32_t (* DataAck) (uint8_t*, uint16_t* len); /**< Pointer to HCI TL function for the IO Bus data ack reception */
   int32_t (* GetTick) (void); /**< Pointer to BSP function for getting the HAL time base timestamp */
 } tHciIO;
@@ -114,8 +167,48 @@ typedef struct
 {   
   tHciIO io; /**< Manage the BUS IO operations */
   void (* UserEvtRx)(void* pData); /**< ACI events callback function pointer */
+  volatile uint8_t cmdCredits; /**< Num_HCI_Command_Packets from the last command complete/status */
 } tHciContext;
 
+/**
+ * @brief HCI transport statistics, see hci_get_stats()
+ */
+typedef struct
+{
+  uint32_t rxPaused;        /**< Reads paused because no read packet was free */
+  uint32_t rxResumed;       /**< Reads resumed once packets came back */
+  uint16_t rxQueueDepth;    /**< Events waiting for hci_user_evt_proc() */
+  uint16_t rxQueueMax;      /**< High-water mark of rxQueueDepth */
+  uint16_t poolFree;        /**< Free large read packets (HCI_READ_PACKET_SIZE) */
+  uint16_t poolFreeMin;     /**< Low-water mark of poolFree */
+  uint16_t poolSmallFree;   /**< Free small read packets (HCI_READ_PACKET_SMALL_SIZE) */
+  uint16_t poolSmallFreeMin;/**< Low-water mark of poolSmallFree */
+  uint32_t txParked;        /**< Commands parked because the controller was busy */
+  uint32_t txCoalesced;     /**< Parked commands sent behind another one in the same transfer */
+  uint32_t rxBadType;       /**< Packets dropped by verify_packet(): not an event */
+  uint32_t rxBadLength;     /**< Packets dropped by verify_packet(): truncated or too long */
+  uint32_t rxEvtParked;     /**< Events parked by hci_send_req() to reach its response, see HCI_EVT_PARK_SIZE */
+  uint32_t reqInstanceSwitched; /**< Requests given up because another task selected another instance, see hci_select() */
+} tHciStats;
+
+/**
+ * @brief Completion callback of an asynchronous HCI request.
+ *        rparam points to the return parameters of the command complete event
+ *        (status first) or to the status of the command status event.
+ *        rparam is NULL and rlen 0 if the response did not come in time
+ *        or the command could not be written (IO error).
+ *        The buffer is only valid during the call.
+ */
+typedef void (* hci_cmd_cb)(int token, const uint8_t *rparam, uint16_t rlen, void *ctx);
+
+/**
+ * @brief Completion callback of an asynchronous command that only returns a
+ *        status (e.g. aci_gatt_update_char_value_ext_async_IDB05A1()).
+ *        status is BLE_STATUS_TIMEOUT if the response did not come in time
+ *        or the command could not be written.
+ */
+typedef void (* hci_status_cb)(int token, uint8_t status, void *ctx);
+
 /**
  * @}
  */ 
@@ -129,14 +222,103 @@ typedef struct
  * @{
  */
 
+/**
+ * @brief  Select the HCI instance (BlueNRG) the following calls work on:
+ *         hci_init(), the ACI/HCI commands, hci_user_evt_proc(), ...
+ *         The ISR of an instance selects it and restores the previous one.
+ *         The selection is global, not per task: all the instances are
+ *         driven from a single task (or under one lock held across each
+ *         call, waits included). A request waiting in hci_send_req() that
+ *         finds the instance switched by another task selects its own
+ *         instance back and ends there, failed unless its response came
+ *         (tHciStats.reqInstanceSwitched, HCI_ASSERT when defined).
+ *
+ * @param  id: 0 .. HCI_NUM_INSTANCES - 1
+ * @retval The instance selected before
+ */
+uint8_t hci_select(uint8_t id);
+
+/**
+ * @brief  The selected HCI instance, see hci_select().
+ *
+ * @param  None
+ * @retval 0 .. HCI_NUM_INSTANCES - 1
+ */
+uint8_t hci_selected(void);
+
 /**
  * @brief  Send an HCI request either in synchronous or in asynchronous mode.
+ *         In synchronous mode, if the events read fill the read packets
+ *         while the response is awaited, they are parked (up to
+ *         HCI_EVT_PARK_SIZE bytes) and handed to UserEvtRx() by the next
+ *         hci_user_evt_proc(), ahead of the events read after them.
  *
  * @param  r: The HCI request
  * @param  async: TRUE if asynchronous mode, FALSE if synchronous mode
  * @retval int: 0 when success, -1 when failure
  */
 int hci_send_req(struct hci_request *r, BOOL async);
+
+/**
+ * @brief  Submit an HCI request without waiting for its response.
+ *         The parameters are copied, r->rparam/r->rlen are not used and the
+ *         request completes on its command complete or command status event.
+ *         Requests are sent in submission order as soon as the controller
+ *         gives a command credit (Num_HCI_Command_Packets), so several of
+ *         them can be in flight back to back. Callbacks are run from
+ *         hci_user_evt_proc().
+ *
+ * @param  r: The HCI request
+ * @param  cb: Completion callback (can be NULL)
+ * @param  ctx: User context passed to the callback
+ * @retval int: token (>= 0) passed to the callback, -1 if no slot is free
+ */
+int hci_send_req_async(struct hci_request *r, hci_cmd_cb cb, void *ctx);
+
+/**
+ * @brief  Submit an HCI request like hci_send_req_async(), the callback
+ *         getting the status of the response decoded. Used by the
+ *         asynchronous ACI wrappers.
+ *
+ * @param  r: The HCI request
+ * @param  cb: Completion callback (can be NULL)
+ * @param  ctx: User context passed to the callback
+ * @retval int: token (>= 0) passed to the callback, -1 if no slot is free
+ */
+int hci_send_req_async_status(struct hci_request *r, hci_status_cb cb, void *ctx);
+
+/**
+ * @brief  Number of asynchronous requests queued or in flight.
+ *
+ * @param  None
+ * @retval uint8_t: number of requests not completed yet
+ */
+uint8_t hci_async_req_pending(void);
+
+/**
+ * @brief  Keep a received event buffer after UserEvtRx() returns.
+ *         By default the packet goes back to the read pool as soon as the
+ *         callback returns. A handler that wants to process the event later
+ *         (e.g. an attribute value) retains it instead of copying it, and
+ *         calls hci_evt_release() when done. An event parked by hci_send_req()
+ *         is not in a read packet and cannot be retained. The packet is not available to
+ *         the transport while retained, so it must be released promptly.
+ *         Must be called from the context running hci_user_evt_proc().
+ *
+ * @param  pData: Any pointer inside the event buffer given to UserEvtRx()
+ * @retval void*: Start of the event buffer (as given to UserEvtRx()),
+ *                NULL if pData is not inside an HCI read packet
+ */
+void *hci_evt_retain(const void *pData);
+
+/**
+ * @brief  Drop a reference taken with hci_evt_retain(). The packet goes back
+ *         to the read pool with the last reference.
+ *
+ * @param  pData: Any pointer inside the retained event buffer
+ * @retval None
+ */
+void hci_evt_release(const void *pData);
  
 /**
  * @brief  Register IO bus services.
@@ -148,7 +330,9 @@ int hci_send_req(struct hci_request *r, BOOL async);
            {			 
              hciContext.io.Init    = fops->Init; 
              hciContext.io.Receive = fops->Receive;  
+             hciContext.io.ReceiveAlloc = fops->ReceiveAlloc;
              hciContext.io.Send    = fops->Send;
+             hciContext.io.SendV   = fops->SendV;
              hciContext.io.GetTick = fops->GetTick;
              hciContext.io.Reset   = fops->Reset;    
            }
@@ -168,7 +352,9 @@ int hci_send_req(struct hci_request *r, BOOL async);
              fops.Init    = HCI_TL_SPI_Init;
              fops.DeInit  = HCI_TL_SPI_DeInit;
              fops.Send    = HCI_TL_SPI_Send;
+             fops.SendV   = HCI_TL_SPI_SendV;
              fops.Receive = HCI_TL_SPI_Receive;
+             fops.ReceiveAlloc = HCI_TL_SPI_ReceiveAlloc;
              fops.Reset   = HCI_TL_SPI_Reset;
              fops.GetTick = BSP_GetTick;
   
@@ -178,6 +364,27 @@ int hci_send_req(struct hci_request *r, BOOL async);
              ... ... ...
            }
  *         @endcode
+ *         ReceiveAlloc is optional (NULL to use Receive). It reads the
+ *         packet length first (e.g. from the SPI header), calls alloc with
+ *         it and reads the packet into the returned buffer, truncated to the
+ *         size written back by alloc. When alloc returns NULL no buffer is
+ *         free for that length: the packet is left in the controller and 0
+ *         is returned. The read pool is then split in size classes instead
+ *         of using HCI_READ_PACKET_SIZE for every event.
+ *         ReceiveAlloc can also start the payload transfer and return
+ *         HCI_IO_PENDING right away; the packet is handed over by
+ *         hci_notify_rx_complete() from the transfer complete interrupt.
+ *         SendV is optional too (NULL to use Send). It sends the segments
+ *         back to back as a single packet, so commands are sent from the
+ *         caller parameters without being copied behind their header.
+ *         Send and SendV make one attempt and return HCI_IO_BUSY when the
+ *         controller is not ready: the command is parked in the transmit
+ *         queue (HCI_TX_QUEUE_LEN) instead of holding the CPU on the bus.
+ *         SendV writes the whole packets fitting in the controller write
+ *         buffer (the space found in the SPI header), back to back in one
+ *         transfer, and returns the number of segments written: the parked
+ *         commands are flushed together. The space left is reported with
+ *         hci_notify_tx_space().
  *            
  * @param  fops The HCI IO structure managing the IO BUS
  * @retval None
@@ -195,14 +402,73 @@ void hci_register_io_bus(tHciIO* fops);
 int32_t hci_notify_asynch_evt(void* pdata);
 
 /**
- * @brief  This function resume the User Event Flow which has been stopped on return 
- *         from UserEvtRx() when the User Event has not been processed.
+ * @brief  Complete a read started by ReceiveAlloc that returned
+ *         HCI_IO_PENDING. Called from the transfer complete interrupt, which
+ *         must not preempt (nor be preempted by) the BlueNRG interrupt line
+ *         ISR: give both the same priority.
+ *
+ * @param  len: Number of bytes read, <= 0 if the transfer failed
+ * @retval None
+ */
+void hci_notify_rx_complete(int32_t len);
+
+/**
+ * @brief  Report the free space of the controller write buffer, called by
+ *         the IO bus on each write handshake (the SPI header gives it) and
+ *         after a write, with the space left. 0 if the controller is busy.
+ *
+ * @param  space: Bytes the controller can take in the next transfer
+ * @retval None
+ */
+void hci_notify_tx_space(uint16_t space);
+
+/**
+ * @brief  TX credit: bytes of commands the controller could take in one
+ *         transfer, as reported by the last write handshake (0 if unknown
+ *         or busy). Lets the application size bursts of commands.
+ *
+ * @param  None
+ * @retval Free space of the controller write buffer
+ */
+uint16_t hci_tx_space(void);
+
+/**
+ * @brief  Resume the reads paused by hci_notify_asynch_evt() when no read
+ *         packet was free. The BlueNRG keeps its IRQ line high meanwhile,
+ *         so no new edge comes: the packets left are read from the caller
+ *         context through hci_tl_lowlevel_resume() once a packet fitting
+ *         the pending one is back in the pool.
+ *         Called by hci_user_evt_proc() and while hci_send_req() waits, the
+ *         application only needs it when packets are released elsewhere.
  *
  * @param  None
  * @retval None
  */
 void hci_resume_flow(void);
 
+/**
+ * @brief  Copy the HCI transport statistics. The depths are read in constant
+ *         time, the water marks are kept by the ISR since hci_init(): a pool
+ *         low-water mark of 0 means the reads had to wait for packets, see
+ *         HCI_READ_PACKET_NUM_MAX and HCI_READ_PACKET_SMALL_NUM_MAX.
+ *
+ * @param  stats: Filled with the counters since hci_init()
+ * @retval None
+ */
+void hci_get_stats(tHciStats *stats);
+
+/**
+ * @brief  Write the HCI capture ring as a btsnoop file (H4 datalink), oldest
+ *         packet first. The commands are captured by send_cmd() and the
+ *         events once accepted by hci_notify_asynch_evt(), with the
+ *         microseconds of HAL_GetTickUs(). Only with HCI_SNOOP_RING_SIZE
+ *         defined (bluenrg_conf.h), the capture is compiled out otherwise.
+ *
+ * @param  write: Called with each part of the file
+ * @retval Number of packets written
+ */
+uint32_t hci_snoop_dump(void (*write)(const uint8_t *data, uint16_t len));
+
 /**
  * @brief  This function is called when an ACI/HCI command is sent and the response 
  *         is waited from the BLE core.
@@ -210,8 +476,13 @@ void hci_resume_flow(void);
  *         until the waited event is received.
  *         This is notified to the application with hci_cmd_resp_release().
  *         It is called from the same context the HCI command has been sent.
+ *         A weak default is provided that sleeps the core in WFI; returning
+ *         early is allowed, hci_send_req() checks the queue again.
+ *         It must return once timeout expires even without a release: while
+ *         commands are parked or the reads paused the timeout is 1 ms, and
+ *         they are retried on return.
  *
- * @param  timeout: Waiting timeout
+ * @param  timeout: Waiting timeout in ms
  * @retval None
  */
 void hci_cmd_resp_wait(uint32_t timeout);
@@ -219,6 +490,8 @@ void hci_cmd_resp_wait(uint32_t timeout);
 /**
  * @brief  This function is called when an ACI/HCI command is sent and the response is
  *         received from the BLE core.
+ *         It is called from the ISR context each time an event is queued.
+ *         A weak default is provided that pairs with the default hci_cmd_resp_wait().
  *
  * @param  flag: Release flag
  * @retval None
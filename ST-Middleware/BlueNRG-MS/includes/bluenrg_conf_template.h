@@ -32,6 +32,8 @@ extern "C" {
 #define PRINT_CSV_FORMAT      0
 /*---------- Number of Bytes reserved for HCI Read Packet -----------*/
 #define HCI_READ_PACKET_SIZE      128
+/*---------- Number of Bytes reserved for HCI Small Read Packet (short events: command complete, disconnection, ...) -----------*/
+#define HCI_READ_PACKET_SMALL_SIZE      32
 /*---------- Number of Bytes reserved for HCI Max Payload -----------*/
 #define HCI_MAX_PAYLOAD_SIZE      128
 /*---------- Scan Interval: time interval from when the Controller started its last scan until it begins the subsequent scan (for a number N, Time = N x 0.625 msec) -----------*/
@@ -19,6 +19,7 @@
 #define __BLUENRG_GATT_ACI_H__
 
 #include "bluenrg_gatt_server.h"
+#include "hci_tl.h"
 
 /** 
  * @addtogroup HIGH_LEVEL_INTERFACE HIGH_LEVEL_INTERFACE
@@ -766,6 +767,25 @@ tBleStatus aci_gatt_update_char_value_ext_IDB05A1(uint16_t service_handle, uint1
                                                   uint16_t value_offset, uint8_t value_length,
                                                   const uint8_t* value);
 
+/**
+ * @brief Asynchronous version of @ref aci_gatt_update_char_value_ext_IDB05A1: the command is queued
+ *        and sent as soon as the controller gives a command credit, see hci_send_req_async().
+ * @param service_handle Handle of the service to which the characteristic belongs.
+ * @param char_handle Handle of the characteristic
+ * @param update_type Bitmask that controls generation of notifications and indications.
+ * @param char_length Total length of the characteristic value.
+ * @param value_offset The offset from which the attribute value has to be updated
+ * @param value_length Length of the value to be updated
+ * @param value   Updated characteristic value, copied
+ * @param cb Called from hci_user_evt_proc() with the status of the command (can be NULL)
+ * @param ctx User context passed to cb
+ * @return Token passed to cb, -1 if no asynchronous slot is free or value_length is too long.
+ */
+int aci_gatt_update_char_value_ext_async_IDB05A1(uint16_t service_handle, uint16_t char_handle,
+                                                 uint8_t update_type, uint16_t char_length,
+                                                 uint16_t value_offset, uint8_t value_length,
+                                                 const uint8_t* value, hci_status_cb cb, void *ctx);
+
 tBleStatus aci_gatt_set_event_mask(uint32_t event_mask);
 
 /**
@@ -56,6 +56,8 @@ void hci_init(void(* UserEvtRx)(void* pData), void* pConf);
  * @brief  Processing function that must be called after an event is received from
  *         HCI interface. 
  *         It must be called outside ISR. It will call user_notify() if necessary.
+ *         It also runs the reads left by the ISR in bottom half mode
+ *         (bnrgm0_hw_t.rx_budget_pkts): call it from a single task.
  *
  * @param  None
  * @retval None
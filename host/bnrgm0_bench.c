@@ -0,0 +1,812 @@
+// HCI throughput benchmark: drives the bnrgm0 driver against the controller
+// emulator and reports command rate, round trip latency per opcode,
+// notification throughput and event reception rate.
+
+#include "bluenrg_aci.h"
+#include "bnrgm0.h"
+#include "bnrgm0_emu.h"
+#include "bnrgm0_evt_rx.h"
+#include "hci_le.h"
+#include <stdlib.h>
+#include <time.h>
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define BENCH_CONN_HANDLE 0x0801U
+#define BENCH_NOTIF_LEN   20U
+#define BENCH_FLOOD_LEN   20U
+#define BENCH_LONG_LEN    512U
+#define BENCH_STREAM_LEN  155U // ATT_MTU-3 of the BlueNRG-MS largest ATT_MTU
+#define BENCH_STREAM_WR   5U   // bytes per bnrgm0_streamWrite() call
+#define BENCH_SHADOW_LEN  4U
+#define BENCH_SHADOW_RUN  10U // samples per sensor value
+#define BENCH_SAMPLE_US   100U // telemetry sample period
+#define BENCH_DASH_CHARS  8U   // dashboard characteristics updated per sample
+#define BENCH_IDLE_US     200000ULL
+#define BENCH_DEFER_MAX   2U
+
+typedef struct {
+  const char *name;
+  uint32_t n;
+  uint64_t total_ns;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint32_t errors;
+} bench_stat_t;
+
+static struct {
+  uint32_t iterations;
+  uint32_t flood;
+  uint8_t radios; // BlueNRG instances, all take part in the notification phase
+  uint8_t rx_budget_pkts;
+  uint32_t rx_budget_us;
+  bool spi_cal;
+  uint16_t min_interval_ms; // between the telemetry notifications
+  const char *snoop_file;
+  bnrgm0_emu_cfg_t emu;
+} opts;
+
+static struct {
+  volatile uint32_t connects;
+  volatile uint32_t disconnects;
+  volatile uint32_t attr_writes;
+  uint32_t deferred;
+  uint32_t corrupted;
+} seen;
+
+// Attribute writes retained by the event handler and processed after
+// bnrgm0_process() returns, without copying the payload.
+static struct {
+  const uint8_t *data;
+  uint8_t len;
+  uint8_t seq;
+} defer_q[BENCH_DEFER_MAX];
+static uint32_t defer_n;
+
+static ble_service_t service[HCI_NUM_INSTANCES];
+static ble_char_t notify_char[HCI_NUM_INSTANCES];
+static ble_char_t write_char[HCI_NUM_INSTANCES];
+static ble_char_t long_char[HCI_NUM_INSTANCES];
+static ble_char_t stream_char[HCI_NUM_INSTANCES];
+static ble_char_t sensor_char[HCI_NUM_INSTANCES]; // notified
+static ble_char_t info_char[HCI_NUM_INSTANCES];   // read-only, read permit requests
+static ble_char_t telemetry_char[HCI_NUM_INSTANCES];
+static ble_char_t dash_char[HCI_NUM_INSTANCES][BENCH_DASH_CHARS];
+static ble_char_shadow_t sensor_shadow[HCI_NUM_INSTANCES];
+static ble_char_shadow_t info_shadow[HCI_NUM_INSTANCES];
+static uint8_t sensor_copy[HCI_NUM_INSTANCES][BENCH_SHADOW_LEN];
+static uint8_t info_copy[HCI_NUM_INSTANCES][BENCH_SHADOW_LEN];
+
+// Like millis()/micros(), reading the time is a point where the emulated IRQ
+// can preempt the main loop.
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  eon_host_irq_poll();
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t now_us(void) { return now_ns() / 1000ULL; }
+
+// ===============================================================
+// Driver callbacks
+// ===============================================================
+
+void __bnrg_on_connect(ble_conn_t conn) { seen.connects++; }
+
+void __bnrg_on_disconnect(ble_conn_t conn) { seen.disconnects++; }
+
+void aci_gatt_attribute_modified_event(uint16_t conn_handle, uint16_t attr_handle, uint8_t data_length, uint8_t *attr_data) {
+  seen.attr_writes++;
+  if (defer_n < BENCH_DEFER_MAX && hci_evt_retain(attr_data) != NULL) {
+    defer_q[defer_n].data = attr_data;
+    defer_q[defer_n].len  = data_length;
+    defer_q[defer_n].seq  = attr_data[0];
+    defer_n++;
+  }
+}
+
+static void defer_drain(void) {
+  for (uint32_t i = 0; i < defer_n; i++) {
+    if (defer_q[i].data[0] != defer_q[i].seq) {
+      seen.corrupted++;
+    }
+    seen.deferred++;
+    hci_evt_release(defer_q[i].data);
+  }
+  defer_n = 0;
+}
+
+void aci_gatt_notification_event(uint16_t conn_handle, uint16_t attr_handle, uint8_t attr_len, uint8_t *attr_value) {}
+
+// ===============================================================
+// Statistics
+// ===============================================================
+
+static void stat_init(bench_stat_t *s, const char *name) {
+  memset(s, 0, sizeof(*s));
+  s->name   = name;
+  s->min_ns = UINT64_MAX;
+}
+
+static void stat_add(bench_stat_t *s, uint64_t ns, bool ok) {
+  s->n++;
+  s->total_ns += ns;
+  if (ns < s->min_ns) { s->min_ns = ns; }
+  if (ns > s->max_ns) { s->max_ns = ns; }
+  if (!ok) { s->errors++; }
+}
+
+static void stat_print(const bench_stat_t *s) {
+  double avg = s->n ? (double) s->total_ns / s->n / 1000.0 : 0.0;
+  printf("  %-34s %8u %9.2f %9.2f %9.2f %6u\n", s->name, s->n, avg,
+         s->n ? s->min_ns / 1000.0 : 0.0, s->max_ns / 1000.0, s->errors);
+}
+
+// ===============================================================
+// Phases
+// ===============================================================
+
+static bool bench_init_radio(bnrgm0_t r) {
+  const bnrgm0_hw_t hw = {
+    .exti_irqn      = (IRQn_Type) (BNRGM0_EMU_IRQN + 2 * r),
+    .rx_budget_pkts = opts.rx_budget_pkts,
+    .rx_budget_us   = opts.rx_budget_us,
+    .spi_speed      = opts.spi_cal ? BNRGM0_EMU_SpiSpeed : NULL,
+  };
+  static const uint8_t addr[6] = {0x02, 0x80, 0xE1, 0x00, 0x00, 0x01};
+
+  hci_select(r);
+  bnrgm0_emu_setConfig(&opts.emu);
+  uint64_t t0 = now_us();
+  if (!bnrgm0_init(r, &hw, addr)) { return false; }
+  uint64_t t1 = now_us();
+  if (!bnrgm0_stackInit(r)) { return false; }
+  if (!bnrgm0_addService(r, &service[r], "0000fe4000cc7a482a3d1cd9e8b0ae11", 7 + BENCH_DASH_CHARS)) { return false; }
+  if (!bnrgm0_addCharacteristic(r, &service[r], &notify_char[r], "0000fe4100cc7a482a3d1cd9e8b0ae11",
+                                BENCH_NOTIF_LEN, 0, CHAR_PROP_NOTIFY | CHAR_PROP_READ, GATT_DONT_NOTIFY_EVENTS)) {
+    return false;
+  }
+  if (!bnrgm0_addCharacteristic(r, &service[r], &write_char[r], "0000fe4200cc7a482a3d1cd9e8b0ae11",
+                                BENCH_FLOOD_LEN, 1, CHAR_PROP_WRITE | CHAR_PROP_WRITE_WITHOUT_RESP,
+                                GATT_NOTIFY_ATTRIBUTE_WRITE)) {
+    return false;
+  }
+  if (!bnrgm0_addCharacteristic(r, &service[r], &long_char[r], "0000fe4300cc7a482a3d1cd9e8b0ae11",
+                                BENCH_LONG_LEN, 1, CHAR_PROP_NOTIFY | CHAR_PROP_READ, GATT_DONT_NOTIFY_EVENTS)) {
+    return false;
+  }
+  if (!bnrgm0_addCharacteristic(r, &service[r], &stream_char[r], "0000fe4400cc7a482a3d1cd9e8b0ae11",
+                                BENCH_STREAM_LEN, 1, CHAR_PROP_NOTIFY, GATT_DONT_NOTIFY_EVENTS)) {
+    return false;
+  }
+  if (!bnrgm0_addCharacteristic(r, &service[r], &sensor_char[r], "0000fe4500cc7a482a3d1cd9e8b0ae11",
+                                BENCH_SHADOW_LEN, 0, CHAR_PROP_NOTIFY | CHAR_PROP_READ, GATT_DONT_NOTIFY_EVENTS) ||
+      !bnrgm0_addCharacteristic(r, &service[r], &info_char[r], "0000fe4600cc7a482a3d1cd9e8b0ae11",
+                                BENCH_SHADOW_LEN, 0, CHAR_PROP_READ, GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP)) {
+    return false;
+  }
+  bnrgm0_setCharShadow(r, &sensor_char[r], &sensor_shadow[r], sensor_copy[r]);
+  bnrgm0_setCharShadow(r, &info_char[r], &info_shadow[r], info_copy[r]);
+  if (!bnrgm0_addCharacteristic(r, &service[r], &telemetry_char[r], "0000fe4700cc7a482a3d1cd9e8b0ae11",
+                                sizeof(uint32_t), 0, CHAR_PROP_NOTIFY, GATT_DONT_NOTIFY_EVENTS) ||
+      !bnrgm0_setCharCoalescing(r, &telemetry_char[r], opts.min_interval_ms)) {
+    return false;
+  }
+  for (uint8_t c = 0; c < BENCH_DASH_CHARS; c++) {
+    char uuid[] = "0000fe5000cc7a482a3d1cd9e8b0ae11";
+    uuid[7]     = (char) ('0' + c);
+    if (!bnrgm0_addCharacteristic(r, &service[r], &dash_char[r][c], uuid, sizeof(uint32_t), 0,
+                                  CHAR_PROP_NOTIFY | CHAR_PROP_READ, GATT_DONT_NOTIFY_EVENTS)) {
+      return false;
+    }
+  }
+  uint64_t t2 = now_us();
+
+  printf("init radio %u\n", r);
+  printf("  bnrgm0_init (incl. 100 ms reset delay) %10.2f ms\n", (t1 - t0) / 1000.0);
+  printf("  stack/service/characteristics          %10.2f us\n", (double) (t2 - t1));
+  if (opts.spi_cal) {
+    printf("  SPI clock (calibrated)                 %10.2f MHz\n", bnrgm0_getSpiClock(r) / 1e6);
+    printf("  reads corrupted during calibration     %10u\n", bnrgm0_emu_getStats()->spi_corrupted);
+  }
+  return true;
+}
+
+static bool bench_init(void) {
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    if (!bench_init_radio(r)) { return false; }
+  }
+  // the single radio phases run on radio 0
+  hci_select(0);
+  return true;
+}
+
+static void bench_opcodes(void) {
+  bench_stat_t st[6];
+  uint8_t buf[HCI_MAX_PAYLOAD_SIZE];
+  uint8_t value[BENCH_NOTIF_LEN] = {0};
+  uint8_t len;
+
+  stat_init(&st[0], "hci_le_rand");
+  stat_init(&st[1], "hci_read_bd_addr");
+  stat_init(&st[2], "aci_hal_read_config_data");
+  stat_init(&st[3], "aci_hal_set_tx_power_level");
+  stat_init(&st[4], "aci_gatt_update_char_value_ext");
+  stat_init(&st[5], "aci_gap_set_non_discoverable");
+
+  tHciStats hs;
+  hci_get_stats(&hs);
+  uint32_t parked = hs.txParked;
+  bnrgm0_emu_clearStats();
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    uint64_t t = now_ns();
+    int ret    = hci_le_rand(buf);
+    stat_add(&st[0], now_ns() - t, ret == 0);
+
+    t   = now_ns();
+    ret = hci_read_bd_addr(buf);
+    stat_add(&st[1], now_ns() - t, ret == 0);
+
+    t   = now_ns();
+    ret = aci_hal_read_config_data(CONFIG_DATA_PUBADDR_OFFSET, sizeof(buf), &len, buf);
+    stat_add(&st[2], now_ns() - t, ret == 0);
+
+    t   = now_ns();
+    ret = aci_hal_set_tx_power_level(1, 4);
+    stat_add(&st[3], now_ns() - t, ret == 0);
+
+    t   = now_ns();
+    ret = aci_gatt_update_char_value_ext_IDB05A1(notify_char[0]._service_handle, notify_char[0]._char_decl_handle,
+                                                 0x00, sizeof(value), 0, sizeof(value), value);
+    stat_add(&st[4], now_ns() - t, ret == 0);
+
+    t   = now_ns();
+    ret = aci_gap_set_non_discoverable();
+    stat_add(&st[5], now_ns() - t, ret == 0);
+  }
+  uint64_t elapsed = now_ns() - start;
+  uint32_t cmds    = opts.iterations * 6;
+
+  printf("command round trip (us)\n");
+  printf("  %-34s %8s %9s %9s %9s %6s\n", "opcode", "n", "avg", "min", "max", "err");
+  for (uint8_t i = 0; i < 6; i++) {
+    stat_print(&st[i]);
+  }
+  printf("  commands/sec                       %12.0f\n", cmds / (elapsed / 1e9));
+  hci_get_stats(&hs);
+  printf("  parked/writes refused (busy)        %8u / %u\n", hs.txParked - parked, bnrgm0_emu_getStats()->tx_busy);
+}
+
+static void bench_async_cb(int token, const uint8_t *rparam, uint16_t rlen, void *ctx) {
+  bench_stat_t *st = ctx;
+  st->n++;
+  if (rparam == NULL || rparam[0] != BLE_STATUS_SUCCESS) { st->errors++; }
+}
+
+static void bench_async(void) {
+  hal_set_tx_power_level_cp cp = {.en_high_power = 1, .pa_level = 4};
+  struct hci_request rq;
+  bench_stat_t st;
+  uint32_t submitted = 0;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf    = OGF_VENDOR_CMD;
+  rq.ocf    = OCF_HAL_SET_TX_POWER_LEVEL;
+  rq.cparam = &cp;
+  rq.clen   = sizeof(cp);
+  stat_init(&st, "aci_hal_set_tx_power_level");
+
+  tHciStats hs;
+  hci_get_stats(&hs);
+  uint32_t coalesced = hs.txCoalesced;
+  bnrgm0_emu_clearStats();
+  uint64_t t0 = now_ns();
+  while (st.n < opts.iterations) {
+    while (submitted < opts.iterations && hci_send_req_async(&rq, bench_async_cb, &st) >= 0) {
+      submitted++;
+    }
+    hci_user_evt_proc();
+  }
+  uint64_t elapsed = now_ns() - t0;
+
+  printf("pipelined commands via hci_send_req_async (ncmd %u)\n", opts.emu.ncmd);
+  printf("  completed/errors                       %10u / %u\n", st.n, st.errors);
+  printf("  commands/sec                           %10.0f\n", st.n / (elapsed / 1e9));
+  hci_get_stats(&hs);
+  const bnrgm0_emu_stats_t *es = bnrgm0_emu_getStats();
+  printf("  write transfers/coalesced              %10u / %u\n", es->tx_transfers, hs.txCoalesced - coalesced);
+}
+
+static bool bench_connect_radio(bnrgm0_t r) {
+  static const uint8_t peer[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+  uint64_t t0                  = now_us();
+  hci_select(r);
+  bnrgm0_emu_connect(BENCH_CONN_HANDLE, peer);
+  while (bnrgm0_getConnHandle(r) == 0) {
+    bnrgm0_process(r);
+    if (now_us() - t0 > BENCH_IDLE_US) { return false; }
+  }
+  // first process() after the connection starts the MTU exchange, then let
+  // the exchange MTU response come in
+  bnrgm0_process(r);
+  while (bnrgm0_emu_pendingEvents() != 0) {
+    bnrgm0_process(r);
+    if (now_us() - t0 > BENCH_IDLE_US) { return false; }
+  }
+  printf("connection radio %u\n", r);
+  printf("  connect + MTU exchange                 %10.2f us\n", (double) (now_us() - t0));
+  return true;
+}
+
+static bool bench_connect(void) {
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    if (!bench_connect_radio(r)) { return false; }
+  }
+  return true;
+}
+
+// Each radio sends opts.iterations notifications, in turns: one waiting for
+// its tx pool does not hold the others' links.
+static void bench_notifications(void) {
+  uint8_t value[BENCH_NOTIF_LEN];
+  uint32_t ok = 0;
+
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    hci_select(r);
+    bnrgm0_emu_clearStats();
+  }
+  uint64_t t0 = now_us();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    memset(value, (uint8_t) i, sizeof(value));
+    for (bnrgm0_t r = 0; r < opts.radios; r++) {
+      if (bnrgm0_updateCharValue(r, bnrgm0_getConnHandle(r), &notify_char[r], value, sizeof(value))) { ok++; }
+    }
+  }
+  uint64_t elapsed = now_us() - t0;
+
+  bnrgm0_emu_stats_t es = {0};
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    hci_select(r);
+    es.notifications += bnrgm0_emu_getStats()->notifications;
+    es.notification_bytes += bnrgm0_emu_getStats()->notification_bytes;
+    es.insufficient_resources += bnrgm0_emu_getStats()->insufficient_resources;
+  }
+  hci_select(0);
+  printf("notifications via bnrgm0_updateCharValue (%u bytes, %u radios)\n", BENCH_NOTIF_LEN, opts.radios);
+  printf("  sent/ok                                %10u / %u\n", es.notifications, ok);
+  printf("  tx pool full retries                   %10u\n", es.insufficient_resources);
+  printf("  notifications/sec                      %10.0f\n", es.notifications / (elapsed / 1e6));
+  printf("  payload bytes/sec                      %10.0f\n", es.notification_bytes / (elapsed / 1e6));
+}
+
+// Same stream through bnrgm0_queueCharValue(): the values wait in the queue
+// for the TX pool available event instead of the caller, which only runs
+// bnrgm0_process() when the queue is full.
+static void bench_queued(void) {
+  uint8_t value[BENCH_NOTIF_LEN];
+  uint64_t call_max_ns = 0;
+
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    hci_select(r);
+    bnrgm0_emu_clearStats();
+  }
+  uint64_t t0 = now_us();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    memset(value, (uint8_t) i, sizeof(value));
+    for (bnrgm0_t r = 0; r < opts.radios; r++) {
+      for (;;) {
+        uint64_t t  = now_ns();
+        bool queued = bnrgm0_queueCharValue(r, bnrgm0_getConnHandle(r), &notify_char[r], value, sizeof(value));
+        t           = now_ns() - t;
+        if (t > call_max_ns) { call_max_ns = t; }
+        if (queued) { break; }
+        bnrgm0_process(r);
+      }
+    }
+  }
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    uint64_t last = now_us();
+    uint8_t left  = bnrgm0_getQueuedCharValues(r);
+    while (left != 0 && now_us() - last < BENCH_IDLE_US * 10) {
+      bnrgm0_process(r);
+      if (bnrgm0_getQueuedCharValues(r) != left) {
+        left = bnrgm0_getQueuedCharValues(r);
+        last = now_us();
+      }
+    }
+  }
+  uint64_t elapsed = now_us() - t0;
+
+  bnrgm0_emu_stats_t es = {0};
+  uint32_t left         = 0;
+  for (bnrgm0_t r = 0; r < opts.radios; r++) {
+    hci_select(r);
+    es.notifications += bnrgm0_emu_getStats()->notifications;
+    es.notification_bytes += bnrgm0_emu_getStats()->notification_bytes;
+    es.insufficient_resources += bnrgm0_emu_getStats()->insufficient_resources;
+    left += bnrgm0_getQueuedCharValues(r);
+  }
+  hci_select(0);
+  printf("queued notifications via bnrgm0_queueCharValue (%u bytes, %u radios)\n", BENCH_NOTIF_LEN, opts.radios);
+  printf("  sent/left in the queue                 %10u / %u\n", es.notifications, left);
+  printf("  tx pool full retries                   %10u\n", es.insufficient_resources);
+  printf("  longest bnrgm0_queueCharValue (us)     %10.2f\n", call_max_ns / 1000.0);
+  printf("  notifications/sec                      %10.0f\n", es.notifications / (elapsed / 1e6));
+  printf("  payload bytes/sec                      %10.0f\n", es.notification_bytes / (elapsed / 1e6));
+}
+
+// Values of the ATT maximum length, written in chunks by bnrgm0_updateCharValue():
+// the emulated peer must read back the last one whole.
+static void bench_long_value(void) {
+  uint8_t value[BENCH_LONG_LEN];
+  uint8_t peer[BENCH_LONG_LEN];
+  uint32_t ok = 0;
+
+  bnrgm0_emu_clearStats();
+  uint64_t t0 = now_us();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    for (uint16_t j = 0; j < sizeof(value); j++) {
+      value[j] = (uint8_t) (i + j);
+    }
+    if (bnrgm0_updateCharValue(0, bnrgm0_getConnHandle(0), &long_char[0], value, sizeof(value))) { ok++; }
+  }
+  uint64_t elapsed = now_us() - t0;
+
+  uint16_t len                 = bnrgm0_emu_charValue(long_char[0]._char_decl_handle, peer, sizeof(peer));
+  bool intact                  = (len == sizeof(value)) && !memcmp(peer, value, sizeof(value));
+  const bnrgm0_emu_stats_t *es = bnrgm0_emu_getStats();
+  printf("long values via bnrgm0_updateCharValue (%u bytes)\n", BENCH_LONG_LEN);
+  printf("  updated/notified                       %10u / %u\n", ok, es->notifications);
+  printf("  commands per value                     %10.2f\n", ok ? (double) es->cmds / ok : 0.0);
+  printf("  values/sec                             %10.0f\n", ok / (elapsed / 1e6));
+  printf("  value read back by the peer            %10s\n", intact ? "intact" : "CORRUPTED");
+}
+
+// The payload of the queued phase as a byte stream written in small pieces:
+// bnrgm0_streamWrite() packs it in notifications of ATT_MTU-3 bytes.
+static void bench_stream(void) {
+  uint8_t piece[BENCH_STREAM_WR];
+  uint32_t total = opts.iterations * BENCH_NOTIF_LEN;
+  ble_conn_t conn = bnrgm0_getConnHandle(0);
+
+  bnrgm0_emu_clearStats();
+  uint64_t t0 = now_us();
+  for (uint32_t sent = 0; sent < total;) {
+    uint16_t len = (total - sent < sizeof(piece)) ? total - sent : sizeof(piece);
+    memset(piece, (uint8_t) sent, len);
+    uint16_t done = 0;
+    while (done < len) {
+      done += bnrgm0_streamWrite(0, conn, &stream_char[0], &piece[done], len - done);
+      if (done < len) { bnrgm0_process(0); }
+    }
+    sent += len;
+  }
+  uint64_t last = now_us();
+  while (!bnrgm0_streamFlush(0) || bnrgm0_getQueuedCharValues(0) != 0) {
+    uint8_t left = bnrgm0_getQueuedCharValues(0);
+    bnrgm0_process(0);
+    if (bnrgm0_getQueuedCharValues(0) != left) { last = now_us(); }
+    if (now_us() - last > BENCH_IDLE_US * 10) { break; }
+  }
+  uint64_t elapsed = now_us() - t0;
+
+  const bnrgm0_emu_stats_t *es = bnrgm0_emu_getStats();
+  printf("stream via bnrgm0_streamWrite (%u bytes per write, ATT_MTU %u)\n", BENCH_STREAM_WR,
+         bnrgm0_getAttMtu(0, conn));
+  printf("  payload bytes sent/written             %10u / %u\n", es->notification_bytes, total);
+  printf("  bytes per notification                 %10.1f\n",
+         es->notifications ? (double) es->notification_bytes / es->notifications : 0.0);
+  printf("  notifications/sec                      %10.0f\n", es->notifications / (elapsed / 1e6));
+  printf("  payload bytes/sec                      %10.0f\n", es->notification_bytes / (elapsed / 1e6));
+}
+
+// A sensor sampled at a fixed rate, its value changing every BENCH_SHADOW_RUN
+// samples, on a notified characteristic and on a read-only one: the shadows
+// skip the unchanged samples and defer the read-only value to the peer read.
+static void bench_shadow(void) {
+  uint8_t value[BENCH_SHADOW_LEN];
+  uint8_t peer[BENCH_SHADOW_LEN];
+  ble_conn_t conn = bnrgm0_getConnHandle(0);
+
+  bnrgm0_emu_clearStats();
+  uint64_t t0 = now_us();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    memset(value, (uint8_t) (i / BENCH_SHADOW_RUN), sizeof(value));
+    bnrgm0_updateCharValue(0, conn, &sensor_char[0], value, sizeof(value));
+    bnrgm0_updateCharValue(0, conn, &info_char[0], value, sizeof(value));
+  }
+  uint64_t elapsed   = now_us() - t0;
+  uint32_t notified  = bnrgm0_emu_getStats()->notifications;
+  uint32_t read_only = bnrgm0_emu_getStats()->char_updates - notified;
+
+  // the peer reads the read-only value
+  bnrgm0_emu_attrRead(info_char[0]._char_val_handle);
+  uint64_t t = now_us();
+  while (bnrgm0_emu_getStats()->reads_allowed == 0 && now_us() - t < BENCH_IDLE_US) {
+    bnrgm0_process(0);
+  }
+  uint16_t len = bnrgm0_emu_charValue(info_char[0]._char_decl_handle, peer, sizeof(peer));
+  bool intact  = bnrgm0_emu_getStats()->reads_allowed == 1 && len == sizeof(value) && !memcmp(peer, value, len);
+
+  printf("shadowed updates via bnrgm0_updateCharValue (value changing every %u samples)\n", BENCH_SHADOW_RUN);
+  printf("  samples notified/read-only             %10u / %u\n", opts.iterations, opts.iterations);
+  printf("  update commands notified/read-only     %10u / %u\n", notified, read_only);
+  printf("  samples/sec                            %10.0f\n", 2 * opts.iterations / (elapsed / 1e6));
+  printf("  read-only value read by the peer       %10s\n", intact ? "intact" : "CORRUPTED");
+}
+
+// Telemetry sampled every BENCH_SAMPLE_US through a coalesced characteristic:
+// the samples the link (-k) or the minimum interval (-m) cannot carry are
+// replaced by newer ones, the sampling loop never waits, and the peer ends up
+// with the last sample.
+static void bench_coalescing(void) {
+  uint8_t peer[sizeof(uint32_t)];
+  uint64_t call_max_ns = 0;
+  ble_conn_t conn      = bnrgm0_getConnHandle(0);
+
+  bnrgm0_emu_clearStats();
+  uint64_t t0   = now_us();
+  uint64_t next = t0;
+  for (uint32_t i = 1; i <= opts.iterations; i++) {
+    while (now_us() < next) {
+      bnrgm0_process(0);
+    }
+    next += BENCH_SAMPLE_US;
+    uint64_t t = now_ns();
+    bnrgm0_updateCharValue(0, conn, &telemetry_char[0], (const uint8_t *) &i, sizeof(i));
+    t = now_ns() - t;
+    if (t > call_max_ns) { call_max_ns = t; }
+  }
+  uint64_t last = now_us();
+  while (bnrgm0_getQueuedCharValues(0) != 0 && now_us() - last < BENCH_IDLE_US * 10) {
+    bnrgm0_process(0);
+  }
+  uint64_t elapsed = now_us() - t0;
+
+  const bnrgm0_emu_stats_t *es = bnrgm0_emu_getStats();
+  bnrgm0_emu_charValue(telemetry_char[0]._char_decl_handle, peer, sizeof(peer));
+  bool newest = !memcmp(peer, &opts.iterations, sizeof(peer));
+  printf("coalesced telemetry (sample every %u us, min interval %u ms)\n", BENCH_SAMPLE_US, opts.min_interval_ms);
+  printf("  samples/notified                       %10u / %u\n", opts.iterations, es->notifications);
+  printf("  longest bnrgm0_updateCharValue (us)    %10.2f\n", call_max_ns / 1000.0);
+  printf("  notifications/sec                      %10.0f\n", es->notifications / (elapsed / 1e6));
+  printf("  last value received by the peer        %10s\n", newest ? "newest" : "STALE");
+}
+
+// A dashboard of BENCH_DASH_CHARS characteristics updated every sample, one
+// bnrgm0_updateCharValue() call each, then all of them in one
+// bnrgm0_updateCharValues() call.
+static void bench_batch(void) {
+  uint32_t values[BENCH_DASH_CHARS];
+  ble_char_update_t updates[BENCH_DASH_CHARS];
+  ble_conn_t conn = bnrgm0_getConnHandle(0);
+  uint64_t elapsed[2];
+  uint32_t failed[2] = {0};
+  uint32_t notified[2];
+
+  for (uint8_t c = 0; c < BENCH_DASH_CHARS; c++) {
+    updates[c].charact   = &dash_char[0][c];
+    updates[c].value     = (const uint8_t *) &values[c];
+    updates[c].value_len = sizeof(values[c]);
+  }
+  for (uint8_t batched = 0; batched < 2; batched++) {
+    bnrgm0_emu_clearStats();
+    uint64_t t0 = now_us();
+    for (uint32_t i = 0; i < opts.iterations; i++) {
+      for (uint8_t c = 0; c < BENCH_DASH_CHARS; c++) {
+        values[c] = i * BENCH_DASH_CHARS + c + batched;
+      }
+      if (batched) {
+        if (!bnrgm0_updateCharValues(0, conn, updates, BENCH_DASH_CHARS)) { failed[1]++; }
+      } else {
+        for (uint8_t c = 0; c < BENCH_DASH_CHARS; c++) {
+          if (!bnrgm0_updateCharValue(0, conn, &dash_char[0][c], updates[c].value, sizeof(values[c]))) {
+            failed[0]++;
+          }
+        }
+      }
+    }
+    elapsed[batched]  = now_us() - t0;
+    notified[batched] = bnrgm0_emu_getStats()->notifications;
+  }
+
+  bool intact = true;
+  for (uint8_t c = 0; c < BENCH_DASH_CHARS; c++) {
+    uint32_t peer = 0;
+    bnrgm0_emu_charValue(dash_char[0][c]._char_decl_handle, (uint8_t *) &peer, sizeof(peer));
+    if (peer != values[c]) { intact = false; }
+  }
+  printf("dashboard of %u characteristics (ncmd %u)\n", BENCH_DASH_CHARS, opts.emu.ncmd);
+  printf("  notified/failed one by one             %10u / %u\n", notified[0], failed[0]);
+  printf("  notified/failed batched                %10u / %u\n", notified[1], failed[1]);
+  printf("  samples/sec one by one                 %10.0f\n", opts.iterations / (elapsed[0] / 1e6));
+  printf("  samples/sec batched                    %10.0f\n", opts.iterations / (elapsed[1] / 1e6));
+  printf("  last values read by the peer           %10s\n", intact ? "intact" : "CORRUPTED");
+}
+
+static void bench_event_flood(void) {
+  uint8_t data[BENCH_FLOOD_LEN];
+  memset(data, 0xA5, sizeof(data));
+
+  seen.attr_writes = 0;
+  seen.deferred    = 0;
+  seen.corrupted   = 0;
+  bnrgm0_emu_clearStats();
+  eon_host_irq_max_ns(BNRGM0_EMU_IRQN);
+  for (uint32_t i = 0; i < opts.flood; i++) {
+    data[0] = (uint8_t) i;
+    bnrgm0_emu_attrWrite(write_char[0]._char_val_handle, data, sizeof(data));
+  }
+  uint64_t t0   = now_us();
+  uint64_t last = t0;
+  while (seen.attr_writes < opts.flood) {
+    uint32_t before = seen.attr_writes;
+    bnrgm0_process(0);
+    defer_drain();
+    if (seen.attr_writes != before) {
+      last = now_us();
+    } else if (now_us() - last > BENCH_IDLE_US) {
+      break;
+    }
+  }
+  uint64_t elapsed = last - t0;
+  uint32_t isr_ns  = eon_host_irq_max_ns(BNRGM0_EMU_IRQN);
+
+  printf("event flood (%u attribute modified events)\n", opts.flood);
+  printf("  delivered/stranded                     %10u / %u\n", seen.attr_writes, bnrgm0_emu_pendingEvents());
+  printf("  dropped by the emulator queue          %10u\n", bnrgm0_emu_getStats()->dropped_events);
+  printf("  payloads read by DMA                   %10u\n", bnrgm0_emu_getStats()->dma_reads);
+  tHciStats hs;
+  hci_get_stats(&hs);
+  printf("  reads paused/resumed                   %10u / %u\n", hs.rxPaused, hs.rxResumed);
+  printf("  rx queue high-water mark               %10u\n", hs.rxQueueMax);
+  printf("  pool low-water mark large/small        %10u / %u\n", hs.poolFreeMin, hs.poolSmallFreeMin);
+  printf("  longest EXTI ISR (us)                  %10.2f\n", isr_ns / 1000.0);
+  printf("  retained/corrupted                     %10u / %u\n", seen.deferred, seen.corrupted);
+  printf("  events/sec                             %10.0f\n",
+         elapsed ? seen.attr_writes / (elapsed / 1e6) : 0.0);
+}
+
+// Attribute writes queued in the controller ahead of a synchronous command:
+// the response only comes once the driver has read all of them, parking those
+// the read packets cannot hold. None is handed to the application meanwhile.
+static bool bench_sync_flood(void) {
+  uint8_t data[BENCH_FLOOD_LEN];
+  uint8_t addr[6];
+  memset(data, 0x5A, sizeof(data));
+
+  seen.attr_writes = 0;
+  tHciStats hs;
+  hci_get_stats(&hs);
+  uint32_t parked = hs.rxEvtParked;
+  for (uint32_t i = 0; i < opts.flood; i++) {
+    bnrgm0_emu_attrWrite(write_char[0]._char_val_handle, data, sizeof(data));
+  }
+  uint64_t t0 = now_us();
+  int ret     = hci_read_bd_addr(addr);
+  uint64_t t1 = now_us();
+  uint32_t in_call = seen.attr_writes;
+  uint64_t last    = t1;
+  while (seen.attr_writes < opts.flood && now_us() - last < BENCH_IDLE_US) {
+    bnrgm0_process(0);
+  }
+  defer_drain();
+  hci_get_stats(&hs);
+
+  printf("sync command behind %u attribute modified events\n", opts.flood);
+  printf("  hci_read_bd_addr status/time (us)      %10d / %llu\n", ret, (unsigned long long) (t1 - t0));
+  printf("  events handled during/after the call   %10u / %u\n", in_call, seen.attr_writes - in_call);
+  printf("  events parked by the wait              %10u\n", hs.rxEvtParked - parked);
+  return ret == 0 && in_call == 0 && seen.attr_writes == opts.flood;
+}
+
+// HCI capture of the last packets, for host/build/btsnoop_latency.
+#ifdef HCI_SNOOP_RING_SIZE
+static FILE *snoop_out;
+
+static void snoop_write(const uint8_t *data, uint16_t len) { fwrite(data, 1, len, snoop_out); }
+#endif
+
+static bool bench_snoop(void) {
+  if (opts.snoop_file == NULL) { return true; }
+#ifdef HCI_SNOOP_RING_SIZE
+  snoop_out = fopen(opts.snoop_file, "wb");
+  if (snoop_out == NULL) { return false; }
+  uint32_t n = hci_snoop_dump(snoop_write);
+  fclose(snoop_out);
+  printf("hci capture\n");
+  printf("  packets written to %-20s %8u\n", opts.snoop_file, n);
+  return true;
+#else
+  printf("-t needs a build with the HCI capture: make -C host SNOOP=256\n");
+  return false;
+#endif
+}
+
+// ===============================================================
+// Main
+// ===============================================================
+
+static void usage(const char *argv0) {
+  printf("usage: %s [-n iterations] [-f flood_events] [-l cmd_latency_us] [-k link_pkt_us] [-p tx_pool] [-c ncmd] [-d spi_dma_us] [-b rx_budget_pkts] [-u rx_budget_us] [-w spi_busy_us] [-s spi_clean_step] [-t btsnoop_file] [-r radios] [-m min_interval_ms]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+  opts.iterations = 2000;
+  opts.flood      = 32;
+  opts.radios     = 1;
+  bnrgm0_emu_defaultConfig(&opts.emu);
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    uint32_t v = (uint32_t) strtoul(argv[i + 1], NULL, 0);
+    if (!strcmp(argv[i], "-n")) {
+      opts.iterations = v;
+    } else if (!strcmp(argv[i], "-f")) {
+      opts.flood = v;
+    } else if (!strcmp(argv[i], "-l")) {
+      opts.emu.cmd_latency_us = v;
+    } else if (!strcmp(argv[i], "-k")) {
+      opts.emu.link_pkt_us = v;
+    } else if (!strcmp(argv[i], "-p")) {
+      opts.emu.tx_pool_size = (uint8_t) v;
+    } else if (!strcmp(argv[i], "-c")) {
+      opts.emu.ncmd = (uint8_t) v;
+    } else if (!strcmp(argv[i], "-d")) {
+      opts.emu.spi_dma_us = v;
+    } else if (!strcmp(argv[i], "-w")) {
+      opts.emu.spi_busy_us = v;
+    } else if (!strcmp(argv[i], "-s")) {
+      opts.spi_cal            = true;
+      opts.emu.spi_clean_step = (uint8_t) v;
+    } else if (!strcmp(argv[i], "-r") && v >= 1 && v <= HCI_NUM_INSTANCES) {
+      opts.radios = (uint8_t) v;
+    } else if (!strcmp(argv[i], "-m")) {
+      opts.min_interval_ms = (uint16_t) v;
+    } else if (!strcmp(argv[i], "-t")) {
+      opts.snoop_file = argv[i + 1];
+    } else if (!strcmp(argv[i], "-b")) {
+      opts.rx_budget_pkts = (uint8_t) v;
+    } else if (!strcmp(argv[i], "-u")) {
+      opts.rx_budget_us = v;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+    i++;
+  }
+
+  printf("bnrgm0 benchmark: %u iterations, cmd latency %u us, link %u us/pkt, tx pool %u\n",
+         opts.iterations, opts.emu.cmd_latency_us, opts.emu.link_pkt_us, opts.emu.tx_pool_size);
+
+  if (!bench_init()) {
+    printf("init failed\n");
+    return 1;
+  }
+  bench_opcodes();
+  bench_async();
+  if (!bench_connect()) {
+    printf("connection failed\n");
+    return 1;
+  }
+  bench_notifications();
+  bench_queued();
+  bench_long_value();
+  bench_stream();
+  bench_shadow();
+  bench_coalescing();
+  bench_batch();
+  bench_event_flood();
+  if (!bench_sync_flood()) {
+    printf("sync command lost behind the events\n");
+    return 1;
+  }
+  return bench_snoop() ? 0 : 1;
+}
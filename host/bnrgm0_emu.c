@@ -0,0 +1,737 @@
+#include "bnrgm0_emu.h"
+#include "bnrgm0.h"
+#include "bluenrg_aci_const.h"
+#include "bluenrg_def.h"
+#include "bluenrg_gatt_aci.h"
+#include "bluenrg_hal_aci.h"
+#include "hci_const.h"
+#include "hci_tl.h"
+#include <stdlib.h>
+#include <time.h>
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define EMU_EVT_QUEUE_LEN     64U
+#define EMU_EVT_MAX_LEN       (1U + HCI_EVENT_HDR_SIZE + 255U)
+#define EMU_WIRE_SIZE         (1U + HCI_COMMAND_HDR_SIZE + 255U)
+#define EMU_CONFIG_DATA_LEN   64U
+#define EMU_TX_POOL_THRESHOLD 2U
+#define EMU_FIRST_HANDLE      0x0001U
+#define EMU_NO_SLOT           0xFFU
+#define EMU_DMA_MIN_LEN       16U
+#define EMU_SPI_BASE_HZ       500000U
+#define EMU_SPI_MAX_STEP      5U
+#define EMU_CHAR_MAX          16U
+#define EMU_CHAR_VALUE_MAX    512U // ATT maximum
+#define EMU_CLIENT_RX_MTU     158U // of the BlueNRG-MS, sent in the exchange MTU request
+
+#define OPCODE(ogf, ocf) cmd_opcode_pack(ogf, ocf)
+
+// ===============================================================
+// Private structure
+// ===============================================================
+
+typedef struct {
+  uint64_t due_us;
+  uint8_t next;
+  uint16_t len;
+  uint8_t buf[EMU_EVT_MAX_LEN];
+} emu_evt_t;
+
+// One controller per driver instance, selected with hci_select()
+typedef struct {
+  bnrgm0_emu_cfg_t cfg;
+  bnrgm0_emu_stats_t stats;
+  // event queue, sorted by due time
+  emu_evt_t slots[EMU_EVT_QUEUE_LEN];
+  uint8_t head;
+  uint8_t tail;
+  uint8_t free;
+  uint32_t pending;
+  uint32_t cmds_in_flight; // commands whose complete/status was not read yet
+  // background payload read, like the SPI DMA of hci_tl_interface.c
+  struct {
+    uint8_t active;
+    uint16_t len;
+    uint64_t due_us;
+  } dma;
+  IRQn_Type irqn;     // EXTI line
+  IRQn_Type dma_irqn; // DMA transfer complete
+  uint8_t irq_disable_nesting;
+  uint64_t spi_ready_us; // write buffer ready again
+  uint8_t spi_step;      // SPI clock set by BNRGM0_EMU_SpiSpeed()
+  uint32_t spi_reads;
+  // bottom half mode of hci_tl_interface.c
+  uint8_t rx_budget_pkts;
+  uint32_t rx_budget_us;
+  volatile uint8_t rx_pending;
+  // controller state
+  uint8_t config_data[EMU_CONFIG_DATA_LEN];
+  uint16_t next_handle;
+  uint8_t is_connected;
+  uint16_t conn_handle;
+  uint16_t att_mtu;
+  // notification tx pool
+  uint8_t tx_used;
+  uint64_t tx_next_free_us;
+  uint64_t tx_avail_due_us;
+  uint8_t tx_avail_scheduled;
+  // characteristic values, as a peer would read them
+  struct {
+    uint16_t handle; // declaration handle
+    uint16_t len;
+    uint8_t value[EMU_CHAR_VALUE_MAX];
+  } chars[EMU_CHAR_MAX];
+  uint8_t n_chars;
+} emu_t;
+
+static emu_t emu_inst[HCI_NUM_INSTANCES];
+static emu_t *emu = &emu_inst[0];
+
+static uint64_t emu_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+// ===============================================================
+// Event queue
+// ===============================================================
+
+static void evt_queue_init(void) {
+  for (uint8_t i = 0; i < EMU_EVT_QUEUE_LEN; i++) {
+    emu->slots[i].next = (i + 1 < EMU_EVT_QUEUE_LEN) ? i + 1 : EMU_NO_SLOT;
+  }
+  emu->free    = 0;
+  emu->head    = EMU_NO_SLOT;
+  emu->tail           = EMU_NO_SLOT;
+  emu->pending        = 0;
+  emu->cmds_in_flight = 0;
+}
+
+// Queue an HCI event packet (event code + parameters) to be readable at due_us.
+static void evt_push(uint64_t due_us, uint8_t evt, const uint8_t *param, uint8_t plen) {
+  if (emu->free == EMU_NO_SLOT) {
+    emu->stats.dropped_events++;
+    return;
+  }
+  uint8_t idx  = emu->free;
+  emu_evt_t *e = &emu->slots[idx];
+  emu->free     = e->next;
+
+  e->due_us = due_us;
+  e->buf[0] = HCI_EVENT_PKT;
+  e->buf[1] = evt;
+  e->buf[2] = plen;
+  memcpy(&e->buf[3], param, plen);
+  e->len  = 3 + plen;
+  e->next = EMU_NO_SLOT;
+
+  if (emu->head == EMU_NO_SLOT) {
+    emu->head = idx;
+    emu->tail = idx;
+  } else if (emu->slots[emu->tail].due_us <= due_us) {
+    emu->slots[emu->tail].next = idx;
+    emu->tail                 = idx;
+  } else if (emu->slots[emu->head].due_us > due_us) {
+    e->next  = emu->head;
+    emu->head = idx;
+  } else {
+    uint8_t prev = emu->head;
+    while (emu->slots[emu->slots[prev].next].due_us <= due_us) {
+      prev = emu->slots[prev].next;
+    }
+    e->next               = emu->slots[prev].next;
+    emu->slots[prev].next = idx;
+  }
+  emu->pending++;
+}
+
+static bool evt_due_of(const emu_t *e, uint64_t now) {
+  return (e->head != EMU_NO_SLOT) && (e->slots[e->head].due_us <= now);
+}
+
+static bool evt_due(uint64_t now) { return evt_due_of(emu, now); }
+
+static void evt_cmd_complete_push(uint16_t opcode, const uint8_t *rp, uint8_t rlen) {
+  uint8_t param[EVT_CMD_COMPLETE_SIZE + 255];
+  param[0] = emu->cfg.ncmd;
+  param[1] = (uint8_t) opcode;
+  param[2] = (uint8_t) (opcode >> 8);
+  memcpy(&param[EVT_CMD_COMPLETE_SIZE], rp, rlen);
+  emu->cmds_in_flight++;
+  evt_push(emu_now_us() + emu->cfg.cmd_latency_us, EVT_CMD_COMPLETE, param, EVT_CMD_COMPLETE_SIZE + rlen);
+}
+
+static void evt_cmd_status_push(uint16_t opcode, uint8_t status) {
+  uint8_t param[EVT_CMD_STATUS_SIZE] = {status, emu->cfg.ncmd, (uint8_t) opcode, (uint8_t) (opcode >> 8)};
+  emu->cmds_in_flight++;
+  evt_push(emu_now_us() + emu->cfg.cmd_latency_us, EVT_CMD_STATUS, param, sizeof(param));
+}
+
+static void evt_vendor_push(uint64_t due_us, uint16_t ecode, const uint8_t *data, uint8_t len) {
+  uint8_t param[255];
+  param[0] = (uint8_t) ecode;
+  param[1] = (uint8_t) (ecode >> 8);
+  memcpy(&param[2], data, len);
+  evt_push(due_us, EVT_VENDOR, param, 2 + len);
+}
+
+// ===============================================================
+// Notification tx pool
+// ===============================================================
+
+// Release the buffers whose notification went over the air.
+static void tx_pool_drain(uint64_t now) {
+  if (emu->cfg.link_pkt_us == 0) {
+    emu->tx_used = 0;
+    return;
+  }
+  while (emu->tx_used > 0 && now >= emu->tx_next_free_us) {
+    emu->tx_used--;
+    emu->tx_next_free_us += emu->cfg.link_pkt_us;
+  }
+}
+
+// Returns false if the pool is full, in which case a TX pool available event
+// is scheduled for when enough buffers have been released.
+static bool tx_pool_take(uint64_t now) {
+  tx_pool_drain(now);
+  if (emu->tx_used < emu->cfg.tx_pool_size) {
+    if (emu->tx_used == 0) { emu->tx_next_free_us = now + emu->cfg.link_pkt_us; }
+    emu->tx_used++;
+    emu->tx_avail_scheduled = 0;
+    return true;
+  }
+  emu->stats.insufficient_resources++;
+  if (!emu->tx_avail_scheduled || now >= emu->tx_avail_due_us) {
+    uint8_t k = (emu->cfg.tx_pool_size < EMU_TX_POOL_THRESHOLD) ? emu->cfg.tx_pool_size : EMU_TX_POOL_THRESHOLD;
+    if (k == 0) { k = 1; }
+    emu->tx_avail_due_us    = emu->tx_next_free_us + (uint64_t) (k - 1) * emu->cfg.link_pkt_us;
+    emu->tx_avail_scheduled = 1;
+    uint8_t data[4]        = {(uint8_t) emu->conn_handle, (uint8_t) (emu->conn_handle >> 8), k, 0};
+    evt_vendor_push(emu->tx_avail_due_us, EVT_BLUE_GATT_TX_POOL_AVAILABLE, data, sizeof(data));
+  }
+  return false;
+}
+
+// ===============================================================
+// Command processing
+// ===============================================================
+
+static uint16_t alloc_handles(uint16_t count) {
+  uint16_t handle = emu->next_handle;
+  emu->next_handle += count;
+  return handle;
+}
+
+// Value of the characteristic declared at handle, allocated on its first update.
+static uint8_t *char_value(uint16_t handle, uint16_t **len) {
+  uint8_t i = 0;
+  while (i < emu->n_chars && emu->chars[i].handle != handle) {
+    i++;
+  }
+  if (i == EMU_CHAR_MAX) { return NULL; }
+  if (i == emu->n_chars) {
+    emu->chars[i].handle = handle;
+    emu->chars[i].len    = 0;
+    emu->n_chars++;
+  }
+  *len = &emu->chars[i].len;
+  return emu->chars[i].value;
+}
+
+static void controller_reset(void) {
+  evt_queue_init();
+  emu->n_chars = 0;
+  memset(emu->config_data, 0, sizeof(emu->config_data));
+  emu->next_handle        = EMU_FIRST_HANDLE;
+  emu->is_connected       = 0;
+  emu->conn_handle        = 0;
+  emu->tx_used            = 0;
+  emu->tx_avail_scheduled = 0;
+}
+
+static void process_cmd(uint16_t opcode, const uint8_t *cp, uint8_t plen) {
+  uint8_t rp[HCI_MAX_PAYLOAD_SIZE];
+  memset(rp, 0, sizeof(rp));
+  emu->stats.cmds++;
+
+  switch (opcode) {
+    case OPCODE(OGF_HOST_CTL, OCF_RESET):
+      controller_reset();
+      evt_cmd_complete_push(opcode, rp, 1);
+      break;
+
+    case OPCODE(OGF_LE_CTL, OCF_LE_RAND):
+      for (uint8_t i = 0; i < 8; i++) {
+        rp[1 + i] = (uint8_t) rand();
+      }
+      evt_cmd_complete_push(opcode, rp, 9);
+      break;
+
+    case OPCODE(OGF_INFO_PARAM, OCF_READ_BD_ADDR):
+      memcpy(&rp[1], &emu->config_data[CONFIG_DATA_PUBADDR_OFFSET], CONFIG_DATA_PUBADDR_LEN);
+      evt_cmd_complete_push(opcode, rp, 1 + CONFIG_DATA_PUBADDR_LEN);
+      break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_HAL_WRITE_CONFIG_DATA): {
+      uint8_t offset = cp[0];
+      uint8_t len    = cp[1];
+      if ((uint16_t) offset + len > EMU_CONFIG_DATA_LEN) {
+        rp[0] = BLE_STATUS_INVALID_PARAMS;
+      } else {
+        memcpy(&emu->config_data[offset], &cp[2], len);
+      }
+      evt_cmd_complete_push(opcode, rp, 1);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_HAL_READ_CONFIG_DATA): {
+      uint8_t offset = cp[0];
+      uint8_t len    = (offset == CONFIG_DATA_PUBADDR_OFFSET) ? CONFIG_DATA_PUBADDR_LEN : 1;
+      if ((uint16_t) offset + len > EMU_CONFIG_DATA_LEN) {
+        rp[0] = BLE_STATUS_INVALID_PARAMS;
+        len   = 0;
+      } else {
+        memcpy(&rp[1], &emu->config_data[offset], len);
+      }
+      evt_cmd_complete_push(opcode, rp, 1 + len);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GAP_INIT): {
+      uint16_t service = alloc_handles(5);
+      uint16_t name    = service + 1;
+      uint16_t appear  = service + 3;
+      rp[1]            = (uint8_t) service;
+      rp[2]            = (uint8_t) (service >> 8);
+      rp[3]            = (uint8_t) name;
+      rp[4]            = (uint8_t) (name >> 8);
+      rp[5]            = (uint8_t) appear;
+      rp[6]            = (uint8_t) (appear >> 8);
+      evt_cmd_complete_push(opcode, rp, GAP_INIT_RP_SIZE);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_ADD_SERV): {
+      uint16_t handle = alloc_handles(1);
+      rp[1]           = (uint8_t) handle;
+      rp[2]           = (uint8_t) (handle >> 8);
+      evt_cmd_complete_push(opcode, rp, GATT_ADD_SERV_RP_SIZE);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_ADD_CHAR): {
+      // declaration, value and CCCD
+      uint16_t handle = alloc_handles(3);
+      rp[1]           = (uint8_t) handle;
+      rp[2]           = (uint8_t) (handle >> 8);
+      evt_cmd_complete_push(opcode, rp, GATT_ADD_SERV_RP_SIZE);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_UPD_CHAR_VAL_EXT): {
+      uint16_t char_handle = cp[2] | (cp[3] << 8);
+      uint8_t update_type  = cp[4];
+      uint16_t char_length = cp[5] | (cp[6] << 8);
+      uint16_t offset      = cp[7] | (cp[8] << 8);
+      uint8_t value_length = cp[9];
+      uint16_t *len;
+      uint8_t *value = char_value(char_handle, &len);
+      emu->stats.char_updates++;
+      if (value == NULL || char_length > EMU_CHAR_VALUE_MAX || (uint32_t) offset + value_length > char_length) {
+        rp[0] = BLE_STATUS_INVALID_PARAMS;
+        evt_cmd_complete_push(opcode, rp, 1);
+        break;
+      }
+      memcpy(&value[offset], &cp[GATT_UPD_CHAR_VAL_EXT_CP_SIZE], value_length);
+      *len = char_length;
+      // The notification goes out with the last chunk of the value.
+      bool notify = emu->is_connected && ((update_type & 0x03) != 0) &&
+                    ((uint32_t) offset + value_length >= char_length);
+      if (notify) {
+        if (tx_pool_take(emu_now_us())) {
+          emu->stats.notifications++;
+          // the notification carries the first ATT_MTU-3 bytes
+          emu->stats.notification_bytes += (char_length < emu->att_mtu - 3) ? char_length : emu->att_mtu - 3;
+        } else {
+          rp[0] = BLE_STATUS_INSUFFICIENT_RESOURCES;
+        }
+      }
+      evt_cmd_complete_push(opcode, rp, 1);
+    } break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_EXCHANGE_CONFIG): {
+      if (!emu->is_connected) {
+        evt_cmd_status_push(opcode, BLE_STATUS_INVALID_PARAMS);
+        break;
+      }
+      evt_cmd_status_push(opcode, BLE_STATUS_SUCCESS);
+      emu->att_mtu    = (emu->cfg.server_rx_mtu < EMU_CLIENT_RX_MTU) ? emu->cfg.server_rx_mtu : EMU_CLIENT_RX_MTU;
+      uint8_t data[5] = {(uint8_t) emu->conn_handle, (uint8_t) (emu->conn_handle >> 8), 2,
+                         (uint8_t) emu->cfg.server_rx_mtu, (uint8_t) (emu->cfg.server_rx_mtu >> 8)};
+      evt_vendor_push(emu_now_us() + 2 * emu->cfg.cmd_latency_us, EVT_BLUE_ATT_EXCHANGE_MTU_RESP, data, sizeof(data));
+    } break;
+
+    case OPCODE(OGF_LINK_CTL, OCF_DISCONNECT):
+    case OPCODE(OGF_VENDOR_CMD, OCF_GAP_TERMINATE):
+      evt_cmd_status_push(opcode, emu->is_connected ? BLE_STATUS_SUCCESS : BLE_STATUS_INVALID_PARAMS);
+      if (emu->is_connected) { bnrgm0_emu_disconnect(0x16); }
+      break;
+
+    case OPCODE(OGF_LE_CTL, OCF_LE_SET_SCAN_RESPONSE_DATA):
+    case OPCODE(OGF_VENDOR_CMD, OCF_HAL_SET_TX_POWER_LEVEL):
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_INIT):
+    case OPCODE(OGF_VENDOR_CMD, OCF_GAP_SET_DISCOVERABLE):
+    case OPCODE(OGF_VENDOR_CMD, OCF_GAP_SET_NON_DISCOVERABLE):
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_WRITE_RESPONSE):
+      evt_cmd_complete_push(opcode, rp, 1);
+      break;
+
+    case OPCODE(OGF_VENDOR_CMD, OCF_GATT_ALLOW_READ):
+      emu->stats.reads_allowed++;
+      evt_cmd_complete_push(opcode, rp, 1);
+      break;
+
+    default:
+      rp[0] = ERR_UNKNOWN_HCI_COMMAND;
+      evt_cmd_complete_push(opcode, rp, 1);
+      break;
+  }
+}
+
+// ===============================================================
+// Configuration
+// ===============================================================
+
+void bnrgm0_emu_defaultConfig(bnrgm0_emu_cfg_t *cfg) {
+  cfg->cmd_latency_us = 0;
+  cfg->link_pkt_us    = 0;
+  cfg->tx_pool_size   = 8;
+  cfg->ncmd           = 1;
+  cfg->server_rx_mtu  = 158;
+  cfg->spi_dma_us     = 0;
+  cfg->spi_busy_us    = 0;
+  cfg->spi_write_buf  = HCI_MAX_PAYLOAD_SIZE;
+  cfg->spi_clean_step = EMU_SPI_MAX_STEP;
+}
+
+void bnrgm0_emu_setConfig(const bnrgm0_emu_cfg_t *cfg) { emu->cfg = *cfg; }
+
+const bnrgm0_emu_stats_t *bnrgm0_emu_getStats(void) { return &emu->stats; }
+
+void bnrgm0_emu_clearStats(void) { memset(&emu->stats, 0, sizeof(emu->stats)); }
+
+uint32_t bnrgm0_emu_pendingEvents(void) { return emu->pending; }
+
+uint16_t bnrgm0_emu_charValue(uint16_t char_handle, uint8_t *buf, uint16_t size) {
+  uint16_t *len;
+  uint8_t *value = char_value(char_handle, &len);
+  if (value == NULL) { return 0; }
+  memcpy(buf, value, (*len < size) ? *len : size);
+  return *len;
+}
+
+// ===============================================================
+// Peer simulation
+// ===============================================================
+
+void bnrgm0_emu_connect(uint16_t conn_handle, const uint8_t peer_addr[6]) {
+  uint8_t evt[1 + EVT_LE_CONN_COMPLETE_SIZE];
+  memset(evt, 0, sizeof(evt));
+  evt[0] = EVT_LE_CONN_COMPLETE;
+  evt[2] = (uint8_t) conn_handle;
+  evt[3] = (uint8_t) (conn_handle >> 8);
+  evt[4] = 0x01; // slave
+  memcpy(&evt[6], peer_addr, 6);
+  evt[12] = CONN_P1;
+  evt[16] = SUPERV_TIMEOUT;
+
+  emu->is_connected = 1;
+  emu->conn_handle  = conn_handle;
+  emu->att_mtu      = ATT_MTU;
+  emu->tx_used      = 0;
+  evt_push(emu_now_us(), EVT_LE_META_EVENT, evt, sizeof(evt));
+}
+
+void bnrgm0_emu_disconnect(uint8_t reason) {
+  uint8_t evt[EVT_DISCONN_COMPLETE_SIZE] = {0x00, (uint8_t) emu->conn_handle,
+                                            (uint8_t) (emu->conn_handle >> 8), reason};
+  emu->is_connected = 0;
+  evt_push(emu_now_us() + emu->cfg.cmd_latency_us, EVT_DISCONN_COMPLETE, evt, sizeof(evt));
+}
+
+void bnrgm0_emu_attrWrite(uint16_t attr_handle, const uint8_t *data, uint8_t data_len) {
+  uint8_t evt[7 + 255];
+  evt[0] = (uint8_t) emu->conn_handle;
+  evt[1] = (uint8_t) (emu->conn_handle >> 8);
+  evt[2] = (uint8_t) attr_handle;
+  evt[3] = (uint8_t) (attr_handle >> 8);
+  evt[4] = data_len;
+  evt[5] = 0; // offset
+  evt[6] = 0;
+  memcpy(&evt[7], data, data_len);
+  evt_vendor_push(emu_now_us(), EVT_BLUE_GATT_ATTRIBUTE_MODIFIED, evt, 7 + data_len);
+}
+
+void bnrgm0_emu_attrRead(uint16_t attr_handle) {
+  uint8_t evt[7] = {(uint8_t) emu->conn_handle, (uint8_t) (emu->conn_handle >> 8), (uint8_t) attr_handle,
+                    (uint8_t) (attr_handle >> 8), 2, 0, 0}; // offset 0
+  evt_vendor_push(emu_now_us(), EVT_BLUE_GATT_READ_PERMIT_REQ, evt, sizeof(evt));
+}
+
+// ===============================================================
+// tHciIO
+// ===============================================================
+
+int32_t BNRGM0_EMU_Init(void *pConf) { return 0; }
+
+int32_t BNRGM0_EMU_DeInit(void) { return 0; }
+
+int32_t BNRGM0_EMU_Reset(void) {
+  controller_reset();
+  return 0;
+}
+
+// Nested masking of the IRQ line, as HCI_TL_SPI_Disable/Enable_IRQ().
+static void emu_irq_disable(void) {
+  if (emu->irq_disable_nesting++ == 0) { NVIC_DisableIRQ(emu->irqn); }
+}
+
+static void emu_irq_enable(void) {
+  if (--emu->irq_disable_nesting == 0) { NVIC_EnableIRQ(emu->irqn); }
+}
+
+// Like the SPI transport: the length is known before the payload is read and
+// the event stays queued if the host has no buffer for it.
+static int32_t emu_receive(uint8_t *(*alloc)(uint16_t *size), uint8_t *buffer, uint16_t size) {
+  if (!evt_due(emu_now_us())) { return 0; }
+  uint8_t idx  = emu->head;
+  emu_evt_t *e = &emu->slots[idx];
+  if (alloc) {
+    size   = e->len;
+    buffer = alloc(&size);
+    if (!buffer) { return 0; }
+  }
+  uint16_t len = (e->len > size) ? size : e->len;
+
+  // Num_HCI_Command_Packets: credits left once this response is delivered
+  if (e->buf[1] == EVT_CMD_COMPLETE || e->buf[1] == EVT_CMD_STATUS) {
+    emu->cmds_in_flight--;
+    uint8_t ncmd = (emu->cmds_in_flight < emu->cfg.ncmd) ? emu->cfg.ncmd - emu->cmds_in_flight : 0;
+    e->buf[(e->buf[1] == EVT_CMD_COMPLETE) ? 3 : 4] = ncmd;
+  }
+  memcpy(buffer, e->buf, len);
+  // Above the clean step every other read loses its last byte
+  if (emu->spi_step > emu->cfg.spi_clean_step && (emu->spi_reads++ & 1) && len > 0) {
+    len--;
+    emu->stats.spi_corrupted++;
+  }
+
+  emu->head = e->next;
+  if (emu->head == EMU_NO_SLOT) { emu->tail = EMU_NO_SLOT; }
+  e->next  = emu->free;
+  emu->free = idx;
+  emu->pending--;
+  emu->stats.events++;
+  eon_host_irq_sample(emu->irqn);
+
+  if (alloc && emu->cfg.spi_dma_us && len >= EMU_DMA_MIN_LEN) {
+    emu->dma.active = 1;
+    emu->dma.len    = len;
+    emu->dma.due_us = emu_now_us() + emu->cfg.spi_dma_us;
+    emu->stats.dma_reads++;
+    emu_irq_disable();
+    return HCI_IO_PENDING;
+  }
+  return len;
+}
+
+int32_t BNRGM0_EMU_Receive(uint8_t *buffer, uint16_t size) { return emu_receive(NULL, buffer, size); }
+
+int32_t BNRGM0_EMU_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size)) { return emu_receive(alloc, NULL, 0); }
+
+// Accepts one or more back to back HCI command packets.
+static int32_t emu_send(const uint8_t *buffer, uint16_t size) {
+  uint16_t pos = 0;
+  while (pos + HCI_HDR_SIZE + HCI_COMMAND_HDR_SIZE <= size) {
+    if (buffer[pos] != HCI_COMMAND_PKT) { return -1; }
+    uint16_t opcode = buffer[pos + 1] | (buffer[pos + 2] << 8);
+    uint8_t plen    = buffer[pos + 3];
+    pos += HCI_HDR_SIZE + HCI_COMMAND_HDR_SIZE;
+    if (pos + plen > size) { return -1; }
+    process_cmd(opcode, &buffer[pos], plen);
+    pos += plen;
+  }
+  return 0;
+}
+
+// The write buffer takes spi_busy_us to be ready again after a write, its
+// free space is reported like the SPI header does.
+static uint16_t emu_write_space(void) { return (emu_now_us() < emu->spi_ready_us) ? 0 : emu->cfg.spi_write_buf; }
+
+static void emu_write_done(uint16_t space, uint16_t size) {
+  hci_notify_tx_space(emu->cfg.spi_busy_us ? 0 : space - size);
+  emu->spi_ready_us = emu_now_us() + emu->cfg.spi_busy_us;
+  emu->stats.tx_transfers++;
+}
+
+static void emu_write_busy(uint16_t space) {
+  hci_notify_tx_space(space);
+  emu->stats.tx_busy++;
+}
+
+int32_t BNRGM0_EMU_Send(uint8_t *buffer, uint16_t size) {
+  uint16_t space = emu_write_space();
+  if (size > space) {
+    emu_write_busy(space);
+    return HCI_IO_BUSY;
+  }
+  emu_write_done(space, size);
+  return emu_send(buffer, size);
+}
+
+// The whole packets fitting in the write buffer arrive back to back on the
+// wire, as one transfer.
+int32_t BNRGM0_EMU_SendV(const tHciIOVec *iov, uint8_t iovcnt) {
+  uint8_t wire[EMU_WIRE_SIZE];
+  uint16_t space = emu_write_space();
+  uint16_t size  = 0;
+  uint16_t len   = 0;
+  uint8_t count  = 0;
+  for (uint8_t i = 0; i < iovcnt && len + iov[i].len <= sizeof(wire); i++) {
+    memcpy(&wire[len], iov[i].data, iov[i].len);
+    len += iov[i].len;
+    if (iov[i].eop || i == iovcnt - 1) {
+      if (len > space) { break; }
+      count = i + 1;
+      size  = len;
+    }
+  }
+  if (count == 0) {
+    emu_write_busy(space);
+    return HCI_IO_BUSY;
+  }
+  emu_write_done(space, size);
+  return (emu_send(wire, size) < 0) ? -1 : count;
+}
+
+int32_t BNRGM0_EMU_GetTick(void) { return (int32_t) (emu_now_us() / 1000ULL); }
+
+uint32_t BNRGM0_EMU_SpiSpeed(SPI_TypeDef *SPIx, uint8_t step) {
+  if (step > EMU_SPI_MAX_STEP) { return 0; }
+  emu->spi_step = step;
+  return EMU_SPI_BASE_HZ << step;
+}
+
+// ===============================================================
+// hci_tl_interface replacement
+// ===============================================================
+
+static int emu_irq_line(void) { return evt_due(emu_now_us()); }
+
+// The IRQ lines are sampled whatever the selected instance, the ISRs select
+// their own through the bnrgm0 handlers.
+static int emu_dma_line_of(const emu_t *e) { return e->dma.active && emu_now_us() >= e->dma.due_us; }
+
+#if HCI_NUM_INSTANCES > 2
+#error "bnrgm0_emu: two instances at most"
+#endif
+
+static int emu_irq_line0(void) { return evt_due_of(&emu_inst[0], emu_now_us()); }
+static int emu_dma_line0(void) { return emu_dma_line_of(&emu_inst[0]); }
+static void emu_exti_isr0(void) { bnrgm0_exti_irq_handler(0); }
+static void emu_dma_isr0(void) { bnrgm0_spi_dma_irq_handler(0); }
+#if HCI_NUM_INSTANCES > 1
+static int emu_irq_line1(void) { return evt_due_of(&emu_inst[1], emu_now_us()); }
+static int emu_dma_line1(void) { return emu_dma_line_of(&emu_inst[1]); }
+static void emu_exti_isr1(void) { bnrgm0_exti_irq_handler(1); }
+static void emu_dma_isr1(void) { bnrgm0_spi_dma_irq_handler(1); }
+#endif
+
+static const struct {
+  int (*irq_line)(void);
+  int (*dma_line)(void);
+  void (*exti_isr)(void);
+  void (*dma_isr)(void);
+} emu_irqs[HCI_NUM_INSTANCES] = {
+  {emu_irq_line0, emu_dma_line0, emu_exti_isr0, emu_dma_isr0},
+#if HCI_NUM_INSTANCES > 1
+  {emu_irq_line1, emu_dma_line1, emu_exti_isr1, emu_dma_isr1},
+#endif
+};
+
+void hci_tl_lowlevel_select(uint8_t id) { emu = &emu_inst[id]; }
+
+void hci_tl_lowlevel_dma_isr(void) {
+  emu->dma.active = 0;
+  hci_notify_rx_complete(emu->dma.len);
+  hci_tl_lowlevel_isr();
+  emu_irq_enable();
+}
+
+// Power on the emulated controller of the selected instance and wire its IRQ
+// line and the DMA transfer complete interrupt to the driver.
+void hci_eon_brige(const bnrgm0_hw_t *hw) {
+  uint8_t id = (uint8_t) (emu - emu_inst);
+  controller_reset();
+  emu->rx_budget_pkts = hw->rx_budget_pkts;
+  emu->rx_budget_us   = hw->rx_budget_us;
+  emu->rx_pending     = 0;
+  emu->irqn           = hw->exti_irqn;
+  emu->dma_irqn       = (IRQn_Type) (BNRGM0_EMU_DMA_IRQN + 2 * id);
+  eon_host_irq_register(emu->irqn, emu_irqs[id].irq_line, emu_irqs[id].exti_isr);
+  eon_host_irq_register(emu->dma_irqn, emu_irqs[id].dma_line, emu_irqs[id].dma_isr);
+  NVIC_EnableIRQ(emu->dma_irqn);
+}
+
+void hci_tl_lowlevel_init(void) {
+  tHciIO fops;
+
+  fops.Init    = BNRGM0_EMU_Init;
+  fops.DeInit  = BNRGM0_EMU_DeInit;
+  fops.Send    = BNRGM0_EMU_Send;
+  fops.SendV   = BNRGM0_EMU_SendV;
+  fops.Receive = BNRGM0_EMU_Receive;
+  fops.ReceiveAlloc = BNRGM0_EMU_ReceiveAlloc;
+  fops.Reset   = BNRGM0_EMU_Reset;
+  fops.GetTick = BNRGM0_EMU_GetTick;
+
+  hci_register_io_bus(&fops);
+
+  NVIC_EnableIRQ(emu->irqn);
+}
+
+void hci_tl_lowlevel_isr(void) {
+  if (emu->rx_budget_pkts != 0) {
+    emu->rx_pending = 1;
+    hci_cmd_resp_release(1);
+    return;
+  }
+  while (!emu->dma.active && emu_irq_line()) {
+    if (hci_notify_asynch_evt(NULL)) {
+      return;
+    }
+  }
+}
+
+int32_t hci_tl_lowlevel_bottom_half(void) {
+  if (!emu->rx_pending) { return 0; }
+  emu->rx_pending = 0;
+
+  uint32_t start = micros();
+  uint8_t count  = 0;
+  while (!emu->dma.active && emu_irq_line()) {
+    if (count == emu->rx_budget_pkts || (emu->rx_budget_us != 0 && (micros() - start) >= emu->rx_budget_us)) {
+      emu->rx_pending = 1;
+      break;
+    }
+    count++;
+    if (hci_notify_asynch_evt(NULL)) { break; }
+  }
+  return emu->rx_pending;
+}
+
+void hci_tl_lowlevel_resume(void) {
+  emu_irq_disable();
+  hci_tl_lowlevel_isr();
+  emu_irq_enable();
+}
@@ -0,0 +1,91 @@
+#ifndef __BNRGM0_EMU_H_
+#define __BNRGM0_EMU_H_
+
+#include "eonOS.h"
+#include "hci_tl.h"
+
+// Host-side BlueNRG-MS controller emulator.
+//
+// It replaces src/hci_tl_interface.c on Linux: the driver registers the
+// BNRGM0_EMU_* functions as its tHciIO and the emulated EXTI line fires
+// hci_tl_lowlevel_isr() whenever a response or event is due.
+//
+// There is one controller per driver instance (HCI_NUM_INSTANCES, two at
+// most): the functions below act on the one selected with hci_select().
+
+// ===============================================================
+// Configuration
+// ===============================================================
+
+typedef struct {
+  uint32_t cmd_latency_us; // delay between a command and its response events
+  uint32_t link_pkt_us;    // air time of one notification (0 = unlimited link)
+  uint8_t tx_pool_size;    // controller buffers available for notifications
+  uint8_t ncmd;            // commands the controller can hold (Num_HCI_Command_Packets)
+  uint16_t server_rx_mtu;  // MTU reported by the ATT exchange MTU procedure
+  uint32_t spi_dma_us;     // duration of a DMA payload read (0 = polled reads)
+  uint32_t spi_busy_us;    // write buffer not ready after each write (HCI_IO_BUSY)
+  uint8_t spi_write_buf;   // write buffer space reported by the SPI header
+  uint8_t spi_clean_step;  // fastest SPI speed step read without errors
+} bnrgm0_emu_cfg_t;
+
+typedef struct {
+  uint32_t cmds;                   // HCI commands received
+  uint32_t events;                 // events read by the host
+  uint32_t notifications;          // notifications sent over the emulated link
+  uint32_t notification_bytes;     // payload bytes of the notifications
+  uint32_t insufficient_resources; // updates rejected because the tx pool was full
+  uint32_t dropped_events;         // events lost because the emulator queue was full
+  uint32_t tx_transfers;           // write transfers from the host (SPI CS low)
+  uint32_t dma_reads;              // payloads read in the background (HCI_IO_PENDING)
+  uint32_t tx_busy;                // writes refused while the write buffer was not ready
+  uint32_t spi_corrupted;          // reads truncated above spi_clean_step
+  uint32_t char_updates;           // characteristic value update commands
+  uint32_t reads_allowed;          // peer reads let through by aci_gatt_allow_read()
+} bnrgm0_emu_stats_t;
+
+// IRQs of instance 0, instance n uses these plus 2 * n.
+#define BNRGM0_EMU_IRQN     ((IRQn_Type) 23)
+#define BNRGM0_EMU_DMA_IRQN ((IRQn_Type) 24)
+
+// ===============================================================
+// Functions
+// ===============================================================
+
+void bnrgm0_emu_defaultConfig(bnrgm0_emu_cfg_t *cfg);
+void bnrgm0_emu_setConfig(const bnrgm0_emu_cfg_t *cfg);
+
+const bnrgm0_emu_stats_t *bnrgm0_emu_getStats(void);
+void bnrgm0_emu_clearStats(void);
+
+// Number of events generated but not read by the host yet.
+uint32_t bnrgm0_emu_pendingEvents(void);
+
+// Value of the characteristic declared at char_handle, as a peer reads it
+// (read long): copies up to size bytes and returns its length.
+uint16_t bnrgm0_emu_charValue(uint16_t char_handle, uint8_t *buf, uint16_t size);
+
+// Simulate a peer: connection, disconnection, a write on an attribute and a
+// read of an attribute that waits for aci_gatt_allow_read() (read permit request).
+void bnrgm0_emu_connect(uint16_t conn_handle, const uint8_t peer_addr[6]);
+void bnrgm0_emu_disconnect(uint8_t reason);
+void bnrgm0_emu_attrWrite(uint16_t attr_handle, const uint8_t *data, uint8_t data_len);
+void bnrgm0_emu_attrRead(uint16_t attr_handle);
+
+// ===============================================================
+// tHciIO
+// ===============================================================
+
+int32_t BNRGM0_EMU_Init(void *pConf);
+int32_t BNRGM0_EMU_DeInit(void);
+int32_t BNRGM0_EMU_Reset(void);
+int32_t BNRGM0_EMU_Receive(uint8_t *buffer, uint16_t size);
+int32_t BNRGM0_EMU_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size));
+int32_t BNRGM0_EMU_Send(uint8_t *buffer, uint16_t size);
+int32_t BNRGM0_EMU_SendV(const tHciIOVec *iov, uint8_t iovcnt);
+int32_t BNRGM0_EMU_GetTick(void);
+
+// bnrgm0_spi_speed_t: 500 kHz << step, up to step 5 (16 MHz).
+uint32_t BNRGM0_EMU_SpiSpeed(SPI_TypeDef *SPIx, uint8_t step);
+
+#endif
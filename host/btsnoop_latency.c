@@ -0,0 +1,137 @@
+// Per-opcode command latencies of a btsnoop capture (H4 datalink), as written
+// by hci_snoop_dump(): each command is matched with the first command
+// complete/status event for its opcode that follows it.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define H4_COMMAND_PKT   0x01
+#define H4_EVENT_PKT     0x04
+#define EVT_CMD_COMPLETE 0x0E
+#define EVT_CMD_STATUS   0x0F
+#define FLAG_RECEIVED    0x01
+#define FLAG_CMD_EVT     0x02
+#define DATALINK_H4      1002U
+
+#define MAX_OPCODES   64U
+#define MAX_IN_FLIGHT 16U // commands of one opcode waiting for their response
+
+typedef struct {
+  uint16_t opcode;
+  uint32_t n;
+  uint32_t unanswered;
+  uint64_t total_us;
+  uint64_t min_us;
+  uint64_t max_us;
+  // send times of the commands waiting for a response, oldest first
+  uint64_t sent_us[MAX_IN_FLIGHT];
+  uint8_t pending;
+} opcode_stat_t;
+
+static opcode_stat_t stats[MAX_OPCODES];
+static uint32_t n_opcodes;
+
+// ===============================================================
+// Privates
+// ===============================================================
+
+static uint32_t be32(const uint8_t *p) { return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static opcode_stat_t *stat_of(uint16_t opcode) {
+  for (uint32_t i = 0; i < n_opcodes; i++) {
+    if (stats[i].opcode == opcode) { return &stats[i]; }
+  }
+  if (n_opcodes == MAX_OPCODES) { return NULL; }
+  opcode_stat_t *s = &stats[n_opcodes++];
+  s->opcode        = opcode;
+  s->min_us        = UINT64_MAX;
+  return s;
+}
+
+static void on_command(uint16_t opcode, uint64_t ts) {
+  opcode_stat_t *s = stat_of(opcode);
+  if (s == NULL) { return; }
+  if (s->pending == MAX_IN_FLIGHT) {
+    // the oldest never got its response
+    memmove(s->sent_us, &s->sent_us[1], sizeof(s->sent_us) - sizeof(s->sent_us[0]));
+    s->pending--;
+    s->unanswered++;
+  }
+  s->sent_us[s->pending++] = ts;
+}
+
+static void on_response(uint16_t opcode, uint64_t ts) {
+  opcode_stat_t *s = stat_of(opcode);
+  if (s == NULL || s->pending == 0) { return; }
+  uint64_t us = ts - s->sent_us[0];
+  memmove(s->sent_us, &s->sent_us[1], (s->pending - 1) * sizeof(s->sent_us[0]));
+  s->pending--;
+  s->n++;
+  s->total_us += us;
+  if (us < s->min_us) { s->min_us = us; }
+  if (us > s->max_us) { s->max_us = us; }
+}
+
+// ===============================================================
+// Main
+// ===============================================================
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("usage: %s capture.btsnoop\n", argv[0]);
+    return 2;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t header[16];
+  if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, "btsnoop", 8) ||
+      be32(&header[12]) != DATALINK_H4) {
+    printf("%s: not a btsnoop H4 capture\n", argv[1]);
+    return 1;
+  }
+
+  uint8_t rec[24];
+  uint8_t data[256];
+  uint32_t packets = 0;
+  uint32_t drops   = 0;
+  while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+    uint32_t incl  = be32(&rec[4]);
+    uint32_t flags = be32(&rec[8]);
+    uint64_t ts    = ((uint64_t) be32(&rec[16]) << 32) | be32(&rec[20]);
+    if (incl > sizeof(data) || fread(data, 1, incl, f) != incl) { break; }
+    drops = be32(&rec[12]);
+    packets++;
+    if (!(flags & FLAG_CMD_EVT)) { continue; }
+
+    if (!(flags & FLAG_RECEIVED) && incl >= 3 && data[0] == H4_COMMAND_PKT) {
+      on_command(data[1] | (data[2] << 8), ts);
+    } else if (incl >= 6 && data[0] == H4_EVENT_PKT && data[1] == EVT_CMD_COMPLETE) {
+      on_response(data[4] | (data[5] << 8), ts);
+    } else if (incl >= 7 && data[0] == H4_EVENT_PKT && data[1] == EVT_CMD_STATUS) {
+      on_response(data[5] | (data[6] << 8), ts);
+    }
+  }
+  fclose(f);
+
+  printf("%u packets, %u dropped before the capture\n", packets, drops);
+  printf("  %-6s %-4s %-5s %8s %9s %9s %9s %6s\n", "opcode", "ogf", "ocf", "n", "avg us", "min us", "max us",
+         "lost");
+  for (uint32_t i = 0; i < n_opcodes; i++) {
+    opcode_stat_t *s = &stats[i];
+    printf("  0x%04x 0x%02x 0x%03x %8u %9.1f %9.1f %9.1f %6u\n", s->opcode, s->opcode >> 10, s->opcode & 0x3FF,
+           s->n, s->n ? (double) s->total_us / s->n : 0.0, s->n ? (double) s->min_us : 0.0, (double) s->max_us,
+           s->unanswered + s->pending);
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef __EONOS_HOST_H_
+#define __EONOS_HOST_H_
+
+// Host (Linux) stand-in for the subset of the eonOS API used by bnrgm0.
+// Only meant to build the driver against the controller emulator, never
+// for target firmware.
+
+#include <assert.h>
+#include <endian.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// ===============================================================
+// Compiler / CMSIS macros
+// ===============================================================
+
+#define __weak          __attribute__((weak))
+#define __STATIC_INLINE static inline
+
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+void __disable_irq(void);
+void __enable_irq(void);
+void __WFI(void);
+
+void __DMB(void);
+
+// The host builds check the calling contract of hci_tl.c
+#define HCI_ASSERT(expr) assert(expr)
+
+// ===============================================================
+// Types
+// ===============================================================
+
+typedef uint8_t pin_t;
+typedef int IRQn_Type;
+
+typedef struct {
+  uint32_t id;
+} SPI_TypeDef;
+
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+
+// ===============================================================
+// GPIO / EXTI / SPI
+// ===============================================================
+
+#define OUTPUT_PP   0
+#define ANALOG      1
+#define NOPULL      0
+#define SPEED_LOW   0
+#define MODE_CHANGE 0
+
+void gpio_mode(pin_t pin, uint32_t mode, uint32_t pull, uint32_t speed);
+void gpio_set(pin_t pin);
+void gpio_reset(pin_t pin);
+uint8_t gpio_read(pin_t pin);
+
+void exti_attach(pin_t pin, uint32_t pull, uint32_t mode);
+void exti_detach(pin_t pin);
+
+uint8_t spi_write8(SPI_TypeDef *SPIx, uint8_t data);
+void spi_writeMultiple8(SPI_TypeDef *SPIx, const uint8_t *tx, uint8_t *rx, uint16_t len);
+
+// ===============================================================
+// Time
+// ===============================================================
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+
+#define pc_printf printf
+
+// ===============================================================
+// Host simulation hooks
+// ===============================================================
+
+// Register an emulated interrupt: `line` tells if the IRQ source is asserted
+// and `isr` is the handler to run when it rises. The first one registered is
+// the EXTI (exti_attach()), the others are enabled with NVIC_EnableIRQ().
+void eon_host_irq_register(IRQn_Type irqn, int (*line)(void), void (*isr)(void));
+
+// Sample the emulated IRQ lines and run an ISR on a rising edge once its IRQ
+// is enabled in the NVIC and interrupts are not masked. Called from every time
+// query, delay(), __WFI(), __DMB() and PRIMASK release, which are the points
+// where the target could be preempted.
+void eon_host_irq_poll(void);
+
+// Sample the line of irqn without running its ISR. Called by an IRQ source
+// when it drops the line, the next rise is an edge even if no poll saw it low.
+void eon_host_irq_sample(IRQn_Type irqn);
+
+// Longest run of the ISR of irqn since the previous call, in ns.
+uint32_t eon_host_irq_max_ns(IRQn_Type irqn);
+
+// Attach an SPI slave model: `xfer` exchanges one byte per clocked byte of
+// spi_write8()/spi_writeMultiple8() and `cs` follows gpio_set()/gpio_reset().
+void eon_host_spi_register(uint8_t (*xfer)(uint8_t mosi), void (*cs)(pin_t pin, uint8_t level));
+
+#endif
@@ -0,0 +1,196 @@
+#include "eonOS.h"
+#include <time.h>
+
+// ===============================================================
+// Private structure
+// ===============================================================
+
+#define EON_HOST_IRQ_MAX 4
+
+typedef struct {
+  uint8_t enabled;
+  uint8_t level;   // last sampled level of the IRQ line
+  uint8_t pending; // edge latched, waiting for the IRQ to be unmasked
+  IRQn_Type irqn;
+  int (*line)(void);
+  void (*isr)(void);
+  uint64_t max_ns; // longest ISR run
+} host_irq_t;
+
+// All the emulated IRQs have the same priority: an ISR is never preempted.
+static struct {
+  uint32_t primask;
+  uint8_t in_isr;
+  uint8_t n_irq;
+  host_irq_t irq[EON_HOST_IRQ_MAX];
+  // SPI slave model
+  uint8_t (*spi_xfer)(uint8_t mosi);
+  void (*spi_cs)(pin_t pin, uint8_t level);
+} host;
+
+static host_irq_t *host_irq(IRQn_Type irqn) {
+  for (uint8_t i = 0; i < host.n_irq; i++) {
+    if (host.irq[i].irqn == irqn) { return &host.irq[i]; }
+  }
+  return NULL;
+}
+
+// Latch a rising edge of the line since the previous sample.
+static void irq_sample(host_irq_t *irq) {
+  uint8_t level = irq->line() ? 1 : 0;
+  if (level && !irq->level) { irq->pending = 1; }
+  irq->level = level;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t monotonic_us(void) { return monotonic_ns() / 1000ULL; }
+
+// ===============================================================
+// CMSIS
+// ===============================================================
+
+uint32_t __get_PRIMASK(void) { return host.primask; }
+
+void __set_PRIMASK(uint32_t primask) {
+  host.primask = primask;
+  if (primask == 0) { eon_host_irq_poll(); }
+}
+
+void __disable_irq(void) { host.primask = 1; }
+
+void __enable_irq(void) { __set_PRIMASK(0); }
+
+void __WFI(void) { eon_host_irq_poll(); }
+
+// The lock-free handoffs between the ISR and the main loop sit on barriers:
+// let the emulated interrupt preempt there.
+void __DMB(void) {
+  __sync_synchronize();
+  eon_host_irq_poll();
+}
+
+void NVIC_EnableIRQ(IRQn_Type irqn) {
+  host_irq_t *irq = host_irq(irqn);
+  if (irq) {
+    irq->enabled = 1;
+    eon_host_irq_poll();
+  }
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn) {
+  host_irq_t *irq = host_irq(irqn);
+  if (irq) { irq->enabled = 0; }
+}
+
+// ===============================================================
+// GPIO / EXTI / SPI
+// ===============================================================
+
+void gpio_mode(pin_t pin, uint32_t mode, uint32_t pull, uint32_t speed) {}
+void gpio_set(pin_t pin) {
+  if (host.spi_cs) { host.spi_cs(pin, 1); }
+}
+
+void gpio_reset(pin_t pin) {
+  if (host.spi_cs) { host.spi_cs(pin, 0); }
+}
+uint8_t gpio_read(pin_t pin) { return 0; }
+
+// The emulated EXTI is the first registered IRQ.
+void exti_attach(pin_t pin, uint32_t pull, uint32_t mode) {
+  if (host.n_irq) { host.irq[0].enabled = 1; }
+}
+
+void exti_detach(pin_t pin) {
+  if (host.n_irq) { host.irq[0].enabled = 0; }
+}
+
+uint8_t spi_write8(SPI_TypeDef *SPIx, uint8_t data) { return host.spi_xfer ? host.spi_xfer(data) : 0xff; }
+
+void spi_writeMultiple8(SPI_TypeDef *SPIx, const uint8_t *tx, uint8_t *rx, uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    uint8_t miso = host.spi_xfer ? host.spi_xfer(tx ? tx[i] : 0xff) : 0xff;
+    if (rx != NULL) { rx[i] = miso; }
+  }
+}
+
+// ===============================================================
+// Time
+// ===============================================================
+
+uint32_t millis(void) {
+  eon_host_irq_poll();
+  return (uint32_t) (monotonic_us() / 1000ULL);
+}
+
+uint32_t micros(void) {
+  eon_host_irq_poll();
+  return (uint32_t) monotonic_us();
+}
+
+void delay(uint32_t ms) {
+  uint64_t until = monotonic_us() + (uint64_t) ms * 1000ULL;
+  while (monotonic_us() < until) {
+    eon_host_irq_poll();
+  }
+}
+
+// ===============================================================
+// Host simulation hooks
+// ===============================================================
+
+void eon_host_irq_register(IRQn_Type irqn, int (*line)(void), void (*isr)(void)) {
+  host_irq_t *irq = host_irq(irqn);
+  if (irq == NULL) {
+    if (host.n_irq == EON_HOST_IRQ_MAX) { return; }
+    irq = &host.irq[host.n_irq++];
+  }
+  memset(irq, 0, sizeof(*irq));
+  irq->irqn = irqn;
+  irq->line = line;
+  irq->isr  = isr;
+}
+
+void eon_host_spi_register(uint8_t (*xfer)(uint8_t mosi), void (*cs)(pin_t pin, uint8_t level)) {
+  host.spi_xfer = xfer;
+  host.spi_cs   = cs;
+}
+
+void eon_host_irq_sample(IRQn_Type irqn) {
+  host_irq_t *irq = host_irq(irqn);
+  if (irq != NULL) { irq_sample(irq); }
+}
+
+uint32_t eon_host_irq_max_ns(IRQn_Type irqn) {
+  host_irq_t *irq = host_irq(irqn);
+  if (irq == NULL) { return 0; }
+  uint32_t ns = (uint32_t) irq->max_ns;
+  irq->max_ns = 0;
+  return ns;
+}
+
+// The lines are edge triggered like the EXTI on the target: if the ISR
+// returns with the line still asserted, it will not run again until the line
+// drops and rises back.
+void eon_host_irq_poll(void) {
+  if (host.in_isr) { return; }
+  for (uint8_t i = 0; i < host.n_irq; i++) {
+    host_irq_t *irq = &host.irq[i];
+    irq_sample(irq);
+    if (!irq->pending || host.primask || !irq->enabled) { continue; }
+    irq->pending = 0;
+    host.in_isr  = 1;
+    uint64_t t0  = monotonic_ns();
+    irq->isr();
+    uint64_t ns = monotonic_ns() - t0;
+    host.in_isr = 0;
+    if (ns > irq->max_ns) { irq->max_ns = ns; }
+    // a line dropped by the ISR and asserted again is a new edge
+    irq_sample(irq);
+  }
+}
@@ -0,0 +1,290 @@
+// H4 UART transport benchmark: runs the driver over src/hci_tl_uart.c against
+// a minimal BlueNRG-MS controller in a child process, on the other end of a
+// pseudo-terminal. The controller can add line noise and split its events to
+// exercise the framing recovery.
+
+#define _GNU_SOURCE
+#include "bluenrg_aci.h"
+#include "bnrgm0.h"
+#include "hci_const.h"
+#include "hci_le.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define H4_UART_IRQN   ((IRQn_Type) 37)
+#define H4_DMA_IRQN    ((IRQn_Type) 38)
+#define H4_RX_BUF_SIZE 512U
+#define H4_NOISE_MAX   8U
+
+static struct {
+  uint32_t iterations;
+  uint32_t noise_every; // line noise before every Nth event (0 = none)
+  uint32_t split_every; // every Nth event written in two parts (0 = none)
+} opts;
+
+// ===============================================================
+// Controller: child process on the pty master
+// ===============================================================
+
+static void ctrl_write(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) { exit(0); }
+    data += n;
+    len -= (size_t) n;
+  }
+}
+
+static bool ctrl_read(int fd, uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, data, len);
+    if (n <= 0) { return false; }
+    data += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
+
+// Command complete with the return parameters of the commands used by
+// bnrgm0_init() and the benchmark, status 0 and zeros for the others.
+static uint8_t ctrl_response(uint8_t *config, uint16_t opcode, const uint8_t *cp, uint8_t plen, uint8_t *rp) {
+  uint8_t len = 1;
+  memset(rp, 0, 16);
+  switch (opcode) {
+    case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_BD_ADDR):
+      memcpy(&rp[1], &config[CONFIG_DATA_PUBADDR_OFFSET], CONFIG_DATA_PUBADDR_LEN);
+      len += CONFIG_DATA_PUBADDR_LEN;
+      break;
+    case cmd_opcode_pack(OGF_VENDOR_CMD, OCF_HAL_WRITE_CONFIG_DATA):
+      if (plen >= 2 && cp[0] + cp[1] <= 64) { memcpy(&config[cp[0]], &cp[2], cp[1]); }
+      break;
+    case cmd_opcode_pack(OGF_VENDOR_CMD, OCF_HAL_READ_CONFIG_DATA):
+      memcpy(&rp[1], &config[CONFIG_DATA_PUBADDR_OFFSET], CONFIG_DATA_PUBADDR_LEN);
+      len += CONFIG_DATA_PUBADDR_LEN;
+      break;
+    case cmd_opcode_pack(OGF_LE_CTL, OCF_LE_RAND):
+      len += 8;
+      break;
+    default:
+      len = 16;
+      break;
+  }
+  return len;
+}
+
+static void ctrl_run(int fd) {
+  uint8_t config[64] = {0};
+  uint8_t hdr[1 + HCI_COMMAND_HDR_SIZE];
+  uint8_t cp[255];
+  uint8_t evt[1 + HCI_EVENT_HDR_SIZE + 3 + 16];
+  uint8_t noise[H4_NOISE_MAX];
+  uint32_t count = 0;
+
+  while (ctrl_read(fd, hdr, sizeof(hdr))) {
+    if (hdr[0] != HCI_COMMAND_PKT || !ctrl_read(fd, cp, hdr[3])) { continue; }
+    uint16_t opcode = hdr[1] | (hdr[2] << 8);
+
+    uint8_t rlen = ctrl_response(config, opcode, cp, hdr[3], &evt[6]);
+    evt[0]       = HCI_EVENT_PKT;
+    evt[1]       = EVT_CMD_COMPLETE;
+    evt[2]       = 3 + rlen;
+    evt[3]       = 1; // Num_HCI_Command_Packets
+    evt[4]       = (uint8_t) opcode;
+    evt[5]       = (uint8_t) (opcode >> 8);
+
+    count++;
+    if (opts.noise_every && count % opts.noise_every == 0) {
+      // 0x00 and 0xFF, like a line glitch or a break
+      uint8_t n = 1 + (uint8_t) (rand() % H4_NOISE_MAX);
+      for (uint8_t i = 0; i < n; i++) {
+        noise[i] = (rand() & 1) ? 0xFF : 0x00;
+      }
+      ctrl_write(fd, noise, n);
+    }
+    if (opts.split_every && count % opts.split_every == 0) {
+      ctrl_write(fd, evt, 2);
+      usleep(50);
+      ctrl_write(fd, &evt[2], 4 + rlen);
+    } else {
+      ctrl_write(fd, evt, 6 + rlen);
+    }
+  }
+  exit(0);
+}
+
+// ===============================================================
+// Host UART: pty slave, receive DMA and its interrupts emulation
+// ===============================================================
+
+static struct {
+  int fd;
+  uint8_t rx_buf[H4_RX_BUF_SIZE];
+  uint16_t dma_pos;
+  uint8_t rx_new;  // bytes received since the last idle line interrupt
+  uint8_t dma_evt; // half or full transfer reached
+} uart;
+
+// The receive DMA: what the pty received goes to the circular buffer. It stops
+// at each half of the buffer, for the half and full transfer interrupts.
+static bool uart_dma(void) {
+  uint16_t half = H4_RX_BUF_SIZE / 2;
+  uint16_t room = half - uart.dma_pos % half;
+  ssize_t n     = read(uart.fd, &uart.rx_buf[uart.dma_pos], room);
+  if (n <= 0) { return false; }
+  uart.dma_pos = (uart.dma_pos + (uint16_t) n) % H4_RX_BUF_SIZE;
+  uart.rx_new  = 1;
+  if (uart.dma_pos % half == 0) { uart.dma_evt = 1; }
+  return true;
+}
+
+static uint16_t uart_rx_pos(void) {
+  uart_dma();
+  return uart.dma_pos;
+}
+
+// Idle line: bytes came in and the line went quiet.
+static int uart_line(void) {
+  if (uart_dma()) { return 0; }
+  return uart.rx_new;
+}
+
+static void uart_isr(void) {
+  uart.rx_new = 0;
+  bnrgm0_uart_irq_handler(0);
+}
+
+// Half and full transfer: a pulse, latched once per boundary.
+static int uart_dma_line(void) {
+  uart_dma();
+  int level    = uart.dma_evt;
+  uart.dma_evt = 0;
+  return level;
+}
+
+static void uart_dma_isr(void) { bnrgm0_uart_irq_handler(0); }
+
+static int32_t uart_write(const uint8_t *data, uint16_t len) {
+  uint16_t done = 0;
+  while (done < len) {
+    ssize_t n = write(uart.fd, &data[done], len - done);
+    if (n < 0) { return -1; }
+    done += (uint16_t) n;
+  }
+  return len;
+}
+
+static const bnrgm0_uart_t uart_cfg = {
+  .write    = uart_write,
+  .rx_pos   = uart_rx_pos,
+  .rx_buf   = uart.rx_buf,
+  .rx_size  = H4_RX_BUF_SIZE,
+  .dma_irqn = H4_DMA_IRQN,
+};
+
+static int pty_open(pid_t *child) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) || unlockpt(master)) { return -1; }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (slave < 0) { return -1; }
+
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  *child = fork();
+  if (*child == 0) {
+    close(slave);
+    ctrl_run(master);
+  }
+  close(master);
+  return slave;
+}
+
+// ===============================================================
+// Main
+// ===============================================================
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+int main(int argc, char **argv) {
+  opts.iterations = 2000;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    uint32_t v = (uint32_t) strtoul(argv[i + 1], NULL, 0);
+    if (!strcmp(argv[i], "-n")) {
+      opts.iterations = v;
+    } else if (!strcmp(argv[i], "-g")) {
+      opts.noise_every = v;
+    } else if (!strcmp(argv[i], "-s")) {
+      opts.split_every = v;
+    } else {
+      printf("usage: %s [-n iterations] [-g noise_every] [-s split_every]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  pid_t child;
+  uart.fd = pty_open(&child);
+  if (uart.fd < 0) {
+    printf("no pseudo-terminal\n");
+    return 1;
+  }
+  eon_host_irq_register(H4_UART_IRQN, uart_line, uart_isr);
+  eon_host_irq_register(H4_DMA_IRQN, uart_dma_line, uart_dma_isr);
+  NVIC_EnableIRQ(H4_UART_IRQN);
+  NVIC_EnableIRQ(H4_DMA_IRQN);
+
+  const bnrgm0_hw_t hw = {
+    .exti_irqn = H4_UART_IRQN,
+    .uart      = &uart_cfg,
+  };
+  static const uint8_t addr[6] = {0x02, 0x80, 0xE1, 0x00, 0x00, 0x01};
+
+  int ret = 1;
+  if (!bnrgm0_init(0, &hw, addr)) {
+    printf("init failed\n");
+  } else {
+    uint32_t errors = 0;
+    uint8_t bdaddr[6], len;
+    uint64_t t0 = now_us();
+    for (uint32_t i = 0; i < opts.iterations; i++) {
+      if (hci_read_bd_addr(bdaddr) != BLE_STATUS_SUCCESS || bdaddr[5] != addr[0]) { errors++; }
+      if (aci_hal_read_config_data(CONFIG_DATA_PUBADDR_OFFSET, 6, &len, bdaddr) != BLE_STATUS_SUCCESS ||
+          len != 6 || bdaddr[0] != addr[5]) {
+        errors++;
+      }
+    }
+    uint64_t us = now_us() - t0;
+
+    hci_tl_uart_stats_t st;
+    hci_tl_uart_getStats(&st);
+    uint32_t cmds = opts.iterations * 2;
+    printf("H4 over a pty: %u commands, noise every %u events, split every %u\n", cmds, opts.noise_every,
+           opts.split_every);
+    printf("  commands/sec                     %10.0f\n", us ? cmds * 1e6 / us : 0.0);
+    printf("  round trip (us)                  %10.2f\n", cmds ? (double) us / cmds : 0.0);
+    printf("  resyncs/skipped bytes            %10u / %u\n", st.resyncs, st.skipped_bytes);
+    printf("  receive DMA overruns             %10u\n", st.overruns);
+    printf("  errors                           %10u\n", errors);
+    ret = errors ? 1 : 0;
+  }
+
+  close(uart.fd);
+  kill(child, SIGTERM);
+  waitpid(child, NULL, 0);
+  return ret;
+}
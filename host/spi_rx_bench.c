@@ -0,0 +1,210 @@
+// SPI receive benchmark: runs src/hci_tl_interface.c against an SPI slave
+// model of the BlueNRG-MS and compares HCI_TL_SPI_Receive() with the former
+// byte per byte payload loop. Also checks that a DMA write whose transfer
+// complete interrupt never comes fails instead of hanging.
+
+#include "hci_const.h"
+#include "hci_tl.h"
+#include "hci_tl_interface.h"
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define BENCH_CS_PIN  1U
+#define HEADER_SIZE   5U
+#define SPI_WRITE_BUF 0x80U
+
+typedef struct {
+  uint64_t ns;
+  uint64_t cycles;
+  uint32_t errors;
+} rx_result_t;
+
+static struct {
+  uint32_t iterations;
+  uint16_t payload_len;
+} opts;
+
+// ===============================================================
+// BlueNRG-MS SPI slave model
+// ===============================================================
+
+static struct {
+  uint8_t cs;
+  uint16_t pos;
+  uint8_t payload[HCI_READ_PACKET_SIZE];
+} slave;
+
+static void slave_cs(pin_t pin, uint8_t level) {
+  if (pin != BENCH_CS_PIN) { return; }
+  slave.cs  = level;
+  slave.pos = 0;
+}
+
+// Header: ready, write buffer size, read buffer size (LSB first), then the payload.
+static uint8_t slave_xfer(uint8_t mosi) {
+  if (slave.cs) { return 0xff; }
+  uint16_t pos = slave.pos++;
+  switch (pos) {
+  case 0: return 0x02;
+  case 1: return SPI_WRITE_BUF;
+  case 2: return 0x00;
+  case 3: return (uint8_t) opts.payload_len;
+  case 4: return (uint8_t) (opts.payload_len >> 8);
+  default: return (pos - HEADER_SIZE < opts.payload_len) ? slave.payload[pos - HEADER_SIZE] : 0x00;
+  }
+}
+
+// ===============================================================
+// hci_tl stubs: only the SPI bus functions are measured
+// ===============================================================
+
+void hci_register_io_bus(tHciIO *fops) {}
+int32_t hci_notify_asynch_evt(void *pdata) { return 1; }
+void hci_notify_rx_complete(int32_t len) {}
+void hci_cmd_resp_release(uint32_t flag) {}
+static uint16_t tx_space;
+void hci_notify_tx_space(uint16_t space) { tx_space = space; }
+
+// ===============================================================
+// Reference: payload loop before the burst read
+// ===============================================================
+
+static int32_t ref_receive(uint8_t *buffer, uint16_t size) {
+  uint16_t byte_count;
+  uint8_t len     = 0;
+  uint8_t char_ff = 0xff;
+  volatile uint8_t read_char;
+
+  uint8_t header_master[HEADER_SIZE] = {0x0b, 0x00, 0x00, 0x00, 0x00};
+  uint8_t header_slave[HEADER_SIZE];
+
+  gpio_reset(BENCH_CS_PIN);
+  spi_writeMultiple8(NULL, header_master, header_slave, HEADER_SIZE);
+  if (header_slave[0] == 0x02) {
+    byte_count = (header_slave[4] << 8) | header_slave[3];
+    if (byte_count > size) { byte_count = size; }
+    for (len = 0; len < byte_count; len++) {
+      read_char   = spi_write8(NULL, char_ff);
+      buffer[len] = read_char;
+    }
+  }
+  gpio_set(BENCH_CS_PIN);
+  return len;
+}
+
+// ===============================================================
+// Stalled DMA write
+// ===============================================================
+
+static uint32_t dma_aborts;
+
+// Starts a transfer that never completes.
+static bool stall_dma(SPI_TypeDef *SPIx, const uint8_t *tx, uint8_t *rx, uint16_t len) { return true; }
+
+static void stall_dma_abort(SPI_TypeDef *SPIx) { dma_aborts++; }
+
+static bool check_dma_stall(void) {
+  static const bnrgm0_hw_t hw = {.cs_pin = BENCH_CS_PIN, .spi_dma = stall_dma, .spi_dma_abort = stall_dma_abort};
+  uint8_t cmd[32] = {HCI_COMMAND_PKT};
+  hci_eon_brige(&hw);
+
+  uint32_t t0 = millis();
+  int32_t ret = HCI_TL_SPI_Send(cmd, sizeof(cmd));
+  uint32_t ms = millis() - t0;
+  printf("stalled DMA write: returned %d after %u ms, %u abort, CS %s\n", ret, ms, dma_aborts,
+         slave.cs ? "released" : "low");
+  bool ok = ret < 0 && dma_aborts == 1 && slave.cs;
+
+  // A short packet (polled) goes out ahead of the stalled one: it counts as written
+  const tHciIOVec iov[2] = {{cmd, 4, 1}, {cmd, sizeof(cmd), 1}};
+  ret = HCI_TL_SPI_SendV(iov, 2);
+  printf("stalled DMA write behind a packet: returned %d, write buffer space %u of %u\n", ret, tx_space,
+         SPI_WRITE_BUF);
+  return ok && ret == 1 && tx_space == SPI_WRITE_BUF - 4 - sizeof(cmd);
+}
+
+// ===============================================================
+// Measurement
+// ===============================================================
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#if HAVE_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static rx_result_t run(int32_t (*receive)(uint8_t *, uint16_t)) {
+  uint8_t buf[HCI_READ_PACKET_SIZE];
+  rx_result_t r = {0};
+
+  uint64_t t0 = now_ns();
+  uint64_t c0 = now_cycles();
+  for (uint32_t i = 0; i < opts.iterations; i++) {
+    if (receive(buf, sizeof(buf)) != opts.payload_len || memcmp(buf, slave.payload, opts.payload_len)) { r.errors++; }
+  }
+  r.cycles = now_cycles() - c0;
+  r.ns     = now_ns() - t0;
+  return r;
+}
+
+static void print_result(const char *name, const rx_result_t *r) {
+  printf("  %-36s %10.1f %10.1f %6u\n", name, (double) r->ns / opts.iterations,
+         HAVE_CYCLES ? (double) r->cycles / opts.iterations : 0.0, r->errors);
+}
+
+// ===============================================================
+// Main
+// ===============================================================
+
+int main(int argc, char **argv) {
+  opts.iterations  = 200000;
+  opts.payload_len = HCI_READ_PACKET_SIZE;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    uint32_t v = (uint32_t) strtoul(argv[i + 1], NULL, 0);
+    if (!strcmp(argv[i], "-n")) {
+      opts.iterations = v;
+    } else if (!strcmp(argv[i], "-s") && v > 0 && v <= HCI_READ_PACKET_SIZE) {
+      opts.payload_len = (uint16_t) v;
+    } else {
+      printf("usage: %s [-n iterations] [-s payload_len (1..%u)]\n", argv[0], HCI_READ_PACKET_SIZE);
+      return 2;
+    }
+  }
+
+  for (uint16_t i = 0; i < sizeof(slave.payload); i++) {
+    slave.payload[i] = (uint8_t) (i * 7 + 1);
+  }
+  slave.cs = 1;
+  eon_host_spi_register(slave_xfer, slave_cs);
+
+  static const bnrgm0_hw_t hw = {.cs_pin = BENCH_CS_PIN};
+  hci_eon_brige(&hw);
+
+  printf("SPI receive of a %u byte packet, %u iterations\n", opts.payload_len, opts.iterations);
+  printf("  %-36s %10s %10s %6s\n", "", "ns/packet", "cycles", "err");
+  rx_result_t before = run(ref_receive);
+  rx_result_t after  = run(HCI_TL_SPI_Receive);
+  print_result("byte per byte payload (before)", &before);
+  print_result("burst read (HCI_TL_SPI_Receive)", &after);
+  bool stall_ok = check_dma_stall();
+  return (before.errors || after.errors || !stall_ok) ? 1 : 0;
+}
@@ -20,50 +20,66 @@ typedef uint8_t ble_error_t;
 // Error getter
 // ===============================================================
 
-ble_error_t bnrgm0_getError(void);
+ble_error_t bnrgm0_getError(bnrgm0_t ble);
 
 // ===============================================================
 // Functions
 // ===============================================================
 
+// Every function takes the BlueNRG instance it acts on, and selects it: the
+// ACI and HCI functions called afterwards, and the event handlers run by
+// bnrgm0_process(), work on that instance (see hci_select()).
+//
+// Single task: the selection is global, not per task, so the instances are
+// not driven in parallel. Call the functions of all the instances from one
+// task, or hold one lock around each call (the commands wait for their
+// response inside it). A command that finds its instance switched by another
+// task while it waits fails: the call returns false, hci_get_stats() counts it
+// in reqInstanceSwitched, and HCI_ASSERT stops there when defined.
+
 /**
  * @brief Initialize BlueNRG-M0 hardware.
  *
+ * @param ble BlueNRG instance the hardware belongs to.
  * @param hw Hardware structure pointer.
  * @param pubaddr Public address must be of length 6.
  * @return true if success, false if failed.
  */
-bool bnrgm0_init(const bnrgm0_hw_t *hw, const uint8_t *pubaddr);
+bool bnrgm0_init(bnrgm0_t ble, const bnrgm0_hw_t *hw, const uint8_t *pubaddr);
 
 /**
  * @brief Set transmission power.
  *
+ * @param ble BlueNRG instance.
  * @param high_power True if you need to enable high power.
  * @param pa_level Power amplifier output level (Values: 0x00 ... 0x31)
  * @return true if success, false if failed.
  */
-bool bnrgm0_setTxPower(bool high_power, uint8_t pa_level);
+bool bnrgm0_setTxPower(bnrgm0_t ble, bool high_power, uint8_t pa_level);
 
 /**
  * @brief Initialize ble stack ( GATT and GAP ).
  *
+ * @param ble BlueNRG instance.
  * @return true if success, false if failed.
  */
-bool bnrgm0_stackInit(void);
+bool bnrgm0_stackInit(bnrgm0_t ble);
 
 /**
  * @brief Add a ble service.
  *
+ * @param ble BlueNRG instance.
  * @param s BLE Service object.
  * @param uuid must be a 16 bit or 128 bit UUID in a hex string.
  * @param nbOfCharacteristics Number of characteristics this service will handle.
  * @return true if success, false if failed.
  */
-bool bnrgm0_addService(ble_service_t *s, const char *uuid, uint8_t nbOfCharacteristics);
+bool bnrgm0_addService(bnrgm0_t ble, ble_service_t *s, const char *uuid, uint8_t nbOfCharacteristics);
 
 /**
  * @brief Add a characteristic to a service.
  *
+ * @param ble BlueNRG instance.
  * @param s Ble service to add the characteristic.
  * @param charact Characteristic object.
  * @param uuid Characteristic UUID.
@@ -81,11 +97,12 @@ bool bnrgm0_addService(ble_service_t *s, const char *uuid, uint8_t nbOfCharacter
  *      |---> triggers aci_gatt_write_permit_req_event() and check if write is allowed and
  *      |     call aci_gatt_write_resp().
  *    GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP
- *      |---> triggers aci_gatt_read_permit_req_event() and need to call aci_gatt_allow_read()
- *      |     if the read is allowed.
+ *      |---> triggers aci_gatt_read_permit_req_event(), bnrgm0_process() then writes the
+ *      |     deferred shadow value (see bnrgm0_setCharShadow()) and calls aci_gatt_allow_read(),
+ *      |     or calls bnrgm0_onReadRequest() for a characteristic without a shadow.
  * @return true if success, false if failed.
  */
-bool bnrgm0_addCharacteristic(const ble_service_t *s, ble_char_t *charact,
+bool bnrgm0_addCharacteristic(bnrgm0_t ble, const ble_service_t *s, ble_char_t *charact,
                               const char *uuid, uint16_t max_value_len,
                               uint8_t is_variable_len, uint8_t char_properties,
                               uint8_t gatt_evt_mask);
@@ -93,15 +110,151 @@ bool bnrgm0_addCharacteristic(const ble_service_t *s, ble_char_t *charact,
 /**
  * @brief Update a characteristic value while in a ble connection.
  *
+ * A value longer than one ACI command (HCI_MAX_PAYLOAD_SIZE) is written in
+ * chunks at their offset and notified with the last one: the notification
+ * carries the first ATT_MTU-3 bytes and the peer reads the rest with a read
+ * long.
+ *
+ * With a shadow (bnrgm0_setCharShadow()), a value equal to the last one is not
+ * sent, and a local-only value (no notify nor indicate property) is only kept
+ * in the shadow while the peer cannot read it: until the connection, or until
+ * the read permit request of a characteristic added with
+ * GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP.
+ *
+ * With coalescing (bnrgm0_setCharCoalescing()), the value goes through the
+ * notification queue and the call never waits for the controller. Otherwise
+ * it waits for a controller TX buffer BNRGM0_TX_WAIT_MS at most, then fails
+ * with BLE_STATUS_INSUFFICIENT_RESOURCES (bnrgm0_getError()): the value can be
+ * queued with bnrgm0_queueCharValue() instead.
+ *
+ * @param ble BlueNRG instance.
  * @param conn Connection handle.
  * @param charact Characteristic object.
- * @param update_type Update type. Must be one of ...
  * @param value Buffer to be written.
- * @param value_len Length of the value buffer.
- * @return true if success, false if failed.
+ * @param value_len Length of the value buffer, up to the max_value_len of the
+ * characteristic (512 at most for ATT), and up to BNRGM0_NOTIFY_VALUE_MAX with
+ * coalescing.
+ * @return true if success (or skipped), false if failed.
  */
-bool bnrgm0_updateCharValue(ble_conn_t conn, const ble_char_t *charact,
-                            const uint8_t *value, uint8_t value_len);
+bool bnrgm0_updateCharValue(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                            const uint8_t *value, uint16_t value_len);
+
+/**
+ * @brief Update several characteristic values at once, their commands sent
+ * back to back.
+ *
+ * The update commands are pipelined with hci_send_req_async() (up to the
+ * asynchronous slots of hci_tl and the commands the controller accepts) and
+ * the call returns after the last completion: about one round trip for all
+ * of them instead of one per value. Each value goes through the shadow and the
+ * coalescing of its characteristic like with bnrgm0_updateCharValue(); the
+ * updates refused for lack of TX buffer are sent again on the TX pool
+ * available event. A value longer than one command is written on its own, in
+ * chunks.
+ *
+ * @param ble BlueNRG instance.
+ * @param conn Connection handle.
+ * @param updates Characteristics and their values, in the order they are sent.
+ * @param count Number of updates.
+ * @return true if all of them succeeded. false if a value is too long (nothing
+ * is sent) or an update failed (the others are done anyway): bnrgm0_getError()
+ * returns the status of the first failure.
+ */
+bool bnrgm0_updateCharValues(bnrgm0_t ble, ble_conn_t conn, const ble_char_update_t *updates, uint8_t count);
+
+/**
+ * @brief Update a characteristic latest value wins, for telemetry where only
+ * the newest sample matters.
+ *
+ * bnrgm0_updateCharValue() then queues the value without waiting, like
+ * bnrgm0_queueCharValue(). While the controller has not started to take the
+ * queued value of the characteristic (TX pool full), a newer one replaces it;
+ * at most one more waits for the one in flight. A value is queued no sooner
+ * than min_interval_ms after the previous one, the newer values meanwhile
+ * replacing each other. Up to BNRGM0_COALESCE_MAX characteristics per
+ * BlueNRG, calling it again changes the interval.
+ *
+ * @param ble BlueNRG instance.
+ * @param charact Characteristic object, must stay valid with the BlueNRG.
+ * @param min_interval_ms Minimum interval between the notifications (0 = none).
+ * @return true if success, false if BNRGM0_COALESCE_MAX characteristics
+ * already coalesce.
+ */
+bool bnrgm0_setCharCoalescing(bnrgm0_t ble, const ble_char_t *charact, uint16_t min_interval_ms);
+
+/**
+ * @brief Keep a host copy of a characteristic value, so that the updates not
+ * changing it cost no ACI command nor notification.
+ *
+ * Call it after bnrgm0_addCharacteristic(). Calling it again replaces the
+ * shadow of the characteristic; a shadow moved to another characteristic
+ * leaves the first one without shadow. The bnrgm0_updateCharValue() and
+ * bnrgm0_queueCharValue() updates go through the shadow, the stream bytes of
+ * bnrgm0_streamWrite() do not.
+ *
+ * @param ble BlueNRG instance.
+ * @param charact Characteristic object.
+ * @param shadow Shadow of the characteristic, must stay valid with it.
+ * @param value Buffer of max_value_len bytes holding the copy.
+ */
+void bnrgm0_setCharShadow(bnrgm0_t ble, ble_char_t *charact, ble_char_shadow_t *shadow, uint8_t *value);
+
+/**
+ * @brief Queue a characteristic value update, without waiting for the controller.
+ *
+ * The values are sent in order, one at a time, from bnrgm0_process() and from
+ * the TX pool available event when the controller had no buffer left: the
+ * notifications then go out at the pace of the link.
+ *
+ * @param ble BlueNRG instance.
+ * @param conn Connection handle.
+ * @param charact Characteristic object, must stay valid until the value is sent.
+ * @param value Buffer to be written, copied in the queue.
+ * @param value_len Length of the value buffer, up to the max_value_len of the
+ * characteristic and BNRGM0_NOTIFY_VALUE_MAX (ATT_MTU-3 of the largest
+ * BlueNRG-MS ATT_MTU by default).
+ * @return true if queued, false if the queue (BNRGM0_NOTIFY_QUEUE_LEN) is full
+ * or the value too long.
+ */
+bool bnrgm0_queueCharValue(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                           const uint8_t *value, uint16_t value_len);
+
+/**
+ * @brief Append bytes to the stream of a characteristic, sent in notifications
+ * packed up to ATT_MTU-3 (and the max_value_len of the characteristic).
+ *
+ * The full notifications are queued like with bnrgm0_queueCharValue(); the
+ * bytes of a partial one wait for the next writes, bnrgm0_streamFlush(), or
+ * bnrgm0_process() finding the queue empty. Bytes written for another
+ * characteristic flush the partial notification first.
+ *
+ * @param ble BlueNRG instance.
+ * @param conn Connection handle.
+ * @param charact Characteristic object, must stay valid until its bytes are sent.
+ * @param data Bytes to be sent, copied.
+ * @param len Number of bytes.
+ * @return Number of bytes taken, less than len when the queue is full: write
+ * the rest after bnrgm0_process().
+ */
+uint16_t bnrgm0_streamWrite(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                            const uint8_t *data, uint16_t len);
+
+/**
+ * @brief Queue the stream bytes of a partial notification.
+ *
+ * @param ble BlueNRG instance.
+ * @return true if no byte is left in the stream, false if the queue is full.
+ */
+bool bnrgm0_streamFlush(bnrgm0_t ble);
+
+/**
+ * @brief Returns the number of queued values the controller did not take yet,
+ * with the coalesced values waiting for their interval.
+ *
+ * @param ble BlueNRG instance.
+ * @return Queued values, 0 once all of them are sent.
+ */
+uint8_t bnrgm0_getQueuedCharValues(bnrgm0_t ble);
 
 /**
  * @brief Verify if the passed attribute handle is the characteristic value handle of the
@@ -156,30 +309,74 @@ __STATIC_INLINE bool bnrgm0_isCCCDIndEnabled(const uint8_t *cccd_data, uint8_t c
 /**
  * @brief Set the device Complete Local Name.
  *
+ * @param ble BlueNRG instance.
  * @param local_name Local name buffer.
  * @param local_name_len Local name buffer length.
  */
-void bnrgm0_setLocalName(const uint8_t *local_name, uint8_t local_name_len);
+void bnrgm0_setLocalName(bnrgm0_t ble, const uint8_t *local_name, uint8_t local_name_len);
 
 /**
  * @brief Enable or disable connectable mode.
  *
+ * @param ble BlueNRG instance.
  * @param en True if you want to enable, false if you want to disable.
  */
-void bnrgm0_setConnectableMode(bool en);
+void bnrgm0_setConnectableMode(bnrgm0_t ble, bool en);
 
 /**
  * @brief Execute bluenrg2 processes (must be called always in the loop).
  *
+ * With bnrgm0_hw_t.rx_budget_pkts set, it also reads the packets flagged by the
+ * EXTI interrupt, within the budget: call it from a single task.
+ *
+ * @param ble BlueNRG instance.
+ */
+void bnrgm0_process(bnrgm0_t ble);
+
+/**
+ * @brief Returns the SPI clock selected by the calibration of bnrgm0_init()
+ * (bnrgm0_hw_t.spi_speed set).
+ *
+ * @param ble BlueNRG instance.
+ * @return SPI clock in Hz, 0 if not calibrated.
+ */
+uint32_t bnrgm0_getSpiClock(bnrgm0_t ble);
+
+/**
+ * @brief Returns the ATT_MTU of a connection: ATT_MTU (23) until the exchange
+ * started by bnrgm0_process() completes, then the negotiated one.
+ *
+ * @param ble BlueNRG instance.
+ * @param conn Connection handle.
+ * @return ATT_MTU, 0 if conn is not the connection of the instance.
  */
-void bnrgm0_process(void);
+uint16_t bnrgm0_getAttMtu(bnrgm0_t ble, ble_conn_t conn);
 
 /**
  * @brief Returns the connection handle if any, if not returns 0.
  *
+ * @param ble BlueNRG instance.
  * @return 0 if no connection, otherwise connection handle
  */
-ble_conn_t bnrgm0_getConnHandle(void);
+ble_conn_t bnrgm0_getConnHandle(bnrgm0_t ble);
+
+/**
+ * @brief Returns the BlueNRG instance selected by the last bnrgm0 call: the
+ * one an event handler is called for.
+ *
+ * @return BlueNRG instance.
+ */
+bnrgm0_t bnrgm0_selected(void);
+
+/**
+ * @brief Let a read of a characteristic added with
+ * GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP go on, see bnrgm0_onReadRequest().
+ *
+ * @param ble BlueNRG instance.
+ * @param conn Connection handle of the read.
+ * @return true if success, false if failed.
+ */
+bool bnrgm0_allowRead(bnrgm0_t ble, ble_conn_t conn);
 
 // ========================================================================
 // Event handlers
@@ -191,6 +388,15 @@ void __bnrg_on_connect(ble_conn_t conn);
 void __bnrg_on_disconnect(ble_conn_t conn);
 #define BNRG_EVT_ON_DISCONNECT(conn) void __bnrg_on_disconnect(ble_conn_t conn)
 
+// Read permit request of a characteristic without a shadow, called from
+// bnrgm0_process(). The application writes the value it wants read, then
+// calls bnrgm0_allowRead(), now or later. The weak default allows it.
+void bnrgm0_onReadRequest(bnrgm0_t ble, ble_conn_t conn, uint16_t handle);
+
+// attr_data points into the HCI event buffer and is only valid during the call,
+// unless the handler keeps the buffer with hci_evt_retain(attr_data) and gives
+// it back later with hci_evt_release(attr_data). hci_evt_retain() returns NULL
+// for an event parked while a synchronous command waited: copy it instead.
 #define BNRG_EVT_ON_ATTR_MODIFIED(conn, attr_handle, attr_data, attr_data_len) \
   void aci_gatt_attribute_modified_event(uint16_t conn,                        \
                                          uint16_t attr_handle,                 \
@@ -201,6 +407,14 @@ void __bnrg_on_disconnect(ble_conn_t conn);
 // EXTI IRQ Handler Function
 // ===============================================================
 
-void bnrgm0_exti_irq_handler(void);
+// Each BlueNRG has its own interrupts, calling the handlers with its instance.
+
+void bnrgm0_exti_irq_handler(bnrgm0_t ble);
+
+// SPI DMA transfer complete, only when bnrgm0_hw_t.spi_dma is set.
+void bnrgm0_spi_dma_irq_handler(bnrgm0_t ble);
+
+// UART idle line and receive DMA half/full transfer, only when bnrgm0_hw_t.uart is set.
+void bnrgm0_uart_irq_handler(bnrgm0_t ble);
 
 #endif
\ No newline at end of file
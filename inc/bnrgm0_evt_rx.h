@@ -17,6 +17,10 @@ void aci_gatt_attribute_modified_event(uint16_t conn_handle, uint16_t attr_handl
 void aci_gatt_notification_event(uint16_t conn_handle, uint16_t attr_handle, uint8_t attr_len, uint8_t *attr_value);
 // This event is generated in response to an Exchange MTU request (local or from the peer).
 void aci_att_exchange_mtu_resp_event(uint16_t conn_handle, uint16_t server_rx_mtu);
+// This function is called when the controller has TX buffers again for notifications.
+void aci_gatt_tx_pool_available_event(uint16_t conn_handle, uint16_t available_buffers);
+// This function is called when the peer reads an attribute that waits for aci_gatt_allow_read().
+void aci_gatt_read_permit_req_event(uint16_t conn_handle, uint16_t attr_handle, uint16_t offset);
 
 // ===============================================================
 // Event process
@@ -7,21 +7,80 @@
 // Hardware struct
 // ===============================================================
 
+// Starts a full duplex DMA transfer of len bytes on SPIx and returns true, or
+// false if the transfer could not be started (the polled I/O is used then).
+// bnrgm0_spi_dma_irq_handler() must be called from the transfer complete
+// interrupt, set at the same priority as exti_irqn.
+typedef bool (*bnrgm0_spi_dma_t)(SPI_TypeDef *SPIx, const uint8_t *tx, uint8_t *rx, uint16_t len);
+
+// Stops the DMA transfer of SPIx started by bnrgm0_spi_dma_t, when its transfer
+// complete interrupt did not come in time.
+typedef void (*bnrgm0_spi_dma_abort_t)(SPI_TypeDef *SPIx);
+
+// Sets the SPI clock of SPIx to a speed step, 0 being the slowest one, and
+// returns the resulting clock in Hz, or 0 if step is beyond the fastest one.
+typedef uint32_t (*bnrgm0_spi_speed_t)(SPI_TypeDef *SPIx, uint8_t step);
+
+// H4 UART transport, used instead of SPI when bnrgm0_hw_t.uart is set. The
+// receive DMA channel runs in circular mode on rx_buf; bnrgm0_uart_irq_handler()
+// must be called from the UART idle line interrupt (exti_irqn) and from the DMA
+// half and full transfer interrupts (dma_irqn), set at the same priority. The
+// driver masks both IRQs while it reads rx_buf outside of them.
+typedef struct {
+  // Writes len bytes, returns len or < 0 on error
+  int32_t (*write)(const uint8_t *data, uint16_t len);
+  // Position of the receive DMA in rx_buf (rx_size minus the DMA counter)
+  uint16_t (*rx_pos)(void);
+  uint8_t *rx_buf;
+  // Events not read yet stay there: a few HCI_READ_PACKET_SIZE. The bytes
+  // the DMA writes over them are dropped (hci_tl_uart_stats_t.overruns).
+  uint16_t rx_size;
+  IRQn_Type dma_irqn; // receive DMA half and full transfer IRQ
+} bnrgm0_uart_t;
+
 typedef struct {
   SPI_TypeDef *SPIx;
   pin_t cs_pin;
   pin_t rst_pin;
   pin_t exti_irq_pin;
   IRQn_Type exti_irqn;
+  bnrgm0_spi_dma_t spi_dma; // NULL if no DMA channel is configured: polled I/O
+  bnrgm0_spi_dma_abort_t spi_dma_abort; // NULL: a stalled transfer is left running
+  // Reads per bnrgm0_process() call, the EXTI interrupt only flags them.
+  // 0 reads all the packets in the interrupt.
+  uint8_t rx_budget_pkts;
+  uint32_t rx_budget_us; // time budget of these reads (0 = no limit)
+  // Calibrated by bnrgm0_init(): fastest clean step minus BNRGM0_SPI_CAL_MARGIN.
+  // NULL keeps the SPI clock set by the application.
+  bnrgm0_spi_speed_t spi_speed;
+  // NULL for the SPI transport. With the UART one, SPIx, cs_pin, exti_irq_pin,
+  // spi_dma and spi_speed are unused and exti_irqn is the UART IRQ.
+  const bnrgm0_uart_t *uart;
 } bnrgm0_hw_t;
 
 typedef uint16_t ble_conn_t;
 
+// BlueNRG instance, 0 ... HCI_NUM_INSTANCES - 1: one per bnrgm0_hw_t, each on
+// its own SPI bus (or UART) and its own EXTI line.
+typedef uint8_t bnrgm0_t;
+
 typedef struct {
   uint16_t _service_handle;
 } ble_service_t;
 
-typedef struct {
+struct _ble_char_t;
+
+// Host copy of a characteristic value, see bnrgm0_setCharShadow()
+typedef struct _ble_char_shadow_t {
+  uint8_t *_value; // max_value_len bytes
+  uint16_t _len;
+  uint8_t _valid;    // _value is the one of the controller, or deferred
+  uint8_t _deferred; // _value is not written to the controller yet
+  struct _ble_char_t *_charact;
+  struct _ble_char_shadow_t *_next; // shadows of the same BlueNRG
+} ble_char_shadow_t;
+
+typedef struct _ble_char_t {
   uint16_t _service_handle;
   uint16_t _char_decl_handle;      // charactetistic declaration handle (handle)
   uint16_t _char_val_handle;       // charactetistic value handle (handle + 1)
@@ -29,6 +88,15 @@ typedef struct {
   uint16_t _max_value_len;
   uint8_t _char_props;
   uint8_t _is_variable_len;
+  uint8_t _gatt_evt_mask;
+  ble_char_shadow_t *_shadow; // NULL unless bnrgm0_setCharShadow() was called
 } ble_char_t;
 
+// One value of bnrgm0_updateCharValues()
+typedef struct {
+  const ble_char_t *charact;
+  const uint8_t *value;
+  uint16_t value_len;
+} ble_char_update_t;
+
 #endif
\ No newline at end of file
@@ -3,22 +3,60 @@
 
 #include "bnrgm0_types.h"
 
-#define HAL_GetTick millis
+struct _tHciIOVec;
+
+#define HAL_GetTick   millis
+#define HAL_GetTickUs micros
 
 int32_t HCI_TL_SPI_Init(void *pConf);
 int32_t HCI_TL_SPI_DeInit(void);
 int32_t HCI_TL_SPI_Receive(uint8_t *buffer, uint16_t size);
+int32_t HCI_TL_SPI_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size));
 int32_t HCI_TL_SPI_Send(uint8_t *buffer, uint16_t size);
+int32_t HCI_TL_SPI_SendV(const struct _tHciIOVec *iov, uint8_t iovcnt);
 int32_t HCI_TL_SPI_Reset(void);
 int32_t HCI_TL_GetTick(void);
 
+int32_t HCI_TL_UART_Init(void *pConf);
+int32_t HCI_TL_UART_DeInit(void);
+int32_t HCI_TL_UART_Receive(uint8_t *buffer, uint16_t size);
+int32_t HCI_TL_UART_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size));
+int32_t HCI_TL_UART_Send(uint8_t *buffer, uint16_t size);
+int32_t HCI_TL_UART_SendV(const struct _tHciIOVec *iov, uint8_t iovcnt);
+int32_t HCI_TL_UART_Reset(void);
+
+typedef struct {
+  uint32_t resyncs;       // packet starts found again after skipping bytes
+  uint32_t skipped_bytes; // bytes that could not start an H4 event
+  uint32_t overruns;      // the receive DMA wrote over bytes not read yet
+} hci_tl_uart_stats_t;
+
 // Bridge to eon OS
 void hci_eon_brige(const bnrgm0_hw_t *hw);
 
+// H4 UART transport, when bnrgm0_hw_t.uart is set
+void hci_tl_uart_select(uint8_t id);
+void hci_tl_uart_bridge(const bnrgm0_hw_t *hw);
+int32_t hci_tl_uart_data_available(void);
+void hci_tl_uart_irq(void);
+void hci_tl_uart_getStats(hci_tl_uart_stats_t *stats);
+
+// Instance of the functions below, called by hci_select()
+void hci_tl_lowlevel_select(uint8_t id);
+
 // Register hci_tl_interface IO bus services
 void hci_tl_lowlevel_init(void);
 
 // HCI Transport Layer Low Level Interrupt Service Routine
 void hci_tl_lowlevel_isr(void);
 
+// Reads flagged by the ISR when bnrgm0_hw_t.rx_budget_pkts is set
+int32_t hci_tl_lowlevel_bottom_half(void);
+
+// Read the packets left in the BlueNRG while the read flow was paused
+void hci_tl_lowlevel_resume(void);
+
+// SPI DMA transfer complete Interrupt Service Routine
+void hci_tl_lowlevel_dma_isr(void);
+
 #endif
\ No newline at end of file
@@ -21,8 +21,78 @@
 #define MAX_LOCAL_NAME_AD_LEN     ((uint8_t) 21) // 20 for name and 1 byte for ad type
 #define DISCOVERABLE_MODE_STARTED ((uint8_t) (0x00))
 #define DISCOVERABLE_MODE_STOPPED ((uint8_t) (0x01))
+// Value bytes of an aci_gatt_update_char_value_ext packet fitting in HCI_MAX_PAYLOAD_SIZE
+#define UPDATE_CHUNK_MAX \
+  ((uint8_t) (HCI_MAX_PAYLOAD_SIZE - HCI_HDR_SIZE - HCI_COMMAND_HDR_SIZE - GATT_UPD_CHAR_VAL_EXT_CP_SIZE))
 
-static struct {
+// SPI clock calibration: echo reads per speed step, and steps kept below the
+// fastest clean one.
+#ifndef BNRGM0_SPI_CAL_READS
+#define BNRGM0_SPI_CAL_READS 8
+#endif
+#ifndef BNRGM0_SPI_CAL_MARGIN
+#define BNRGM0_SPI_CAL_MARGIN 1
+#endif
+
+// Client RX MTU of the BlueNRG-MS: the ATT_MTU negotiated on a connection is
+// at most this one.
+#ifndef BNRGM0_ATT_MTU_MAX
+#define BNRGM0_ATT_MTU_MAX 158
+#endif
+
+// Notification queue of bnrgm0_queueCharValue() and bnrgm0_streamWrite():
+// values waiting for a controller TX buffer, and their largest length (one
+// notification at the largest ATT_MTU).
+#ifndef BNRGM0_NOTIFY_QUEUE_LEN
+#define BNRGM0_NOTIFY_QUEUE_LEN 8
+#endif
+#ifndef BNRGM0_NOTIFY_VALUE_MAX
+#define BNRGM0_NOTIFY_VALUE_MAX (BNRGM0_ATT_MTU_MAX - 3)
+#endif
+
+// Longest wait of bnrgm0_updateCharValue() for a controller TX buffer before
+// it fails with BLE_STATUS_INSUFFICIENT_RESOURCES. 0 never waits: the caller
+// queues the value with bnrgm0_queueCharValue() instead.
+#ifndef BNRGM0_TX_WAIT_MS
+#define BNRGM0_TX_WAIT_MS HCI_DEFAULT_TIMEOUT_MS
+#endif
+
+// Characteristics updated latest value wins, see bnrgm0_setCharCoalescing().
+#ifndef BNRGM0_COALESCE_MAX
+#define BNRGM0_COALESCE_MAX 4
+#endif
+
+// Read permit requests waiting for bnrgm0_process(): one per connection at
+// most, ATT requests are sequential, and the BlueNRG-MS has 8 links.
+#ifndef BNRGM0_READ_PERMIT_MAX
+#define BNRGM0_READ_PERMIT_MAX 8
+#endif
+
+typedef struct {
+  const ble_char_t *charact;
+  uint8_t len;
+  uint8_t value[BNRGM0_NOTIFY_VALUE_MAX];
+} notify_entry_t;
+
+// Newest value of a coalesced characteristic, queued once the controller took
+// the previous one and min_interval_ms elapsed.
+typedef struct {
+  const ble_char_t *charact;
+  uint16_t min_interval_ms;
+  uint32_t last_tick; // when the previous value was queued
+  uint8_t pending;
+  uint8_t len;
+  uint8_t value[BNRGM0_NOTIFY_VALUE_MAX];
+} coalesce_slot_t;
+
+// Read of a characteristic waiting for aci_gatt_allow_read()
+typedef struct {
+  uint16_t conn;
+  uint16_t handle;
+} read_permit_t;
+
+// One per BlueNRG, the one of the last bnrgm0 call is selected
+typedef struct {
   ble_error_t error;
   volatile ble_conn_t conn_handle;
   volatile uint8_t is_connected;
@@ -31,25 +101,440 @@ static struct {
   uint8_t connectable_mode_enabled;   // check if user enable connectable mode
   uint8_t mtu_exchanged;
   uint8_t mtu_exchanged_wait;
+  uint16_t att_mtu; // of the connection, ATT_MTU (23) until the exchange
   uint8_t local_name_AD[MAX_LOCAL_NAME_AD_LEN];
   uint8_t local_name_AD_len;
-} ble_state = {
-    .error                    = BLE_ERROR_NONE,
-    .conn_handle              = 0,
-    .is_connected             = false,
-    .connectable_mode_enabled = false,
-    .discoverable_mode        = DISCOVERABLE_MODE_STOPPED,
-    .mtu_exchanged            = 0,
-    .mtu_exchanged_wait       = 0,
-    .local_name_AD            = {AD_TYPE_COMPLETE_LOCAL_NAME, 'E', 'O', 'N', 'B', 'L', 'E'},
-    .local_name_AD_len        = 7,
-};
+  uint32_t spi_clock; // selected by the calibration, 0 if not calibrated
+  // bnrgm0_queueCharValue(): the value at notify_head is sent asynchronously,
+  // one at a time, and dropped from the queue once the controller took it.
+  notify_entry_t notify_q[BNRGM0_NOTIFY_QUEUE_LEN];
+  uint8_t notify_head;
+  uint8_t notify_count;
+  uint8_t notify_sent;     // the head is in flight
+  uint8_t notify_off;      // bytes of the head already written, values longer than one command
+  uint8_t notify_chunk;    // length of the chunk in flight
+  uint8_t notify_pool_seq; // tx_pool_seq when the head was sent
+  uint8_t tx_pool_seq;     // TX pool available events received
+  uint32_t tx_full_tick;   // when the queue found the TX pool full
+  // bnrgm0_streamWrite(): bytes packed into the next notification of stream_char
+  const ble_char_t *stream_char;
+  uint8_t stream_len;
+  uint8_t stream_buf[BNRGM0_NOTIFY_VALUE_MAX];
+  coalesce_slot_t coalesce[BNRGM0_COALESCE_MAX];
+  uint8_t n_coalesce;
+  // bnrgm0_setCharShadow(): the shadowed characteristics, and the deferred
+  // values bnrgm0_process() writes on connection and on read permit requests
+  ble_char_shadow_t *shadows;
+  uint8_t shadow_flush;
+  read_permit_t read_permit[BNRGM0_READ_PERMIT_MAX];
+  uint8_t n_read_permit;
+} ble_state_t;
+
+// Set by bnrgm0_init()
+static ble_state_t ble_state[HCI_NUM_INSTANCES];
+static ble_state_t *state = &ble_state[0];
 
 // ===============================================================
 // Privates
 // ===============================================================
 
-__STATIC_INLINE void setError(ble_error_t error) { ble_state.error = error; }
+__STATIC_INLINE void setError(ble_error_t error) { state->error = error; }
+
+// Selects the BlueNRG of a bnrgm0 call: its state here and its HCI instance.
+static void select_instance(bnrgm0_t ble) {
+  state = &ble_state[ble];
+  hci_select(ble);
+}
+
+// GATT update type of a value update: notification and/or indication.
+static uint8_t update_type_of(const ble_char_t *charact) {
+  uint8_t update_type = 0x00; // GATT_LOCAL_UPDATE
+  if ((charact->_char_props & CHAR_PROP_NOTIFY) != 0x00) {
+    update_type |= 0x01; // GATT_NOTIFICATION
+  }
+  if ((charact->_char_props & CHAR_PROP_INDICATE) != 0x00) {
+    update_type |= 0x02; // GATT_INDICATION
+  }
+  return update_type;
+}
+
+// An update was refused for lack of TX buffer: wait for the TX pool available
+// event, see tx_pool_ready().
+static void tx_pool_full(ble_state_t *st) {
+  st->is_tx_buffer_full = true;
+  st->tx_full_tick      = millis();
+}
+
+// Writes one chunk of a characteristic value, waiting for the TX pool
+// available event while the controller has no buffer for the notification,
+// BNRGM0_TX_WAIT_MS at most.
+static bool update_chunk(const ble_char_t *charact, uint8_t update_type, uint16_t char_length,
+                         uint16_t offset, uint8_t chunk_len, const uint8_t *chunk) {
+  uint8_t ret        = BLE_STATUS_INSUFFICIENT_RESOURCES;
+  uint32_t tickstart = millis();
+  while (ret == BLE_STATUS_INSUFFICIENT_RESOURCES) {
+    ret = aci_gatt_update_char_value_ext_IDB05A1(charact->_service_handle, charact->_char_decl_handle,
+                                                 update_type, char_length, offset, chunk_len, chunk);
+    if (ret != BLE_STATUS_INSUFFICIENT_RESOURCES) { break; }
+    tx_pool_full(state);
+    while (state->is_tx_buffer_full) {
+      // Radio is busy (buffer full).
+      if ((millis() - tickstart) >= BNRGM0_TX_WAIT_MS) {
+        setError(BLE_STATUS_INSUFFICIENT_RESOURCES);
+        DEBUG_PRINTF("Failed to update characteristic: TX buffer full\n");
+        return false;
+      }
+      hci_user_evt_proc();
+    }
+  }
+  if (ret != BLE_ERROR_NONE) {
+    setError(ret);
+    DEBUG_PRINTF("Failed to update characteristic: 0x%x\n", ret);
+    return false;
+  }
+  return true;
+}
+
+// Writes a whole value. A value longer than one command is written in chunks
+// at their offset, the notification or indication goes out with the last one.
+static bool write_value(const ble_char_t *charact, const uint8_t *value, uint16_t value_len) {
+  uint16_t offset = 0;
+  do {
+    uint8_t chunk_len = (value_len - offset > UPDATE_CHUNK_MAX) ? UPDATE_CHUNK_MAX : value_len - offset;
+    bool last         = (offset + chunk_len == value_len);
+    if (!update_chunk(charact, last ? update_type_of(charact) : 0x00, value_len, offset, chunk_len,
+                      &value[offset])) {
+      return false;
+    }
+    offset += chunk_len;
+  } while (offset < value_len);
+  return true;
+}
+
+// A local-only value nobody can read yet: no connection, or the peer reads it
+// through a read permit request.
+static bool shadow_defers(const ble_char_t *charact) {
+  return update_type_of(charact) == 0x00 &&
+         (!state->is_connected || (charact->_gatt_evt_mask & GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP));
+}
+
+// Keeps a value in the shadow of the characteristic, if any. Returns false if
+// the controller already has it (or will get it): the update is skipped.
+static bool shadow_store(const ble_char_t *charact, const uint8_t *value, uint16_t len) {
+  ble_char_shadow_t *sh = charact->_shadow;
+  if (sh == NULL) { return true; }
+  if (sh->_valid && sh->_len == len && !memcmp(sh->_value, value, len)) { return false; }
+  memcpy(sh->_value, value, len);
+  sh->_len      = len;
+  sh->_valid    = true;
+  sh->_deferred = false;
+  return true;
+}
+
+// Writes a deferred value to the controller, the next update of the same
+// value retries it if that fails.
+static void shadow_write(ble_char_shadow_t *sh) {
+  if (!sh->_deferred) { return; }
+  sh->_deferred = false;
+  if (!write_value(sh->_charact, sh->_value, sh->_len)) { sh->_valid = false; }
+}
+
+// Submits one chunk of a characteristic value without waiting, returns its
+// token or < 0 if no asynchronous slot is free.
+static int update_chunk_async(const ble_char_t *charact, uint8_t update_type, uint16_t char_length,
+                              uint16_t offset, uint8_t chunk_len, const uint8_t *chunk, hci_status_cb cb,
+                              void *ctx) {
+  return aci_gatt_update_char_value_ext_async_IDB05A1(charact->_service_handle, charact->_char_decl_handle,
+                                                      update_type, char_length, offset, chunk_len, chunk, cb,
+                                                      ctx);
+}
+
+// The controller may have a TX buffer: no update was refused for lack of one,
+// or the TX pool available event got lost for HCI_DEFAULT_TIMEOUT_MS.
+static bool tx_pool_ready(ble_state_t *st) {
+  if (st->is_tx_buffer_full) {
+    if ((millis() - st->tx_full_tick) <= HCI_DEFAULT_TIMEOUT_MS) { return false; }
+    st->is_tx_buffer_full = false;
+  }
+  return true;
+}
+
+static void notify_drain(ble_state_t *st);
+
+// Adds a value at the tail of the queue, the caller checked there is room.
+static void notify_enqueue(ble_state_t *st, const ble_char_t *charact, const uint8_t *value, uint8_t len) {
+  notify_entry_t *e = &st->notify_q[(st->notify_head + st->notify_count) % BNRGM0_NOTIFY_QUEUE_LEN];
+  e->charact        = charact;
+  e->len            = len;
+  memcpy(e->value, value, len);
+  st->notify_count++;
+}
+
+// Queued value of a characteristic the controller has not started to take,
+// NULL if none. With all set, the head in flight counts too.
+static notify_entry_t *notify_find(ble_state_t *st, const ble_char_t *charact, bool all) {
+  uint8_t first = (!all && (st->notify_sent || st->notify_off != 0)) ? 1 : 0;
+  for (uint8_t i = first; i < st->notify_count; i++) {
+    notify_entry_t *e = &st->notify_q[(st->notify_head + i) % BNRGM0_NOTIFY_QUEUE_LEN];
+    if (e->charact == charact) { return e; }
+  }
+  return NULL;
+}
+
+// Queues the pending coalesced values whose previous one is gone and whose
+// interval elapsed.
+static void coalesce_flush(ble_state_t *st) {
+  for (uint8_t i = 0; i < st->n_coalesce; i++) {
+    coalesce_slot_t *slot = &st->coalesce[i];
+    if (!slot->pending || st->notify_count == BNRGM0_NOTIFY_QUEUE_LEN ||
+        notify_find(st, slot->charact, true) != NULL || (millis() - slot->last_tick) < slot->min_interval_ms) {
+      continue;
+    }
+    notify_enqueue(st, slot->charact, slot->value, slot->len);
+    slot->pending   = 0;
+    slot->last_tick = millis();
+  }
+}
+
+static coalesce_slot_t *coalesce_slot_of(const ble_char_t *charact) {
+  for (uint8_t i = 0; i < state->n_coalesce; i++) {
+    if (state->coalesce[i].charact == charact) { return &state->coalesce[i]; }
+  }
+  return NULL;
+}
+
+// Latest value wins: it replaces the queued one the controller has not
+// started to take, or waits in the slot for the previous one to go.
+static void coalesce_update(coalesce_slot_t *slot, const uint8_t *value, uint8_t len) {
+  notify_entry_t *e = notify_find(state, slot->charact, false);
+  if (e != NULL) {
+    e->len = len;
+    memcpy(e->value, value, len);
+    slot->pending = 0; // older than this one
+  } else {
+    slot->len = len;
+    memcpy(slot->value, value, len);
+    slot->pending = 1;
+  }
+  notify_drain(state);
+}
+
+// Completion of the queued value update in flight.
+static void notify_done(int token, uint8_t status, void *ctx) {
+  ble_state_t *st = ctx;
+  st->notify_sent = 0;
+  if (status == BLE_STATUS_INSUFFICIENT_RESOURCES) {
+    // Wait for the TX pool available event, unless it came in meanwhile
+    if (st->tx_pool_seq == st->notify_pool_seq) {
+      tx_pool_full(st);
+      return;
+    }
+  } else if (status == BLE_STATUS_SUCCESS && st->notify_off + st->notify_chunk < st->notify_q[st->notify_head].len) {
+    // next chunk of the value
+    st->notify_off += st->notify_chunk;
+  } else {
+    if (status != BLE_STATUS_SUCCESS) {
+      const ble_char_t *charact = st->notify_q[st->notify_head].charact;
+      if (charact->_shadow != NULL) { charact->_shadow->_valid = false; }
+      st->error = status;
+      DEBUG_PRINTF("Failed to update queued characteristic: 0x%x\n", st->error);
+    }
+    st->notify_off  = 0;
+    st->notify_head = (st->notify_head + 1) % BNRGM0_NOTIFY_QUEUE_LEN;
+    st->notify_count--;
+  }
+  notify_drain(st);
+}
+
+// Sends the value at the head of the queue, unless it is already in flight
+// or the controller has no TX buffer for it. A TX pool available event lost
+// on the way is covered by a retry after HCI_DEFAULT_TIMEOUT_MS. A value
+// longer than one command goes in chunks like in bnrgm0_updateCharValue().
+static void notify_drain(ble_state_t *st) {
+  coalesce_flush(st);
+  if (st->notify_sent || st->notify_count == 0 || !tx_pool_ready(st)) { return; }
+  const notify_entry_t *e = &st->notify_q[st->notify_head];
+  uint8_t chunk           = e->len - st->notify_off;
+  if (chunk > UPDATE_CHUNK_MAX) { chunk = UPDATE_CHUNK_MAX; }
+  uint8_t update_type = (st->notify_off + chunk == e->len) ? update_type_of(e->charact) : 0x00;
+
+  st->notify_chunk    = chunk;
+  st->notify_pool_seq = st->tx_pool_seq;
+  // no free asynchronous slot: bnrgm0_process() tries again
+  if (update_chunk_async(e->charact, update_type, e->len, st->notify_off, chunk, &e->value[st->notify_off],
+                         notify_done, st) >= 0) {
+    st->notify_sent = 1;
+  }
+}
+
+// Adds a value at the tail of the queue and sends it when it is the head,
+// false if the queue is full.
+static bool notify_push(ble_state_t *st, const ble_char_t *charact, const uint8_t *value, uint8_t len) {
+  if (st->notify_count == BNRGM0_NOTIFY_QUEUE_LEN) { return false; }
+  notify_enqueue(st, charact, value, len);
+  notify_drain(st);
+  return true;
+}
+
+// Bytes of a stream notification: ATT_MTU-3, within a queue entry and the
+// characteristic max length.
+static uint8_t stream_payload_max(const ble_char_t *charact) {
+  uint16_t max = state->att_mtu - 3;
+  if (max > BNRGM0_NOTIFY_VALUE_MAX) { max = BNRGM0_NOTIFY_VALUE_MAX; }
+  if (max > charact->_max_value_len) { max = charact->_max_value_len; }
+  return (uint8_t) max;
+}
+
+// Queues the packed stream bytes, false if the queue is full.
+static bool stream_flush(void) {
+  if (state->stream_len == 0) { return true; }
+  if (!notify_push(state, state->stream_char, state->stream_buf, state->stream_len)) { return false; }
+  state->stream_len = 0;
+  return true;
+}
+
+// Longest value of an update: the characteristic one, and a queue entry with
+// coalescing.
+static bool update_len_valid(const ble_char_t *charact, uint16_t value_len) {
+  return value_len <= charact->_max_value_len &&
+         (coalesce_slot_of(charact) == NULL || value_len <= BNRGM0_NOTIFY_VALUE_MAX);
+}
+
+// The shadow and the coalescing of an update: true if the value is not
+// written now (unchanged, deferred or queued).
+static bool update_absorbed(const ble_char_t *charact, const uint8_t *value, uint16_t value_len) {
+  if (!shadow_store(charact, value, value_len)) { return true; }
+  coalesce_slot_t *slot = coalesce_slot_of(charact);
+  if (slot != NULL) {
+    coalesce_update(slot, value, (uint8_t) value_len);
+    return true;
+  }
+  if (charact->_shadow != NULL && shadow_defers(charact)) {
+    charact->_shadow->_deferred = true;
+    return true;
+  }
+  return false;
+}
+
+// bnrgm0_updateCharValues(): the updates in flight, each one waiting for its
+// command complete or for a TX buffer. They share the asynchronous slots of
+// hci_tl with the notification queue, which keeps one for its value in flight.
+#if HCI_ASYNC_REQ_NUM_MAX < 2
+#error "HCI_ASYNC_REQ_NUM_MAX must be 2 or more: one for the notification queue"
+#endif
+#define BATCH_REQ_MAX (HCI_ASYNC_REQ_NUM_MAX - 1)
+
+#define BATCH_REQ_FREE  0
+#define BATCH_REQ_SENT  1
+#define BATCH_REQ_RETRY 2 // refused for lack of TX buffer or asynchronous slot
+
+struct batch;
+
+typedef struct {
+  struct batch *b;
+  uint8_t index; // in the updates
+  uint8_t state;
+  uint8_t pool_seq; // tx_pool_seq when it was sent
+} batch_req_t;
+
+typedef struct batch {
+  ble_state_t *st;
+  const ble_char_update_t *updates;
+  uint8_t count;
+  uint8_t next; // first update not looked at yet
+  uint8_t in_flight;
+  uint32_t progress; // completions, for the timeout
+  ble_error_t status; // first failure
+  batch_req_t req[BATCH_REQ_MAX];
+} batch_t;
+
+static void batch_fail(batch_t *b, const ble_char_t *charact, ble_error_t status) {
+  if (charact->_shadow != NULL) { charact->_shadow->_valid = false; }
+  if (b->status == BLE_ERROR_NONE) { b->status = status; }
+}
+
+static void batch_done(int token, uint8_t status, void *ctx) {
+  batch_req_t *req          = ctx;
+  batch_t *b                = req->b;
+  const ble_char_t *charact = b->updates[req->index].charact;
+  b->in_flight--;
+  b->progress++;
+  if (status == BLE_STATUS_INSUFFICIENT_RESOURCES) {
+    // Wait for the TX pool available event, unless it came in meanwhile
+    if (b->st->tx_pool_seq == req->pool_seq) {
+      tx_pool_full(b->st);
+    }
+    req->state = BATCH_REQ_RETRY;
+    return;
+  }
+  req->state = BATCH_REQ_FREE;
+  if (status != BLE_STATUS_SUCCESS) { batch_fail(b, charact, status); }
+}
+
+static void batch_send(batch_t *b, batch_req_t *req) {
+  const ble_char_update_t *u = &b->updates[req->index];
+  req->pool_seq              = b->st->tx_pool_seq;
+  if (update_chunk_async(u->charact, update_type_of(u->charact), u->value_len, 0, (uint8_t) u->value_len,
+                         u->value, batch_done, req) < 0) {
+    req->state = BATCH_REQ_RETRY;
+    return;
+  }
+  req->state = BATCH_REQ_SENT;
+  b->in_flight++;
+}
+
+// An update of the characteristic is in flight or refused.
+static bool batch_char_busy(const batch_t *b, const ble_char_t *charact) {
+  for (uint8_t i = 0; i < BATCH_REQ_MAX; i++) {
+    if (b->req[i].state != BATCH_REQ_FREE && b->updates[b->req[i].index].charact == charact) { return true; }
+  }
+  return false;
+}
+
+// Sends the refused updates again, oldest first, once the ones in flight are
+// done and the controller has a TX buffer. Then the next ones, in order, as
+// long as there are requests and asynchronous slots for them: an update waits
+// for the one in flight of its characteristic, which gets them in order.
+static void batch_pump(batch_t *b) {
+  bool resumed = false;
+  for (;;) {
+    batch_req_t *req = NULL;
+    for (uint8_t i = 0; i < BATCH_REQ_MAX; i++) {
+      if (b->req[i].state == BATCH_REQ_RETRY && (req == NULL || b->req[i].index < req->index)) {
+        req = &b->req[i];
+      }
+    }
+    if (req == NULL) { break; }
+    if (!resumed && (b->in_flight > 0 || !tx_pool_ready(b->st))) { return; }
+    resumed = true;
+    batch_send(b, req);
+    if (req->state == BATCH_REQ_RETRY) { return; }
+  }
+  while (b->next < b->count) {
+    batch_req_t *req = NULL;
+    for (uint8_t i = 0; i < BATCH_REQ_MAX && req == NULL; i++) {
+      if (b->req[i].state == BATCH_REQ_FREE) { req = &b->req[i]; }
+    }
+    const ble_char_update_t *u = &b->updates[b->next];
+    if (req == NULL || batch_char_busy(b, u->charact)) { return; }
+    req->index = b->next++;
+    if (update_absorbed(u->charact, u->value, u->value_len)) { continue; }
+    if (u->value_len > UPDATE_CHUNK_MAX) {
+      // more than one command: written in chunks meanwhile
+      if (!write_value(u->charact, u->value, u->value_len)) { batch_fail(b, u->charact, b->st->error); }
+      continue;
+    }
+    batch_send(b, req);
+    if (req->state == BATCH_REQ_RETRY) { return; }
+  }
+}
+
+static bool batch_idle(const batch_t *b) {
+  for (uint8_t i = 0; i < BATCH_REQ_MAX; i++) {
+    if (b->req[i].state != BATCH_REQ_FREE) { return false; }
+  }
+  return b->next == b->count;
+}
 
 static tBleStatus setup_public_address(const uint8_t *addr) {
   uint8_t bdaddr[6];
@@ -89,6 +574,41 @@ static tBleStatus setup_public_address(const uint8_t *addr) {
   return aci_hal_write_config_data(CONFIG_DATA_PUBADDR_OFFSET, CONFIG_DATA_PUBADDR_LEN, bdaddr);
 }
 
+// Echo reads of the public address at the current SPI clock: both reads must
+// return the reference and no packet may be dropped by verify_packet().
+static bool spi_cal_clean(const uint8_t *ref) {
+  tHciStats before, after;
+  uint8_t addr[CONFIG_DATA_PUBADDR_LEN];
+  uint8_t len;
+
+  hci_get_stats(&before);
+  for (uint8_t i = 0; i < BNRGM0_SPI_CAL_READS; i++) {
+    if (hci_read_bd_addr(addr) != BLE_STATUS_SUCCESS || memcmp(addr, ref, sizeof(addr))) { return false; }
+    if (aci_hal_read_config_data(CONFIG_DATA_PUBADDR_OFFSET, sizeof(addr), &len, addr) != BLE_STATUS_SUCCESS ||
+        len != sizeof(addr) || memcmp(addr, ref, sizeof(addr))) {
+      return false;
+    }
+  }
+  hci_get_stats(&after);
+  return after.rxBadType == before.rxBadType && after.rxBadLength == before.rxBadLength;
+}
+
+// Step the SPI clock up until the echo reads fail, then lock in the fastest
+// clean step minus the margin.
+static void spi_calibrate(const bnrgm0_hw_t *hw) {
+  uint8_t ref[CONFIG_DATA_PUBADDR_LEN];
+  uint8_t clean = 0;
+
+  state->spi_clock = hw->spi_speed(hw->SPIx, 0);
+  if (state->spi_clock == 0 || hci_read_bd_addr(ref) != BLE_STATUS_SUCCESS) { return; }
+  for (uint8_t step = 1; hw->spi_speed(hw->SPIx, step) != 0 && spi_cal_clean(ref); step++) {
+    clean = step;
+  }
+  clean               = (clean > BNRGM0_SPI_CAL_MARGIN) ? clean - BNRGM0_SPI_CAL_MARGIN : 0;
+  state->spi_clock = hw->spi_speed(hw->SPIx, clean);
+  DEBUG_PRINTF("SPI clock calibrated: step %u, %lu Hz\n", clean, (unsigned long) state->spi_clock);
+}
+
 // Hex digit to decimal digit
 static uint8_t _hexDigitToDec(char hexDigit) {
   if ((hexDigit >= '0') && (hexDigit <= '9')) { return (hexDigit - '0'); }
@@ -127,7 +647,7 @@ static bool _uuidStringToBuff(uint8_t *uuid, uint8_t *uuidType, const char *uuid
 // Error getter
 // ===============================================================
 
-ble_error_t bnrg2_getError(void) { return ble_state.error; }
+ble_error_t bnrgm0_getError(bnrgm0_t ble) { return ble_state[ble].error; }
 
 // ===============================================================
 // Functions
@@ -135,9 +655,32 @@ ble_error_t bnrg2_getError(void) { return ble_state.error; }
 
 // Initialize BlueNRG-M0 hardware. Passing a null public address, will
 // generate a real random public address.
-bool bnrgm0_init(const bnrgm0_hw_t *hw, const uint8_t *pubaddr) {
+bool bnrgm0_init(bnrgm0_t ble, const bnrgm0_hw_t *hw, const uint8_t *pubaddr) {
   uint8_t ret;
+  select_instance(ble);
   setError(BLE_ERROR_NONE);
+  state->conn_handle              = 0;
+  state->is_connected             = false;
+  state->connectable_mode_enabled = false;
+  state->discoverable_mode        = DISCOVERABLE_MODE_STOPPED;
+  state->mtu_exchanged            = 0;
+  state->mtu_exchanged_wait       = 0;
+  state->att_mtu                  = ATT_MTU;
+  // the default name, unless bnrgm0_setLocalName() came first
+  if (state->local_name_AD_len == 0) {
+    static const uint8_t name_AD[] = {AD_TYPE_COMPLETE_LOCAL_NAME, 'E', 'O', 'N', 'B', 'L', 'E'};
+    memcpy(state->local_name_AD, name_AD, sizeof(name_AD));
+    state->local_name_AD_len = sizeof(name_AD);
+  }
+  state->notify_count      = 0;
+  state->notify_sent       = 0;
+  state->notify_off        = 0;
+  state->stream_len        = 0;
+  state->n_coalesce        = 0;
+  state->shadows           = NULL;
+  state->shadow_flush      = 0;
+  state->n_read_permit     = 0;
+  state->is_tx_buffer_full = false;
   hci_eon_brige(hw);
   hci_init(bnrgm0_event_rx, NULL);
   ret = hci_reset(); // Sw reset of the device
@@ -153,12 +696,14 @@ bool bnrgm0_init(const bnrgm0_hw_t *hw, const uint8_t *pubaddr) {
     setError(ret);
     return false;
   }
+  if (hw->spi_speed != NULL) { spi_calibrate(hw); }
   return true;
 }
 
 // Set transmission power.
 //
-bool bnrgm0_setTxPower(bool high_power, uint8_t pa_level) {
+bool bnrgm0_setTxPower(bnrgm0_t ble, bool high_power, uint8_t pa_level) {
+  select_instance(ble);
   uint8_t ret = aci_hal_set_tx_power_level(high_power ? 1 : 0, pa_level);
   if (ret != BLE_ERROR_NONE) {
     DEBUG_PRINTF("Error while setting tx power level: 0x%x\n", ret);
@@ -170,9 +715,10 @@ bool bnrgm0_setTxPower(bool high_power, uint8_t pa_level) {
 
 // Initialize ble stack ( GATT and GAP ).
 //
-bool bnrgm0_stackInit(void) {
+bool bnrgm0_stackInit(bnrgm0_t ble) {
   uint8_t ret;
   uint16_t service_handle, dev_name_char_handle, appearance_char_handle;
+  select_instance(ble);
   setError(BLE_ERROR_NONE);
 
   // GATT Init
@@ -195,10 +741,11 @@ bool bnrgm0_stackInit(void) {
 
 // Add a ble service.
 //
-bool bnrgm0_addService(ble_service_t *s, const char *uuid, uint8_t nbOfCharacteristics) {
+bool bnrgm0_addService(bnrgm0_t ble, ble_service_t *s, const char *uuid, uint8_t nbOfCharacteristics) {
   uint8_t ret;
   uint8_t service_uuid[16];
   uint8_t uuidType;
+  select_instance(ble);
   setError(BLE_ERROR_NONE);
   if (!_uuidStringToBuff(&service_uuid[0], &uuidType, uuid)) {
     DEBUG_PRINTF("Invalid service uuid\n");
@@ -221,13 +768,14 @@ bool bnrgm0_addService(ble_service_t *s, const char *uuid, uint8_t nbOfCharacter
 
 // Add characteristic to a service.
 //
-bool bnrgm0_addCharacteristic(const ble_service_t *s, ble_char_t *charact,
+bool bnrgm0_addCharacteristic(bnrgm0_t ble, const ble_service_t *s, ble_char_t *charact,
                               const char *uuid, uint16_t max_value_len,
                               uint8_t is_variable_len, uint8_t char_properties,
                               uint8_t gatt_evt_mask) {
   uint8_t ret;
   uint8_t char_uuid[16];
   uint8_t uuidType;
+  select_instance(ble);
   setError(BLE_ERROR_NONE);
   if (!_uuidStringToBuff(&char_uuid[0], &uuidType, uuid)) {
     DEBUG_PRINTF("Invalid characteristic uuid");
@@ -247,109 +795,286 @@ bool bnrgm0_addCharacteristic(const ble_service_t *s, ble_char_t *charact,
   charact->_char_props            = char_properties;
   charact->_max_value_len         = max_value_len;
   charact->_is_variable_len       = is_variable_len;
+  charact->_gatt_evt_mask         = gatt_evt_mask;
+  charact->_shadow                = NULL;
   return true;
 }
 
 // Update a characteristic value in a ble connection.
 //
-bool bnrgm0_updateCharValue(ble_conn_t conn, const ble_char_t *charact,
-                            const uint8_t *value, uint8_t value_len) {
+bool bnrgm0_updateCharValue(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                            const uint8_t *value, uint16_t value_len) {
+  select_instance(ble);
+  setError(BLE_ERROR_NONE);
+  if (!update_len_valid(charact, value_len)) {
+    setError(BLE_STATUS_INVALID_PARAMS);
+    DEBUG_PRINTF("Failed to update characteristic: value too long\n");
+    return false;
+  }
+  if (update_absorbed(charact, value, value_len)) { return true; }
+  if (!write_value(charact, value, value_len)) {
+    if (charact->_shadow != NULL) { charact->_shadow->_valid = false; }
+    return false;
+  }
+  return true;
+}
+
+// Update a characteristic through the notification queue, latest value wins.
+//
+bool bnrgm0_setCharCoalescing(bnrgm0_t ble, const ble_char_t *charact, uint16_t min_interval_ms) {
+  select_instance(ble);
+  setError(BLE_ERROR_NONE);
+  coalesce_slot_t *slot = coalesce_slot_of(charact);
+  if (slot == NULL) {
+    if (state->n_coalesce == BNRGM0_COALESCE_MAX) {
+      setError(BLE_STATUS_INSUFFICIENT_RESOURCES);
+      return false;
+    }
+    slot            = &state->coalesce[state->n_coalesce++];
+    slot->charact   = charact;
+    slot->pending   = 0;
+    slot->last_tick = millis() - min_interval_ms;
+  }
+  slot->min_interval_ms = min_interval_ms;
+  return true;
+}
 
-  uint8_t update_type = 0x00; // GATT_LOCAL_UPDATE
-  uint8_t ret         = BLE_STATUS_INSUFFICIENT_RESOURCES;
+// Update several characteristic values, their commands pipelined.
+//
+bool bnrgm0_updateCharValues(bnrgm0_t ble, ble_conn_t conn, const ble_char_update_t *updates, uint8_t count) {
+  batch_t b;
+  select_instance(ble);
   setError(BLE_ERROR_NONE);
-  if ((charact->_char_props & CHAR_PROP_NOTIFY) != 0x00) {
-    update_type |= 0x01; // GATT_NOTIFICATION
+  for (uint8_t i = 0; i < count; i++) {
+    if (!update_len_valid(updates[i].charact, updates[i].value_len)) {
+      setError(BLE_STATUS_INVALID_PARAMS);
+      DEBUG_PRINTF("Failed to update characteristic %u: value too long\n", i);
+      return false;
+    }
   }
-  if ((charact->_char_props & CHAR_PROP_INDICATE) != 0x00) {
-    update_type |= 0x02; // GATT_INDICATION
+  memset(&b, 0, sizeof(b));
+  b.st      = state;
+  b.updates = updates;
+  b.count   = count;
+  for (uint8_t i = 0; i < BATCH_REQ_MAX; i++) {
+    b.req[i].b = &b;
   }
+
+  bool timed_out     = false;
+  uint32_t progress  = 0;
   uint32_t tickstart = millis();
-  while (ret == BLE_STATUS_INSUFFICIENT_RESOURCES) {
-    ret = aci_gatt_update_char_value_ext_IDB05A1(charact->_service_handle,
-                                                 charact->_char_decl_handle, update_type, value_len,
-                                                 0, value_len, (uint8_t *) value); // offset = 0
-    if (ret != BLE_STATUS_INSUFFICIENT_RESOURCES) { break; }
-    ble_state.is_tx_buffer_full = true;
-    while (ble_state.is_tx_buffer_full) {
-      hci_user_evt_proc();
-      // Radio is busy (buffer full).
-      if ((millis() - tickstart) > (10 * HCI_DEFAULT_TIMEOUT_MS)) {
-        setError(BLE_STATUS_TIMEOUT);
-        DEBUG_PRINTF("Failed to update characteristic: TIMEOUT\n");
-        return false;
+  for (;;) {
+    if (!timed_out) { batch_pump(&b); }
+    // the requests in flight complete or time out in hci_tl before returning
+    if (b.in_flight == 0 && (timed_out || batch_idle(&b))) { break; }
+    hci_user_evt_proc();
+    if (b.progress != progress) {
+      progress  = b.progress;
+      tickstart = millis();
+    } else if (!timed_out && (millis() - tickstart) > (10 * HCI_DEFAULT_TIMEOUT_MS)) {
+      // Radio is busy (buffer full): the updates not sent yet fail
+      DEBUG_PRINTF("Failed to update characteristics: TIMEOUT\n");
+      timed_out = true;
+      for (; b.next < count; b.next++) {
+        batch_fail(&b, updates[b.next].charact, BLE_STATUS_TIMEOUT);
       }
     }
   }
-  if (ret != BLE_ERROR_NONE) {
-    setError(ret);
-    DEBUG_PRINTF("Failed to update characteristic: 0x%x\n", ret);
+  for (uint8_t i = 0; i < BATCH_REQ_MAX; i++) {
+    if (b.req[i].state == BATCH_REQ_RETRY) { batch_fail(&b, updates[b.req[i].index].charact, BLE_STATUS_TIMEOUT); }
+  }
+  if (b.status != BLE_ERROR_NONE) {
+    setError(b.status);
     return false;
   }
   return true;
 }
 
+// Keep a host copy of a characteristic value to skip the updates that do not
+// change it.
+//
+void bnrgm0_setCharShadow(bnrgm0_t ble, ble_char_t *charact, ble_char_shadow_t *shadow, uint8_t *value) {
+  // a shadow set again, or the one replaced, leaves the list first
+  ble_char_shadow_t **link = &ble_state[ble].shadows;
+  while (*link != NULL) {
+    if (*link == shadow || *link == charact->_shadow) {
+      // moved from another characteristic: that one has no shadow anymore
+      if (*link == shadow && shadow->_charact->_shadow == shadow) { shadow->_charact->_shadow = NULL; }
+      *link = (*link)->_next;
+    } else {
+      link = &(*link)->_next;
+    }
+  }
+  shadow->_value         = value;
+  shadow->_len           = 0;
+  shadow->_valid         = false;
+  shadow->_deferred      = false;
+  shadow->_charact       = charact;
+  shadow->_next          = ble_state[ble].shadows;
+  ble_state[ble].shadows = shadow;
+  charact->_shadow       = shadow;
+}
+
+// Queue a characteristic value update, sent when the controller has a TX
+// buffer for it.
+//
+bool bnrgm0_queueCharValue(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                           const uint8_t *value, uint16_t value_len) {
+  select_instance(ble);
+  setError(BLE_ERROR_NONE);
+  if (value_len > BNRGM0_NOTIFY_VALUE_MAX || value_len > charact->_max_value_len) {
+    setError(BLE_STATUS_INVALID_PARAMS);
+    return false;
+  }
+  if (state->notify_count == BNRGM0_NOTIFY_QUEUE_LEN) {
+    setError(BLE_STATUS_INSUFFICIENT_RESOURCES);
+    return false;
+  }
+  if (shadow_store(charact, value, value_len)) { notify_push(state, charact, value, (uint8_t) value_len); }
+  return true;
+}
+
+// Append bytes to the stream of a characteristic, sent in notifications
+// filled up to ATT_MTU-3.
+//
+uint16_t bnrgm0_streamWrite(bnrgm0_t ble, ble_conn_t conn, const ble_char_t *charact,
+                            const uint8_t *data, uint16_t len) {
+  select_instance(ble);
+  setError(BLE_ERROR_NONE);
+  // the bytes of another characteristic go out first
+  if (state->stream_char != charact && !stream_flush()) {
+    setError(BLE_STATUS_INSUFFICIENT_RESOURCES);
+    return 0;
+  }
+  state->stream_char = charact;
+  // the stream bytes do not go through the shadow
+  if (charact->_shadow != NULL) { charact->_shadow->_valid = false; }
+  uint8_t max        = stream_payload_max(charact);
+  uint16_t done      = 0;
+  while (done < len) {
+    if (state->stream_len >= max && !stream_flush()) { break; }
+    uint16_t n = max - state->stream_len;
+    if (n > len - done) { n = len - done; }
+    memcpy(&state->stream_buf[state->stream_len], &data[done], n);
+    state->stream_len += n;
+    done += n;
+  }
+  if (state->stream_len >= max) { stream_flush(); }
+  if (done < len) { setError(BLE_STATUS_INSUFFICIENT_RESOURCES); }
+  return done;
+}
+
+// Queue the stream bytes of a partial notification.
+//
+bool bnrgm0_streamFlush(bnrgm0_t ble) {
+  select_instance(ble);
+  setError(BLE_ERROR_NONE);
+  if (!stream_flush()) {
+    setError(BLE_STATUS_INSUFFICIENT_RESOURCES);
+    return false;
+  }
+  return true;
+}
+
+// Number of queued values not taken by the controller yet.
+//
+uint8_t bnrgm0_getQueuedCharValues(bnrgm0_t ble) {
+  uint8_t n = ble_state[ble].notify_count;
+  for (uint8_t i = 0; i < ble_state[ble].n_coalesce; i++) {
+    n += ble_state[ble].coalesce[i].pending;
+  }
+  return n;
+}
+
 // Set the device Complete Local Name.
 //
-void bnrgm0_setLocalName(const uint8_t *local_name, uint8_t local_name_len) {
+void bnrgm0_setLocalName(bnrgm0_t ble, const uint8_t *local_name, uint8_t local_name_len) {
+  select_instance(ble);
   if (local_name_len > (MAX_LOCAL_NAME_AD_LEN - 1)) {
     local_name_len = MAX_LOCAL_NAME_AD_LEN - 1;
   }
-  ble_state.local_name_AD_len = local_name_len + 1;
-  ble_state.local_name_AD[0]  = AD_TYPE_COMPLETE_LOCAL_NAME;
+  state->local_name_AD_len = local_name_len + 1;
+  state->local_name_AD[0]  = AD_TYPE_COMPLETE_LOCAL_NAME;
   for (uint8_t i = 0; i < local_name_len; i++) {
-    ble_state.local_name_AD[i + 1] = local_name[i];
+    state->local_name_AD[i + 1] = local_name[i];
   }
 }
 
 // Enable or disable connectable mode.
 //
-void bnrgm0_setConnectableMode(bool en) {
-  ble_state.connectable_mode_enabled = en;
+void bnrgm0_setConnectableMode(bnrgm0_t ble, bool en) {
+  ble_state[ble].connectable_mode_enabled = en;
 }
 
 // Execute Bluenrg-M0 processes (must be called always in the loop).
 //
-void bnrgm0_process(void) {
+void bnrgm0_process(bnrgm0_t ble) {
   uint8_t ret;
+  select_instance(ble);
   hci_user_evt_proc();
-  if (ble_state.is_connected == false) {
+  notify_drain(state);
+  // the link is idle: the stream bytes do not wait for a full notification
+  if (state->notify_count == 0) { stream_flush(); }
+  if (state->shadow_flush) {
+    // connected: the local-only values the peer reads directly
+    state->shadow_flush = 0;
+    for (ble_char_shadow_t *sh = state->shadows; sh != NULL; sh = sh->_next) {
+      if (!shadow_defers(sh->_charact)) { shadow_write(sh); }
+    }
+  }
+  while (state->n_read_permit > 0) {
+    // oldest request first: the value read by the peer, then the read goes
+    // on. The reads of the characteristics without a shadow are left to the
+    // application.
+    read_permit_t rp = state->read_permit[0];
+    state->n_read_permit--;
+    memmove(&state->read_permit[0], &state->read_permit[1], state->n_read_permit * sizeof(rp));
+    ble_char_shadow_t *sh = state->shadows;
+    while (sh != NULL && sh->_charact->_char_val_handle != rp.handle) { sh = sh->_next; }
+    if (sh == NULL) {
+      bnrgm0_onReadRequest(ble, rp.conn, rp.handle);
+      continue;
+    }
+    shadow_write(sh);
+    bnrgm0_allowRead(ble, rp.conn);
+  }
+  if (state->is_connected == false) {
     // If Bluenrg-M0 is in discoverable mode stopped and the user enabled connectable mode,
     // then set discoverable mode.
-    if (ble_state.discoverable_mode == DISCOVERABLE_MODE_STOPPED &&
-        ble_state.connectable_mode_enabled) {
+    if (state->discoverable_mode == DISCOVERABLE_MODE_STOPPED &&
+        state->connectable_mode_enabled) {
       // Put Peripheral device in discoverable mode
       // disable scan response
       hci_le_set_scan_resp_data(0, NULL);
       ret = aci_gap_set_discoverable(ADV_DATA_TYPE, ADV_INTERV_MIN, ADV_INTERV_MAX, PUBLIC_ADDR,
-                                     NO_WHITE_LIST_USE, ble_state.local_name_AD_len,
-                                     (const char *) ble_state.local_name_AD,
+                                     NO_WHITE_LIST_USE, state->local_name_AD_len,
+                                     (const char *) state->local_name_AD,
                                      0, NULL, 0x0, 0x0);
       if (ret != BLE_STATUS_SUCCESS) {
         DEBUG_PRINTF("aci_gap_set_discoverable() failed: 0x%x\r\n", ret);
       } else {
         DEBUG_PRINTF("discoverable mode started\n");
-        ble_state.discoverable_mode = DISCOVERABLE_MODE_STARTED;
+        state->discoverable_mode = DISCOVERABLE_MODE_STARTED;
       }
     }
     // If Bluenrg-M0 has started the discoverable mode and the user disabled connectable mode,
     // then set non discoverable mode.
-    if (ble_state.discoverable_mode == DISCOVERABLE_MODE_STARTED &&
-        !ble_state.connectable_mode_enabled) {
+    if (state->discoverable_mode == DISCOVERABLE_MODE_STARTED &&
+        !state->connectable_mode_enabled) {
       // Put Peripheral device in non-discoverable mode
       ret = aci_gap_set_non_discoverable();
       if (ret != BLE_STATUS_SUCCESS) {
         DEBUG_PRINTF("aci_gap_set_non_discoverable() failed: 0x%x\r\n", ret);
       } else {
         DEBUG_PRINTF("discoverable mode stopped\n");
-        ble_state.discoverable_mode = DISCOVERABLE_MODE_STOPPED;
+        state->discoverable_mode = DISCOVERABLE_MODE_STOPPED;
       }
     }
   } else {
     // Handle the connection and mtu exchanged
-    if ((ble_state.mtu_exchanged == 0) && (ble_state.mtu_exchanged_wait == 0)) {
-      ble_state.mtu_exchanged_wait = 1;
-      uint8_t ret                  = aci_gatt_exchange_configuration(ble_state.conn_handle);
+    if ((state->mtu_exchanged == 0) && (state->mtu_exchanged_wait == 0)) {
+      state->mtu_exchanged_wait = 1;
+      uint8_t ret                  = aci_gatt_exchange_configuration(state->conn_handle);
       if (ret != BLE_STATUS_SUCCESS) {
         DEBUG_PRINTF("aci_gatt_exchange_configuration() error: 0x%x\r\n", ret);
       }
@@ -357,11 +1082,39 @@ void bnrgm0_process(void) {
   }
 }
 
+// SPI clock selected by the calibration, 0 if not calibrated.
+//
+uint32_t bnrgm0_getSpiClock(bnrgm0_t ble) { return ble_state[ble].spi_clock; }
+
+// Returns the ATT_MTU of a connection, 0 if it is not the connection.
+//
+uint16_t bnrgm0_getAttMtu(bnrgm0_t ble, ble_conn_t conn) {
+  if (!ble_state[ble].is_connected || ble_state[ble].conn_handle != conn) { return 0; }
+  return ble_state[ble].att_mtu;
+}
+
 // Returns the connection handle if any, if not returns 0.
 //
-ble_conn_t bnrgm0_getConnHandle(void) {
-  if (!ble_state.is_connected) { return 0; }
-  return ble_state.conn_handle;
+ble_conn_t bnrgm0_getConnHandle(bnrgm0_t ble) {
+  if (!ble_state[ble].is_connected) { return 0; }
+  return ble_state[ble].conn_handle;
+}
+
+// BlueNRG of the last bnrgm0 call, the one whose events are handled.
+//
+bnrgm0_t bnrgm0_selected(void) { return (bnrgm0_t) (state - ble_state); }
+
+// Lets a read waiting for the application go on.
+//
+bool bnrgm0_allowRead(bnrgm0_t ble, ble_conn_t conn) {
+  select_instance(ble);
+  uint8_t ret = aci_gatt_allow_read(conn);
+  if (ret != BLE_STATUS_SUCCESS) {
+    setError(ret);
+    DEBUG_PRINTF("aci_gatt_allow_read() failed: 0x%x\r\n", ret);
+    return false;
+  }
+  return true;
 }
 
 // ===============================================================
@@ -371,6 +1124,9 @@ ble_conn_t bnrgm0_getConnHandle(void) {
 __weak void __bnrg_on_connect(ble_conn_t conn);
 __weak void __bnrg_on_disconnect(ble_conn_t conn);
 
+// Read of a characteristic without a shadow: allowed as it is.
+__weak void bnrgm0_onReadRequest(bnrgm0_t ble, ble_conn_t conn, uint16_t handle) { bnrgm0_allowRead(ble, conn); }
+
 // ===========================================================================
 //  ***** Handle BlueNRG event functions declared in bnrm0_evt_rx.h *****
 // ===========================================================================
@@ -378,8 +1134,10 @@ __weak void __bnrg_on_disconnect(ble_conn_t conn);
 // This function is called when there is a LE Connection Complete event.
 //
 void hci_le_connection_complete_event(uint8_t peer_addr[6], uint16_t conn_handle) {
-  ble_state.is_connected = true;
-  ble_state.conn_handle  = conn_handle;
+  state->is_connected = true;
+  state->conn_handle  = conn_handle;
+  state->att_mtu      = ATT_MTU;
+  state->shadow_flush = 1;
   __bnrg_on_connect(conn_handle);
 #ifdef BNRGM0_DEBUG
   DEBUG_PRINTF("Connection complete with peer address: ");
@@ -393,26 +1151,57 @@ void hci_le_connection_complete_event(uint8_t peer_addr[6], uint16_t conn_handle
 // This function is called when the peer device get disconnected.
 //
 void hci_disconnection_complete_event(uint8_t status, uint8_t conn_handle, uint8_t reason) {
-  ble_state.is_connected       = false;
-  ble_state.discoverable_mode  = DISCOVERABLE_MODE_STOPPED;
-  ble_state.conn_handle        = 0;
-  ble_state.mtu_exchanged      = 0;
-  ble_state.mtu_exchanged_wait = 0;
+  state->is_connected       = false;
+  state->discoverable_mode  = DISCOVERABLE_MODE_STOPPED;
+  state->conn_handle        = 0;
+  state->mtu_exchanged      = 0;
+  state->mtu_exchanged_wait = 0;
+  state->att_mtu            = ATT_MTU;
   __bnrg_on_disconnect(conn_handle);
   DEBUG_PRINTF("Disconnection with reason: 0x%x\r\n", reason);
 }
 
+// This event is generated when the controller has TX buffers again after an
+// update was refused for lack of them.
+//
+void aci_gatt_tx_pool_available_event(uint16_t conn_handle, uint16_t available_buffers) {
+  state->tx_pool_seq++;
+  state->is_tx_buffer_full = false;
+  notify_drain(state);
+}
+
+// This event is generated when the peer reads a characteristic added with
+// GATT_NOTIFY_READ_REQ_AND_WAIT_FOR_APPL_RESP: bnrgm0_process() writes its
+// deferred value and allows the read, or calls bnrgm0_onReadRequest().
+//
+void aci_gatt_read_permit_req_event(uint16_t conn_handle, uint16_t attr_handle, uint16_t offset) {
+  read_permit_t *rp = NULL;
+  for (uint8_t i = 0; i < state->n_read_permit; i++) {
+    if (state->read_permit[i].conn == conn_handle) { rp = &state->read_permit[i]; }
+  }
+  if (rp == NULL) {
+    if (state->n_read_permit == BNRGM0_READ_PERMIT_MAX) {
+      DEBUG_PRINTF("Read permit request dropped: conn 0x%x\r\n", conn_handle);
+      return;
+    }
+    rp = &state->read_permit[state->n_read_permit++];
+  }
+  rp->conn   = conn_handle;
+  rp->handle = attr_handle;
+}
+
 // This event is generated in response to an Exchange MTU request (local or from the peer).
 //
 void aci_att_exchange_mtu_resp_event(uint16_t conn_handle, uint16_t server_rx_mtu) {
-  // TODO handle the rx mtu
   DEBUG_PRINTF("aci_att_exchange_mtu_resp_event: Server_RX_MTU=%d\r\n", server_rx_mtu);
-  if ((ble_state.mtu_exchanged_wait == 0) || ((ble_state.mtu_exchanged_wait == 1))) {
+  // The exchange settles on the smaller of the two RX MTUs
+  state->att_mtu = (server_rx_mtu < BNRGM0_ATT_MTU_MAX) ? server_rx_mtu : BNRGM0_ATT_MTU_MAX;
+  if ((state->mtu_exchanged_wait == 0) || ((state->mtu_exchanged_wait == 1))) {
     // The aci_att_exchange_mtu_resp_event is received also if the
     // aci_gatt_exchange_config is called by the other peer.
     // Here we manage this case.
-    if (ble_state.mtu_exchanged_wait == 0) { ble_state.mtu_exchanged_wait = 2; }
-    ble_state.mtu_exchanged = 1;
+    if (state->mtu_exchanged_wait == 0) { state->mtu_exchanged_wait = 2; }
+    state->mtu_exchanged = 1;
   }
 }
 
@@ -420,6 +1209,23 @@ void aci_att_exchange_mtu_resp_event(uint16_t conn_handle, uint16_t server_rx_mt
 // EXTI IRQ Handler Function
 // ===============================================================
 
-void bnrgm0_exti_irq_handler(void) {
+// The handlers may interrupt a call on another BlueNRG: its HCI instance is
+// selected again on return.
+
+void bnrgm0_exti_irq_handler(bnrgm0_t ble) {
+  uint8_t prev = hci_select(ble);
+  hci_tl_lowlevel_isr();
+  hci_select(prev);
+}
+
+void bnrgm0_spi_dma_irq_handler(bnrgm0_t ble) {
+  uint8_t prev = hci_select(ble);
+  hci_tl_lowlevel_dma_isr();
+  hci_select(prev);
+}
+
+void bnrgm0_uart_irq_handler(bnrgm0_t ble) {
+  uint8_t prev = hci_select(ble);
   hci_tl_lowlevel_isr();
+  hci_select(prev);
 }
\ No newline at end of file
@@ -15,6 +15,8 @@ __weak void hci_disconnection_complete_event(uint8_t status, uint8_t conn_handle
 __weak void aci_gatt_attribute_modified_event(uint16_t conn_handle, uint16_t attr_handle, uint8_t data_length, uint8_t *attr_data);
 __weak void aci_gatt_notification_event(uint16_t conn_handle, uint16_t attr_handle, uint8_t attr_len, uint8_t *attr_value);
 __weak void aci_att_exchange_mtu_resp_event(uint16_t conn_handle, uint16_t server_rx_mtu);
+__weak void aci_gatt_tx_pool_available_event(uint16_t conn_handle, uint16_t available_buffers);
+__weak void aci_gatt_read_permit_req_event(uint16_t conn_handle, uint16_t attr_handle, uint16_t offset);
 
 // ===============================================================
 // Main event
@@ -62,6 +64,14 @@ void bnrgm0_event_rx(void *pData) {
           evt_att_exchange_mtu_resp *evt = (evt_att_exchange_mtu_resp *) blue_evt->data;
           aci_att_exchange_mtu_resp_event(evt->conn_handle, evt->server_rx_mtu);
         } break;
+        case EVT_BLUE_GATT_TX_POOL_AVAILABLE: {
+          evt_gatt_tx_pool_available *evt = (evt_gatt_tx_pool_available *) blue_evt->data;
+          aci_gatt_tx_pool_available_event(evt->conn_handle, evt->available_buffers);
+        } break;
+        case EVT_BLUE_GATT_READ_PERMIT_REQ: {
+          evt_gatt_read_permit_req *evt = (evt_gatt_read_permit_req *) blue_evt->data;
+          aci_gatt_read_permit_req_event(evt->conn_handle, evt->attr_handle, evt->offset);
+        } break;
       }
       break;
     }
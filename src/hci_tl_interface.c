@@ -1,42 +1,111 @@
 #include "hci_tl.h"
 
 // ===============================================================
-// Private structure
+// Definitions
 // ===============================================================
 
-static bnrgm0_hw_t ble_hw;
+#define HEADER_SIZE      5U
+#define MAX_BUFFER_SIZE  255U
+
+// Shorter transfers are polled: the DMA setup costs more than the bytes
+#define DMA_MIN_LEN 16U
+
+// Longest wait of a DMA write: a whole segment takes 2 ms at 1 MHz. The
+// EXTI line stays masked and CS low meanwhile.
+#define DMA_TX_TIMEOUT_MS 5U
+
+typedef enum {
+  DMA_IDLE = 0,
+  DMA_RX, // payload read in progress, CS low, completed by hci_tl_lowlevel_dma_isr()
+  DMA_TX, // segment write in progress, waited by HCI_TL_SPI_SendV()
+} dma_state_t;
 
 // ===============================================================
-// Definitions
+// Private structure
 // ===============================================================
 
-#define HEADER_SIZE      5U
-#define MAX_BUFFER_SIZE  255U
-#define TIMEOUT_DURATION 15U
+// One per BlueNRG, see hci_select()
+typedef struct {
+  bnrgm0_hw_t ble_hw;
+  volatile uint8_t dma_state;
+  uint16_t dma_len;
+  // A write owns the bus: the reads chained from the DMA interrupt wait for it
+  volatile uint8_t tx_busy;
+  volatile uint8_t rx_deferred;
+  // Bottom half mode (rx_budget_pkts > 0): packets flagged by the ISR
+  volatile uint8_t rx_pending;
+  // Nesting of HCI_TL_Disable_IRQ(): the reads done by
+  // hci_tl_lowlevel_resume() must not enable the IRQs back.
+  volatile uint8_t irq_disable_nesting;
+} tl_state_t;
+
+static tl_state_t tl_state[HCI_NUM_INSTANCES];
+static tl_state_t *tl = &tl_state[0];
+
+// Shared by the instances: nothing is kept from the dummy reads
+static uint8_t dma_rx_dummy[MAX_BUFFER_SIZE];
+// Transmit source of the reads: the BlueNRG expects 0xFF while it sends
+static uint8_t spi_tx_ff[MAX_BUFFER_SIZE];
 
 // ===============================================================
 // Privates
 // ===============================================================
 
-// Enable SPI IRQ.
-static void HCI_TL_SPI_Enable_IRQ(void) { NVIC_EnableIRQ(ble_hw.exti_irqn); }
+// Enable the IRQs reading the BlueNRG: the EXTI line, or with the H4
+// transport the UART idle line and the receive DMA ones. The SPI DMA interrupt
+// enables them too, so the nesting count changes with all the interrupts masked.
+static void HCI_TL_Enable_IRQ(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (--tl->irq_disable_nesting == 0) {
+    if (tl->ble_hw.uart != NULL) { NVIC_EnableIRQ(tl->ble_hw.uart->dma_irqn); }
+    NVIC_EnableIRQ(tl->ble_hw.exti_irqn);
+  }
+  __set_PRIMASK(primask);
+}
 
-// Disable SPI IRQ.
-static void HCI_TL_SPI_Disable_IRQ(void) { NVIC_DisableIRQ(ble_hw.exti_irqn); }
+// Disable the IRQs reading the BlueNRG.
+static void HCI_TL_Disable_IRQ(void) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (tl->irq_disable_nesting++ == 0) {
+    NVIC_DisableIRQ(tl->ble_hw.exti_irqn);
+    if (tl->ble_hw.uart != NULL) { NVIC_DisableIRQ(tl->ble_hw.uart->dma_irqn); }
+  }
+  __set_PRIMASK(primask);
+}
 
 // Reports if the BlueNRG has data for the host micro (1 if data are present, 0 otherwise).
-static int32_t IsDataAvailable(void) { return gpio_read(ble_hw.exti_irq_pin); }
+static int32_t IsDataAvailable(void) {
+  if (tl->ble_hw.uart != NULL) { return hci_tl_uart_data_available(); }
+  return gpio_read(tl->ble_hw.exti_irq_pin);
+}
 
 // ===============================================================
 // EON Bridge
 // ===============================================================
 
+void hci_tl_lowlevel_select(uint8_t id) {
+  tl = &tl_state[id];
+  hci_tl_uart_select(id);
+}
+
 void hci_eon_brige(const bnrgm0_hw_t *hw) {
-  ble_hw.SPIx         = hw->SPIx;
-  ble_hw.cs_pin       = hw->cs_pin;
-  ble_hw.rst_pin      = hw->rst_pin;
-  ble_hw.exti_irq_pin = hw->exti_irq_pin;
-  ble_hw.exti_irqn    = hw->exti_irqn;
+  tl->ble_hw.SPIx           = hw->SPIx;
+  tl->ble_hw.cs_pin         = hw->cs_pin;
+  tl->ble_hw.rst_pin        = hw->rst_pin;
+  tl->ble_hw.exti_irq_pin   = hw->exti_irq_pin;
+  tl->ble_hw.exti_irqn      = hw->exti_irqn;
+  tl->ble_hw.spi_dma        = hw->spi_dma;
+  tl->ble_hw.spi_dma_abort  = hw->spi_dma_abort;
+  tl->ble_hw.rx_budget_pkts = hw->rx_budget_pkts;
+  tl->ble_hw.rx_budget_us   = hw->rx_budget_us;
+  tl->ble_hw.uart           = hw->uart;
+  tl->rx_pending            = 0;
+  if (hw->uart != NULL) { hci_tl_uart_bridge(hw); }
+
+  tl->dma_state = DMA_IDLE;
+  memset(spi_tx_ff, 0xff, sizeof(spi_tx_ff));
 }
 
 // ===============================================================
@@ -53,13 +122,13 @@ void hci_eon_brige(const bnrgm0_hw_t *hw) {
 int32_t HCI_TL_SPI_Init(void *pConf) {
 
   // Configure RESET Line
-  gpio_mode(ble_hw.rst_pin, OUTPUT_PP, NOPULL, SPEED_LOW);
+  gpio_mode(tl->ble_hw.rst_pin, OUTPUT_PP, NOPULL, SPEED_LOW);
 
   // Configure CS
-  gpio_mode(ble_hw.cs_pin, OUTPUT_PP, NOPULL, SPEED_LOW);
+  gpio_mode(tl->ble_hw.cs_pin, OUTPUT_PP, NOPULL, SPEED_LOW);
 
   // Deselect CS PIN for BlueNRG at startup to avoid spurious commands
-  gpio_set(ble_hw.cs_pin);
+  gpio_set(tl->ble_hw.cs_pin);
 
   return 0;
 }
@@ -72,10 +141,10 @@ int32_t HCI_TL_SPI_Init(void *pConf) {
  * @retval int32_t 0
  */
 int32_t HCI_TL_SPI_DeInit(void) {
-  exti_detach(ble_hw.exti_irq_pin);
-  gpio_mode(ble_hw.exti_irq_pin, ANALOG, NOPULL, SPEED_LOW);
-  gpio_mode(ble_hw.cs_pin, ANALOG, NOPULL, SPEED_LOW);
-  gpio_mode(ble_hw.rst_pin, ANALOG, NOPULL, SPEED_LOW);
+  exti_detach(tl->ble_hw.exti_irq_pin);
+  gpio_mode(tl->ble_hw.exti_irq_pin, ANALOG, NOPULL, SPEED_LOW);
+  gpio_mode(tl->ble_hw.cs_pin, ANALOG, NOPULL, SPEED_LOW);
+  gpio_mode(tl->ble_hw.rst_pin, ANALOG, NOPULL, SPEED_LOW);
   return 0;
 }
 
@@ -87,118 +156,220 @@ int32_t HCI_TL_SPI_DeInit(void) {
  */
 int32_t HCI_TL_SPI_Reset(void) {
   // Deselect CS PIN for BlueNRG to avoid spurious commands
-  gpio_set(ble_hw.cs_pin);
+  gpio_set(tl->ble_hw.cs_pin);
 
-  gpio_reset(ble_hw.rst_pin);
+  gpio_reset(tl->ble_hw.rst_pin);
   delay(5);
-  gpio_set(ble_hw.rst_pin);
+  gpio_set(tl->ble_hw.rst_pin);
   delay(5);
   return 0;
 }
 
-/**
- * @brief  Reads from BlueNRG SPI buffer and store data into local buffer.
- *
- * @param  buffer : Buffer where data from SPI are stored
- * @param  size   : Buffer size
- * @retval int32_t: Number of read bytes
- */
-int32_t HCI_TL_SPI_Receive(uint8_t *buffer, uint16_t size) {
+// Reads a packet from the BlueNRG SPI buffer. The destination is either the
+// given buffer or, when alloc is set, the buffer it returns for the length
+// found in the SPI header.
+static int32_t HCI_TL_SPI_Read(uint8_t *buffer, uint16_t size, uint8_t *(*alloc)(uint16_t *size)) {
   uint16_t byte_count;
-  uint8_t len     = 0;
-  uint8_t char_ff = 0xff;
-  volatile uint8_t read_char;
+  uint8_t len = 0;
 
   uint8_t header_master[HEADER_SIZE] = {0x0b, 0x00, 0x00, 0x00, 0x00};
   uint8_t header_slave[HEADER_SIZE];
 
-  HCI_TL_SPI_Disable_IRQ();
+  HCI_TL_Disable_IRQ();
 
   // CS reset
-  gpio_reset(ble_hw.cs_pin);
+  gpio_reset(tl->ble_hw.cs_pin);
 
   // Read the header
-  spi_writeMultiple8(ble_hw.SPIx, header_master, header_slave, HEADER_SIZE);
+  spi_writeMultiple8(tl->ble_hw.SPIx, header_master, header_slave, HEADER_SIZE);
 
   if (header_slave[0] == 0x02) {
     /* device is ready */
     byte_count = (header_slave[4] << 8) | header_slave[3];
 
+    if (byte_count > 0 && alloc != NULL) {
+      /* no buffer: the packet stays in the BlueNRG until the next read */
+      size   = byte_count;
+      buffer = alloc(&size);
+      if (buffer == NULL) {
+        byte_count = 0;
+      }
+    }
+
     if (byte_count > 0) {
       /* avoid to read more data than the size of the buffer */
       if (byte_count > size) {
         byte_count = size;
       }
+      if (byte_count > MAX_BUFFER_SIZE) {
+        byte_count = MAX_BUFFER_SIZE;
+      }
 
-      for (len = 0; len < byte_count; len++) {
-        read_char   = spi_write8(ble_hw.SPIx, char_ff);
-        buffer[len] = read_char;
+      /* the payload is read in the background: CS and IRQ are released
+         by hci_tl_lowlevel_dma_isr() */
+      if (alloc != NULL && tl->ble_hw.spi_dma != NULL && byte_count >= DMA_MIN_LEN) {
+        tl->dma_len   = byte_count;
+        tl->dma_state = DMA_RX;
+        if (tl->ble_hw.spi_dma(tl->ble_hw.SPIx, spi_tx_ff, buffer, byte_count)) {
+          return HCI_IO_PENDING;
+        }
+        tl->dma_state = DMA_IDLE;
       }
+
+      /* payload clocked in with the header in the same CS low transaction */
+      spi_writeMultiple8(tl->ble_hw.SPIx, spi_tx_ff, buffer, byte_count);
+      len = (uint8_t) byte_count;
     }
   }
 
   // Release CS line
-  gpio_set(ble_hw.cs_pin);
+  gpio_set(tl->ble_hw.cs_pin);
 
-  HCI_TL_SPI_Enable_IRQ();
+  HCI_TL_Enable_IRQ();
 
   return len;
 }
 
 /**
- * @brief  Writes data from local buffer to SPI.
+ * @brief  Reads from BlueNRG SPI buffer and store data into local buffer.
  *
- * @param  buffer : data buffer to be written
- * @param  size   : size of first data buffer to be written
+ * @param  buffer : Buffer where data from SPI are stored
+ * @param  size   : Buffer size
  * @retval int32_t: Number of read bytes
  */
-int32_t HCI_TL_SPI_Send(uint8_t *buffer, uint16_t size) {
-  int32_t result;
+int32_t HCI_TL_SPI_Receive(uint8_t *buffer, uint16_t size) {
+  return HCI_TL_SPI_Read(buffer, size, NULL);
+}
+
+/**
+ * @brief  Reads from BlueNRG SPI buffer into a buffer sized from the SPI header.
+ *
+ * @param  alloc  : Returns a buffer for the packet length (NULL if none)
+ * @retval int32_t: Number of read bytes
+ */
+int32_t HCI_TL_SPI_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size)) {
+  return HCI_TL_SPI_Read(NULL, 0, alloc);
+}
+
+// Number of segments holding the whole packets that fit in space bytes, and
+// their size. The last segment ends a packet even without eop.
+static uint8_t fit_packets(const tHciIOVec *iov, uint8_t iovcnt, uint16_t space, uint16_t *size) {
+  uint16_t len  = 0;
+  uint8_t count = 0;
+
+  *size = 0;
+  for (uint8_t i = 0; i < iovcnt; i++) {
+    len += iov[i].len;
+    if (iov[i].eop || i == iovcnt - 1) {
+      if (len > space) { break; }
+      count = i + 1;
+      *size = len;
+    }
+  }
+  return count;
+}
+
+/**
+ * @brief  Writes packets made of one or more segments to SPI, in one CS low
+ *         transaction: the whole packets fitting in the write buffer space
+ *         reported by the header go out back to back. A single attempt: if
+ *         the BlueNRG cannot take the first one now, hci_tl parks them and
+ *         calls again later.
+ *
+ * @param  iov    : segments to be written, eop set on the last one of each packet
+ * @param  iovcnt : number of segments
+ * @retval int32_t: number of segments written (whole packets), HCI_IO_BUSY if the BlueNRG
+ *                  is not ready, -1 if a DMA write did not complete before any packet
+ */
+int32_t HCI_TL_SPI_SendV(const tHciIOVec *iov, uint8_t iovcnt) {
+  int32_t result = HCI_IO_BUSY;
+  uint16_t size  = 0;
+  uint16_t len   = 0;
 
   uint8_t header_master[HEADER_SIZE] = {0x0a, 0x00, 0x00, 0x00, 0x00};
   uint8_t header_slave[HEADER_SIZE];
 
   static uint8_t read_char_buf[MAX_BUFFER_SIZE];
-  uint32_t tickstart = millis();
 
-  HCI_TL_SPI_Disable_IRQ();
-
-  do {
-    result = 0;
+  HCI_TL_Disable_IRQ();
 
+  // A background read owns the bus: the packets go out after it
+  tl->tx_busy = 1;
+  if (tl->dma_state != DMA_IDLE) {
+    hci_notify_tx_space(0);
+  } else {
     // CS reset
-    gpio_reset(ble_hw.cs_pin);
+    gpio_reset(tl->ble_hw.cs_pin);
 
     // Read header
-    spi_writeMultiple8(ble_hw.SPIx, header_master, header_slave, HEADER_SIZE);
-
-    if (header_slave[0] == 0x02) {
-      // SPI is ready
-      if (header_slave[1] >= size) {
-        spi_writeMultiple8(ble_hw.SPIx, buffer, read_char_buf, size);
-      } else {
-        // Buffer is too small
-        result = -2;
+    spi_writeMultiple8(tl->ble_hw.SPIx, header_master, header_slave, HEADER_SIZE);
+
+    // TX credit: free space of the BlueNRG write buffer
+    uint16_t space = (header_slave[0] == 0x02) ? header_slave[1] : 0;
+    uint8_t count  = fit_packets(iov, iovcnt, space, &size);
+
+    // Nothing is written if the SPI is not ready or the first packet does not fit
+    if (count > 0) { result = count; }
+    for (uint8_t i = 0; i < count; i++) {
+      if (tl->ble_hw.spi_dma != NULL && iov[i].len >= DMA_MIN_LEN) {
+        tl->dma_state = DMA_TX;
+        if (tl->ble_hw.spi_dma(tl->ble_hw.SPIx, iov[i].data, dma_rx_dummy, iov[i].len)) {
+          // the core sleeps until the transfer complete interrupt, bounded
+          // by DMA_TX_TIMEOUT_MS
+          uint32_t tickstart = millis();
+          while (tl->dma_state == DMA_TX && (millis() - tickstart) <= DMA_TX_TIMEOUT_MS) { __WFI(); }
+          if (tl->dma_state != DMA_IDLE) {
+            // no transfer complete interrupt: the packet of this segment is
+            // lost, the whole packets before it went out. The bytes the DMA
+            // clocked out are unknown, the whole segment is counted.
+            if (tl->ble_hw.spi_dma_abort != NULL) { tl->ble_hw.spi_dma_abort(tl->ble_hw.SPIx); }
+            tl->dma_state = DMA_IDLE;
+            size   = len + iov[i].len;
+            result = -1;
+            for (uint8_t j = 0; j < i; j++) {
+              if (iov[j].eop) { result = j + 1; }
+            }
+            break;
+          }
+          len += iov[i].len;
+          continue;
+        }
+        tl->dma_state = DMA_IDLE;
       }
-    } else {
-      // SPI is not ready
-      result = -1;
+      spi_writeMultiple8(tl->ble_hw.SPIx, (uint8_t *) iov[i].data, read_char_buf, iov[i].len);
+      len += iov[i].len;
     }
 
     // Release CS line
-    gpio_set(ble_hw.cs_pin);
+    gpio_set(tl->ble_hw.cs_pin);
+    hci_notify_tx_space(space - size);
+  }
 
-    if ((millis() - tickstart) > TIMEOUT_DURATION) {
-      result = -3;
-      break;
-    }
-  } while (result < 0);
+  tl->tx_busy = 0;
+  if (tl->rx_deferred) {
+    // the IRQ line was high at the end of the background read
+    tl->rx_deferred = 0;
+    hci_tl_lowlevel_isr();
+  }
 
-  HCI_TL_SPI_Enable_IRQ();
+  HCI_TL_Enable_IRQ();
 
   return result;
 }
 
+/**
+ * @brief  Writes data from local buffer to SPI.
+ *
+ * @param  buffer : data buffer to be written
+ * @param  size   : size of first data buffer to be written
+ * @retval int32_t: 0 if success, HCI_IO_BUSY if the BlueNRG is not ready, -1 on error
+ */
+int32_t HCI_TL_SPI_Send(uint8_t *buffer, uint16_t size) {
+  tHciIOVec iov = {buffer, size, 1};
+  int32_t ret   = HCI_TL_SPI_SendV(&iov, 1);
+  return (ret > 0) ? 0 : ret;
+}
+
 /**
  * @brief  Return the current milliseconds of the system.
  *
@@ -221,22 +392,99 @@ void hci_tl_lowlevel_init(void) {
   fops.Init    = HCI_TL_SPI_Init;
   fops.DeInit  = HCI_TL_SPI_DeInit;
   fops.Send    = HCI_TL_SPI_Send;
+  fops.SendV   = HCI_TL_SPI_SendV;
   fops.Receive = HCI_TL_SPI_Receive;
+  fops.ReceiveAlloc = HCI_TL_SPI_ReceiveAlloc;
   fops.Reset   = HCI_TL_SPI_Reset;
   fops.GetTick = HCI_TL_GetTick;
 
+  if (tl->ble_hw.uart != NULL) {
+    fops.Init    = HCI_TL_UART_Init;
+    fops.DeInit  = HCI_TL_UART_DeInit;
+    fops.Send    = HCI_TL_UART_Send;
+    fops.SendV   = HCI_TL_UART_SendV;
+    fops.Receive = HCI_TL_UART_Receive;
+    fops.ReceiveAlloc = HCI_TL_UART_ReceiveAlloc;
+    fops.Reset   = HCI_TL_UART_Reset;
+  }
+
   hci_register_io_bus(&fops);
 
-  // Initialize event irq
-  exti_attach(ble_hw.exti_irq_pin, NOPULL, MODE_CHANGE);
+  // Initialize event irq: the UART one is enabled by the application
+  if (tl->ble_hw.uart == NULL) { exti_attach(tl->ble_hw.exti_irq_pin, NOPULL, MODE_CHANGE); }
 }
 
 // HCI Transport Layer Low Level Interrupt Service Routine
 void hci_tl_lowlevel_isr(void) {
+  // the receive DMA half and full transfer IRQs account its progress even
+  // when the reads are deferred
+  if (tl->ble_hw.uart != NULL) { hci_tl_uart_irq(); }
+  if (tl->ble_hw.rx_budget_pkts != 0) {
+    // Left to hci_tl_lowlevel_bottom_half(), wake up a command waiting for it
+    tl->rx_pending = 1;
+    hci_cmd_resp_release(1);
+    return;
+  }
+  if (tl->tx_busy) {
+    tl->rx_deferred = 1;
+    return;
+  }
   // Call hci_notify_asynch_evt()
-  while (IsDataAvailable()) {
+  while (tl->dma_state == DMA_IDLE && IsDataAvailable()) {
     if (hci_notify_asynch_evt(NULL)) {
       return;
     }
   }
-}
\ No newline at end of file
+}
+
+// Bottom half of the ISR: read at most rx_budget_pkts packets or for
+// rx_budget_us, with the IRQs masked like hci_tl_lowlevel_resume(). Returns 1
+// if packets are left for the next call.
+int32_t hci_tl_lowlevel_bottom_half(void) {
+  if (!tl->rx_pending || tl->tx_busy) { return tl->rx_pending; }
+  tl->rx_pending = 0;
+
+  uint32_t start = micros();
+  uint8_t count  = 0;
+  HCI_TL_Disable_IRQ();
+  while (tl->dma_state == DMA_IDLE && IsDataAvailable()) {
+    if (count == tl->ble_hw.rx_budget_pkts ||
+        (tl->ble_hw.rx_budget_us != 0 && (micros() - start) >= tl->ble_hw.rx_budget_us)) {
+      tl->rx_pending = 1;
+      break;
+    }
+    count++;
+    if (hci_notify_asynch_evt(NULL)) { break; }
+  }
+  HCI_TL_Enable_IRQ();
+  return tl->rx_pending;
+}
+
+// Read the packets left in the BlueNRG while the read flow was paused. The
+// IRQ line stayed high, so no edge will come: run the ISR from the caller
+// context with the IRQs masked (the UART ones too, they read the same receive
+// buffer). An edge in the meantime stays pending and is served when the IRQs
+// are enabled back.
+void hci_tl_lowlevel_resume(void) {
+  HCI_TL_Disable_IRQ();
+  hci_tl_lowlevel_isr();
+  HCI_TL_Enable_IRQ();
+}
+
+// SPI DMA transfer complete Interrupt Service Routine
+void hci_tl_lowlevel_dma_isr(void) {
+  if (tl->dma_state == DMA_TX) {
+    tl->dma_state = DMA_IDLE;
+    return;
+  }
+  if (tl->dma_state != DMA_RX) { return; }
+
+  // Release CS line
+  gpio_set(tl->ble_hw.cs_pin);
+  tl->dma_state = DMA_IDLE;
+  hci_notify_rx_complete(tl->dma_len);
+
+  // Read the next packets, then let the IRQ line in again
+  hci_tl_lowlevel_isr();
+  HCI_TL_Enable_IRQ();
+}
@@ -0,0 +1,231 @@
+#include "hci_tl.h"
+#include "hci_const.h"
+
+// ===============================================================
+// Private structure
+// ===============================================================
+
+// One per BlueNRG, see hci_select()
+typedef struct {
+  const bnrgm0_uart_t *uart;
+  pin_t rst_pin;
+  // Read position in the receive DMA buffer
+  uint16_t rx_rd;
+  // DMA position at the last rx_sync(), and the bytes written since rx_rd
+  uint16_t rx_wr;
+  uint32_t rx_unread;
+  hci_tl_uart_stats_t stats;
+} uart_state_t;
+
+static uart_state_t uart_state[HCI_NUM_INSTANCES];
+static uart_state_t *u = &uart_state[0];
+
+// ===============================================================
+// Definitions
+// ===============================================================
+
+#define EVT_HEADER_SIZE (HCI_HDR_SIZE + HCI_EVENT_HDR_SIZE)
+#define EVT_MAX_PLEN    (HCI_READ_PACKET_SIZE - EVT_HEADER_SIZE)
+
+// ===============================================================
+// Privates
+// ===============================================================
+
+static uint8_t rx_byte(uint16_t offset) { return u->uart->rx_buf[(u->rx_rd + offset) % u->uart->rx_size]; }
+
+// Restarts the reads at the DMA position.
+static void rx_reset(void) {
+  u->rx_rd     = u->uart->rx_pos();
+  u->rx_wr     = u->rx_rd;
+  u->rx_unread = 0;
+}
+
+// Accounts the bytes the receive DMA wrote since the previous call. The DMA
+// half and full transfer interrupts call it at least every half buffer, so
+// the DMA moved by less than rx_size meanwhile: more unread bytes than
+// rx_size means it lapped rx_rd and overwrote them. They are dropped, the
+// framing then resyncs on the next header.
+static void rx_sync(void) {
+  uint16_t pos = u->uart->rx_pos();
+  u->rx_unread += (uint16_t) ((pos + u->uart->rx_size - u->rx_wr) % u->uart->rx_size);
+  u->rx_wr = pos;
+  if (u->rx_unread >= u->uart->rx_size) {
+    u->stats.overruns++;
+    u->stats.skipped_bytes += u->rx_unread;
+    u->rx_rd     = pos;
+    u->rx_unread = 0;
+  }
+}
+
+// Bytes written by the receive DMA and not read yet.
+static uint16_t rx_count(void) {
+  rx_sync();
+  return (uint16_t) u->rx_unread;
+}
+
+// Moves rx_rd over len bytes read or skipped.
+static void rx_skip(uint16_t len) {
+  u->rx_rd = (u->rx_rd + len) % u->uart->rx_size;
+  u->rx_unread -= len;
+}
+
+// An H4 event header as the BlueNRG sends them: HCI_EVENT_PKT, an event code
+// of the Bluetooth range or the vendor one, and a length the host can read.
+static bool rx_header_valid(void) {
+  uint8_t evt = rx_byte(1);
+  return rx_byte(0) == HCI_EVENT_PKT && evt != 0x00 && (evt < 0x40 || evt == 0xFF) &&
+         rx_byte(2) <= EVT_MAX_PLEN;
+}
+
+// Length of the packet at rx_rd once it is complete, 0 otherwise. Bytes that
+// cannot start a packet (line noise, the rest of a packet overwritten by the
+// DMA) are skipped up to the next valid header.
+static uint16_t rx_frame(void) {
+  uint16_t count = rx_count();
+  bool skipped   = false;
+
+  // a partial header is only checked for its packet type
+  while (count > 0 && ((count >= EVT_HEADER_SIZE) ? !rx_header_valid() : rx_byte(0) != HCI_EVENT_PKT)) {
+    rx_skip(1);
+    count--;
+    u->stats.skipped_bytes++;
+    skipped = true;
+  }
+  if (skipped) { u->stats.resyncs++; }
+
+  if (count < EVT_HEADER_SIZE) { return 0; }
+  uint16_t len = EVT_HEADER_SIZE + rx_byte(2);
+  return (count >= len) ? len : 0;
+}
+
+// Copies the packet out of the receive DMA buffer, like HCI_TL_SPI_Read(): the
+// destination is either the given buffer or the one alloc returns for the length.
+static int32_t HCI_TL_UART_Read(uint8_t *buffer, uint16_t size, uint8_t *(*alloc)(uint16_t *size)) {
+  uint16_t len = rx_frame();
+  if (len == 0) { return 0; }
+
+  if (alloc != NULL) {
+    // no buffer: the packet stays in the receive buffer until the next read
+    size   = len;
+    buffer = alloc(&size);
+    if (buffer == NULL) { return 0; }
+  }
+  uint16_t copy  = (len > size) ? size : len;
+  uint16_t first = u->uart->rx_size - u->rx_rd;
+  if (first > copy) { first = copy; }
+  memcpy(buffer, &u->uart->rx_buf[u->rx_rd], first);
+  memcpy(&buffer[first], u->uart->rx_buf, copy - first);
+
+  rx_skip(len);
+  return copy;
+}
+
+// ===============================================================
+// EON Bridge
+// ===============================================================
+
+void hci_tl_uart_select(uint8_t id) { u = &uart_state[id]; }
+
+void hci_tl_uart_bridge(const bnrgm0_hw_t *hw) {
+  u->uart    = hw->uart;
+  u->rst_pin = hw->rst_pin;
+  memset(&u->stats, 0, sizeof(u->stats));
+}
+
+// ===============================================================
+// IO Operation and BUS services
+// ===============================================================
+
+/**
+ * @brief  Initializes the H4 UART transport: the bytes already in the receive
+ *         buffer are discarded.
+ *
+ * @param  void* Pointer to configuration struct
+ * @retval int32_t Status
+ */
+int32_t HCI_TL_UART_Init(void *pConf) {
+  // Configure RESET Line
+  gpio_mode(u->rst_pin, OUTPUT_PP, NOPULL, SPEED_LOW);
+
+  rx_reset();
+  return 0;
+}
+
+/**
+ * @brief  DeInitializes the H4 UART transport.
+ *
+ * @param  None
+ * @retval int32_t 0
+ */
+int32_t HCI_TL_UART_DeInit(void) {
+  gpio_mode(u->rst_pin, ANALOG, NOPULL, SPEED_LOW);
+  return 0;
+}
+
+/**
+ * @brief  Reset BlueNRG module, then drop what it sent before.
+ *
+ * @param  None
+ * @retval int32_t 0
+ */
+int32_t HCI_TL_UART_Reset(void) {
+  gpio_reset(u->rst_pin);
+  delay(5);
+  gpio_set(u->rst_pin);
+  delay(5);
+  rx_reset();
+  return 0;
+}
+
+/**
+ * @brief  Reads the next complete H4 event from the receive DMA buffer.
+ *
+ * @param  buffer : Buffer where the event is stored
+ * @param  size   : Buffer size
+ * @retval int32_t: Number of read bytes, 0 if no event is complete yet
+ */
+int32_t HCI_TL_UART_Receive(uint8_t *buffer, uint16_t size) { return HCI_TL_UART_Read(buffer, size, NULL); }
+
+/**
+ * @brief  Reads the next complete H4 event into a buffer sized from its header.
+ *
+ * @param  alloc  : Returns a buffer for the packet length (NULL if none)
+ * @retval int32_t: Number of read bytes
+ */
+int32_t HCI_TL_UART_ReceiveAlloc(uint8_t *(*alloc)(uint16_t *size)) { return HCI_TL_UART_Read(NULL, 0, alloc); }
+
+/**
+ * @brief  Writes an H4 packet: the packet type byte starts the HCI packet.
+ *
+ * @param  buffer : data buffer to be written
+ * @param  size   : size of first data buffer to be written
+ * @retval int32_t: 0 if success, < 0 on error
+ */
+int32_t HCI_TL_UART_Send(uint8_t *buffer, uint16_t size) { return (u->uart->write(buffer, size) == size) ? 0 : -1; }
+
+/**
+ * @brief  Writes packets made of one or more segments. There is no write
+ *         buffer to fill on the UART: every segment goes out.
+ *
+ * @param  iov    : segments to be written
+ * @param  iovcnt : number of segments
+ * @retval int32_t: number of segments written, < 0 on error
+ */
+int32_t HCI_TL_UART_SendV(const tHciIOVec *iov, uint8_t iovcnt) {
+  for (uint8_t i = 0; i < iovcnt; i++) {
+    if (u->uart->write(iov[i].data, iov[i].len) != iov[i].len) { return -1; }
+  }
+  return iovcnt;
+}
+
+// ===============================================================
+// hci_tl_interface functions
+// ===============================================================
+
+// A complete event waits in the receive buffer.
+int32_t hci_tl_uart_data_available(void) { return rx_frame() != 0; }
+
+// Called by hci_tl_lowlevel_isr(), before the events are read.
+void hci_tl_uart_irq(void) { rx_sync(); }
+
+void hci_tl_uart_getStats(hci_tl_uart_stats_t *out) { *out = u->stats; }
@@ -31,8 +31,37 @@ extern "C" {
 
 /*---------- Number of Bytes reserved for HCI Read Packet -----------*/
 #define HCI_READ_PACKET_SIZE      128
+/*---------- Number of Bytes reserved for HCI Small Read Packet (short events: command complete, disconnection, ...) -----------*/
+#define HCI_READ_PACKET_SMALL_SIZE      32
+/*---------- HCI capture ring (hci_snoop_dump()): number of packets kept, undefined = no capture -----------*/
+/* #define HCI_SNOOP_RING_SIZE      64 */
+/*---------- Number of BlueNRG instances (bnrgm0_t, hci_select()), each on its own SPI bus -----------*/
+/* #define HCI_NUM_INSTANCES      2 */
+/*---------- Check of the single task use of the HCI instances (hci_select()), undefined = no check -----------*/
+/* #define HCI_ASSERT(expr)      assert_param(expr) */
 /*---------- Number of Bytes reserved for HCI Max Payload -----------*/
 #define HCI_MAX_PAYLOAD_SIZE      128
+/*---------- Bytes of the events parked by hci_send_req() behind a flood of events, default: the largest event (132) -----------*/
+/* #define HCI_EVT_PARK_SIZE      1024 */
+/*---------- Commands parked while the BlueNRG is busy, default 1 -----------*/
+/* #define HCI_TX_QUEUE_LEN      4 */
+/*---------- Asynchronous requests in flight (hci_send_req_async(), bnrgm0_updateCharValues() pipelining), default and minimum 2 -----------*/
+/* #define HCI_ASYNC_REQ_NUM_MAX      4 */
+/*
+ * RAM per BlueNRG instance (HCI_NUM_INSTANCES), with the sizes above on a 32-bit MCU:
+ *   hci_tl, about 1.9 KB with the defaults:
+ *     read packets           4 x (HCI_READ_PACKET_SIZE + 16)        576
+ *     small read packets     8 x (HCI_READ_PACKET_SMALL_SIZE + 16)  384
+ *     event park             HCI_EVT_PARK_SIZE                      132
+ *     transmit queue         HCI_TX_QUEUE_LEN x 136                 136
+ *     asynchronous requests  HCI_ASYNC_REQ_NUM_MAX x 160            320
+ *     rings, requests, stats                                        340
+ *     capture                HCI_SNOOP_RING_SIZE x 40                 0
+ *   bnrgm0, about 2.2 KB with the defaults:
+ *     notification queue     BNRGM0_NOTIFY_QUEUE_LEN (8) x 160     1280
+ *     coalescing             BNRGM0_COALESCE_MAX (4) x 172          688
+ *     stream, read permits, state                                   256
+ */
 /*---------- Scan Interval: time interval from when the Controller started its last scan until it begins the subsequent scan (for a number N, Time = N x 0.625 msec) -----------*/
 #define SCAN_P      16384
 /*---------- Scan Window: amount of time for the duration of the LE scan (for a number N, Time = N x 0.625 msec) -----------*/